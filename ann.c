@@ -0,0 +1,377 @@
+/*
+
+  Copyright (c) 1997-2025 Victor Lavrenko (v.lavrenko@gmail.com)
+
+  This file is part of YARI.
+
+  YARI is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  YARI is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YARI. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "matrix.h"
+#include "synq.h"
+#include "simd.h"
+#include "ann.h"
+
+/* -------------------- layout --------------------
+
+   file:  ann_hdr_t ; ids [n] ; lev [n] ; V [n x dim] ; L0 [n x (M0+1)] ;
+          upo [n] ; UP [nup]                    (each part padded to 8 bytes)
+
+   node u lives on layers 0..lev[u]. Its links on layer 0 are L0 + u*(M0+1),
+   on layer l > 0: UP + upo[u] + (l-1)*(M+1). The first uint is the count.
+
+   ----------------------------------------------- */
+
+#define ANN_MAGIC "YARIANN1"
+
+static inline float *vec_at (ann_t *A, uint u) { return A->V + (ulong) u * A->dim; }
+
+static inline float sim (ann_t *A, float *q, uint u) { return simd_dot (q, vec_at (A,u), A->dim); }
+
+static inline uint *links (ann_t *A, uint u, uint l) {
+  return l ? A->UP + A->upo[u] + (ulong) (l-1) * (A->M+1) : A->L0 + (ulong) u * (A->M0+1);
+}
+
+static void unit (float *F, uint dim) {
+  double s = simd_dot (F, F, dim), k; uint i;
+  if (s > 0) for (k = 1 / sqrt (s), i = 0; i < dim; ++i) F[i] *= k;
+}
+
+static uint row_dim (void *vec) { // dimensions spanned by a row
+  uint n = vec ? len(vec) : 0;
+  return !n ? 0 : (vesize(vec) == sizeof(float)) ? n : ((ix_t*)vec)[n-1].i;
+}
+
+float *dense_row (void *vec, uint dim) {
+  float *F = new_vec (dim, sizeof(float)); uint k, n = vec ? len(vec) : 0;
+  memset (F, 0, dim * sizeof(float));
+  if (n && vesize(vec) == sizeof(float)) memcpy (F, vec, MIN(n,dim) * sizeof(float));
+  else for (k = 0; k < n; ++k) {
+      ix_t *v = (ix_t*)vec + k;
+      if (v->i && v->i <= dim) F[v->i-1] = v->x;
+    }
+  return F;
+}
+
+// -------------------- heaps of (node, similarity) --------------------
+
+static ix_t *hpush (ix_t *H, uint i, float x) { // min-heap on x
+  ix_t e = {i, x}, t; uint k;
+  H = append_vec (H, &e);
+  for (k = len(H)-1; k && H[(k-1)/2].x > H[k].x; k = (k-1)/2) {
+    t = H[k]; H[k] = H[(k-1)/2]; H[(k-1)/2] = t; }
+  return H;
+}
+
+static ix_t hpop (ix_t *H) { // remove and return the smallest x
+  ix_t top = H[0], t; uint n = --len(H), k = 0, c;
+  H[0] = H[n];
+  while ((c = 2*k+1) < n) {
+    if (c+1 < n && H[c+1].x < H[c].x) ++c;
+    if (H[k].x <= H[c].x) break;
+    t = H[k]; H[k] = H[c]; H[c] = t; k = c;
+  }
+  return top;
+}
+
+// -------------------- per-thread search state --------------------
+
+typedef struct {
+  uint *seen, tag; // seen[u] == tag: u visited in the current search
+  ix_t *C, *R;     // candidates (max-heap, x negated), results (min-heap)
+  ix_t *S, *P;     // sorted results, pruning buffer
+  uint *nb, *sel;  // copy of a link list, selected links
+} scratch_t;
+
+static pthread_key_t SCRATCH_KEY;
+static pthread_once_t SCRATCH_ONCE = PTHREAD_ONCE_INIT;
+
+static void free_scratch (scratch_t *S) {
+  if (!S) return;
+  free_vec (S->seen); free_vec (S->C); free_vec (S->R);
+  free_vec (S->S); free_vec (S->P); free_vec (S->nb); free_vec (S->sel);
+  free (S);
+}
+
+static void scratch_key_init () { pthread_key_create (&SCRATCH_KEY, (void (*)(void*)) free_scratch); }
+
+// one search state per thread, sized for A, freed when the thread exits
+static scratch_t *thread_scratch (ann_t *A) {
+  pthread_once (&SCRATCH_ONCE, scratch_key_init);
+  scratch_t *S = pthread_getspecific (SCRATCH_KEY);
+  if (!S) {
+    S = safe_calloc (sizeof (scratch_t));
+    S->seen = new_vec (0, sizeof(uint));
+    S->C = new_vec (0, sizeof(ix_t)); S->R = new_vec (0, sizeof(ix_t));
+    S->S = new_vec (0, sizeof(ix_t)); S->P = new_vec (0, sizeof(ix_t));
+    S->nb = new_vec (0, sizeof(uint)); S->sel = new_vec (0, sizeof(uint));
+    pthread_setspecific (SCRATCH_KEY, S);
+  }
+  if (len(S->seen) < A->n) {
+    S->seen = resize_vec (S->seen, A->n);
+    memset (S->seen, 0, A->n * sizeof(uint)); S->tag = 0;
+  }
+  if (len(S->nb) < A->M0+2) {
+    S->nb = resize_vec (S->nb, A->M0+2); S->sel = resize_vec (S->sel, A->M0+2);
+    S->P = resize_vec (S->P, A->M0+2);
+  }
+  return S;
+}
+
+// -------------------- search --------------------
+
+// links of u on layer l, copied under the node lock while building
+static uint *get_links (ann_t *A, uint u, uint l, uint *nb) {
+  uint *L = links (A,u,l);
+  if (!A->lk) return L;
+  lock (A->lk+u);
+  memcpy (nb, L, (L[0]+1) * sizeof(uint));
+  unlock (A->lk+u);
+  return nb;
+}
+
+// walk layer l towards q while a neighbour is more similar, s = sim(q,u)
+static uint greedy (ann_t *A, scratch_t *S, float *q, uint u, float *s, uint l) {
+  uint changed = 1, k, *L;
+  while (changed) {
+    changed = 0;
+    L = get_links (A, u, l, S->nb);
+    for (k = 1; k <= L[0]; ++k) {
+      float x = sim (A, q, L[k]);
+      if (x > *s) { *s = x; u = L[k]; changed = 1; }
+    }
+  }
+  return u;
+}
+
+// best ef nodes on layer l reachable from the entry points already in S->R
+static void search_layer (ann_t *A, scratch_t *S, float *q, uint ef, uint l) {
+  uint k, *L;
+  if (!++S->tag) { memset (S->seen, 0, len(S->seen) * sizeof(uint)); S->tag = 1; }
+  len(S->C) = 0;
+  for (k = 0; k < len(S->R); ++k) {
+    S->C = hpush (S->C, S->R[k].i, -S->R[k].x);
+    S->seen[S->R[k].i] = S->tag;
+  }
+  while (len(S->C)) {
+    ix_t c = hpop (S->C);
+    if (len(S->R) >= ef && -c.x < S->R[0].x) break; // nothing closer left
+    L = get_links (A, c.i, l, S->nb);
+    for (k = 1; k <= L[0]; ++k) {
+      uint e = L[k];
+      if (k < L[0]) __builtin_prefetch (vec_at (A, L[k+1]));
+      if (S->seen[e] == S->tag) continue;
+      S->seen[e] = S->tag;
+      float x = sim (A, q, e);
+      if (len(S->R) < ef || x > S->R[0].x) {
+	S->C = hpush (S->C, e, -x);
+	S->R = hpush (S->R, e, x);
+	if (len(S->R) > ef) hpop (S->R);
+      }
+    }
+  }
+}
+
+ix_t *ann_query (ann_t *A, void *vec, uint top, uint ef) {
+  float *q = dense_row (vec, A->dim), s;
+  if (A->metric == 'c') unit (q, A->dim);
+  scratch_t *S = thread_scratch (A);
+  uint l, k, u = A->entry;
+  for (s = sim (A,q,u), l = A->top; l > 0; --l) u = greedy (A, S, q, u, &s, l);
+  len(S->R) = 0;
+  S->R = hpush (S->R, u, s);
+  search_layer (A, S, q, MAX(ef,top), 0);
+  while (len(S->R) > top) hpop (S->R);
+  ix_t *out = new_vec (len(S->R), sizeof(ix_t));
+  for (k = 0; k < len(out); ++k) out[k] = (ix_t) {A->ids[S->R[k].i], S->R[k].x};
+  sort_vec (out, cmp_ix_i);
+  free_vec (q);
+  return out;
+}
+
+// -------------------- build --------------------
+
+typedef struct {
+  ann_t *A;
+  uint efc; // candidate list size during construction
+} build_t;
+
+// keep a candidate only if it is more similar to the base node than to
+// every link kept so far (C sorted by decreasing similarity to the base)
+static uint select_links (ann_t *A, ix_t *C, uint nc, uint m, uint *out) {
+  uint k, j, n = 0;
+  for (k = 0; k < nc && n < m; ++k) {
+    float *c = vec_at (A, C[k].i);
+    for (j = 0; j < n; ++j) if (simd_dot (c, vec_at (A, out[j]), A->dim) > C[k].x) break;
+    if (j == n) out[n++] = C[k].i;
+  }
+  return n;
+}
+
+// link u from e on layer l, re-select e's links if the list is full
+static void add_link (ann_t *A, scratch_t *S, uint e, uint u, uint l) {
+  uint max = l ? A->M : A->M0, *L = links (A,e,l), k, n = 0;
+  float *ve = vec_at (A,e);
+  lock (A->lk+e);
+  if (L[0] < max) L[++L[0]] = u;
+  else {
+    for (k = 1; k <= L[0]; ++k) S->P[n++] = (ix_t) {L[k], sim (A, ve, L[k])};
+    S->P[n++] = (ix_t) {u, sim (A, ve, u)};
+    qsort (S->P, n, sizeof(ix_t), cmp_ix_X);
+    L[0] = select_links (A, S->P, n, max, L+1);
+  }
+  unlock (A->lk+e);
+}
+
+static int ann_insert (uint i, void *arg) {
+  build_t *B = arg; ann_t *A = B->A;
+  uint u = i+1, lu = A->lev[u], l, k, n, ep, top, *L;
+  float *q = vec_at (A,u), s;
+  lock (&A->glk); ep = A->entry; top = A->top; unlock (&A->glk);
+  scratch_t *S = thread_scratch (A);
+  for (s = sim (A,q,ep), l = top; l > lu; --l) ep = greedy (A, S, q, ep, &s, l);
+  len(S->R) = 0;
+  S->R = hpush (S->R, ep, s);
+  for (l = MIN(lu,top); ; --l) {
+    search_layer (A, S, q, B->efc, l);
+    S->S = resize_vec (S->S, len(S->R));
+    memcpy (S->S, S->R, len(S->R) * sizeof(ix_t));
+    sort_vec (S->S, cmp_ix_X);
+    n = select_links (A, S->S, len(S->S), A->M, S->sel);
+    L = links (A,u,l);
+    lock (A->lk+u);
+    memcpy (L+1, S->sel, n * sizeof(uint)); L[0] = n;
+    unlock (A->lk+u);
+    for (k = 0; k < n; ++k) add_link (A, S, S->sel[k], u, l);
+    if (!l) break;
+  }
+  if (lu > top) {
+    lock (&A->glk);
+    if (lu > A->top) { A->top = lu; A->entry = u; }
+    unlock (&A->glk);
+  }
+  return 0;
+}
+
+static uint draw_level (uint u, double mL) { // -ln(U(0,1)) * mL, hashed from u
+  ulong z = (u + 1) * 0x9E3779B97F4A7C15lu;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9lu;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBlu;
+  z ^= z >> 31;
+  double r = ((z >> 11) + 0.5) / (double) (1lu << 53);
+  return MIN (-log (r) * mL, 30);
+}
+
+static void put_part (int fd, void *buf, ulong sz) {
+  char zero[8] = {0};
+  if (sz) safe_write (fd, buf, sz);
+  if (sz & 7) safe_write (fd, zero, 8 - (sz & 7));
+}
+
+static void write_ann (ann_t *A, char *path) {
+  ann_hdr_t H = {ANN_MAGIC, A->n, A->dim, A->M, A->M0, A->top, A->entry, A->metric, 0, A->nup};
+  ulong n = A->n;
+  int fd = safe_open (path, "w");
+  put_part (fd, &H, sizeof(H));
+  put_part (fd, A->ids, n * sizeof(uint));
+  put_part (fd, A->lev, n);
+  put_part (fd, A->V, n * A->dim * sizeof(float));
+  put_part (fd, A->L0, n * (A->M0+1) * sizeof(uint));
+  put_part (fd, A->upo, n * sizeof(ulong));
+  put_part (fd, A->UP, A->nup * sizeof(uint));
+  close (fd);
+}
+
+void ann_build (char *path, coll_t *X, char *prm) {
+  uint M = getprm (prm,"M=",16), efc = getprm (prm,"efc=",200);
+  uint nt = MAX(1, getprm (prm,"threads=",1)), id, u = 0, n = 0, dim = 0, N = nvecs (X);
+  char metric = strstr (prm,"dot") ? 'd' : 'c';
+  double mL = 1 / log (MAX(M,2));
+  for (id = 1; id <= N; ++id) { // rows and dimensions
+    void *row = !has_vec (X,id) ? NULL : has_dense (X,id) ? get_dense_ro (X,id) : get_vec_ro (X,id);
+    if (row && len(row)) { ++n; dim = MAX (dim, row_dim (row)); }
+  }
+  assert (n && dim);
+  ann_t *A = safe_calloc (sizeof (ann_t));
+  A->n = n; A->dim = dim; A->M = M; A->M0 = 2*M; A->metric = metric;
+  A->ids = safe_calloc (n * sizeof(uint));
+  A->lev = safe_calloc (n);
+  A->upo = safe_calloc (n * sizeof(ulong));
+  A->V = safe_calloc ((ulong) n * dim * sizeof(float));
+  fprintf (stderr, "[%.0fs] %s: indexing %d rows [%d dims], M=%d, efc=%d, %s, %d threads\n",
+	   vtime(), path, n, dim, M, efc, (metric == 'c' ? "cosine" : "dot"), nt);
+  for (id = 1; id <= N; ++id) { // vectors and levels
+    void *row = !has_vec (X,id) ? NULL : has_dense (X,id) ? get_dense_ro (X,id) : get_vec_ro (X,id);
+    if (!row || !len(row)) continue;
+    float *F = dense_row (row, dim);
+    if (metric == 'c') unit (F, dim);
+    memcpy (vec_at (A,u), F, dim * sizeof(float));
+    free_vec (F);
+    A->ids[u] = id;
+    A->lev[u] = draw_level (u, mL);
+    A->upo[u] = A->nup;
+    A->nup += A->lev[u] * (M+1);
+    ++u;
+  }
+  A->L0 = safe_calloc ((ulong) n * (A->M0+1) * sizeof(uint));
+  A->UP = safe_calloc (A->nup * sizeof(uint) + 1);
+  A->lk = safe_calloc (n * sizeof(int));
+  A->entry = 0; A->top = A->lev[0];
+  build_t B = {A, MAX(efc,M)};
+  parallel (nt, n-1, ann_insert, &B, " rows indexed");
+  write_ann (A, path);
+  fprintf (stderr, "[%.0fs] %s: %d layers, %.0fMB\n", vtime(), path, A->top+1,
+	   (n * (sizeof(uint) + 1 + sizeof(ulong) + (dim + A->M0+1) * 4.) + A->nup * 4.) / (1<<20));
+  free_ann (A);
+}
+
+// -------------------- open / free --------------------
+
+ann_t *open_ann (char *path) {
+  int fd = safe_open (path, "r");
+  off_t size = safe_lseek (fd, 0, SEEK_END);
+  char *p = safe_mmap (fd, 0, size, "r");
+  close (fd);
+  ann_hdr_t *H = (ann_hdr_t*) p;
+  if (size < (off_t) sizeof(*H) || memcmp (H->magic, ANN_MAGIC, 8)) {
+    fprintf (stderr, "[open_ann] %s is not an ANN index\n", path); assert (0); }
+  ann_t *A = safe_calloc (sizeof (ann_t));
+  ulong n = H->n;
+  A->hdr = H; A->size = size;
+  A->n = H->n; A->dim = H->dim; A->M = H->M; A->M0 = H->M0;
+  A->top = H->top; A->entry = H->entry; A->metric = H->metric; A->nup = H->nup;
+  p += align8 (sizeof(*H));
+  A->ids = (uint*) p;  p += align8 (n * sizeof(uint));
+  A->lev = (uchar*) p; p += align8 (n);
+  A->V = (float*) p;   p += align8 (n * A->dim * sizeof(float));
+  A->L0 = (uint*) p;   p += align8 (n * (A->M0+1) * sizeof(uint));
+  A->upo = (ulong*) p; p += n * sizeof(ulong);
+  A->UP = (uint*) p;   p += align8 (A->nup * sizeof(uint));
+  assert (p == (char*) H + size);
+  return A;
+}
+
+void free_ann (ann_t *A) {
+  if (!A) return;
+  if (A->hdr) munmap (A->hdr, A->size);
+  else {
+    free (A->ids); free (A->lev); free (A->upo); free (A->V);
+    free (A->L0); free (A->UP); free ((void*) A->lk);
+  }
+  free (A);
+}
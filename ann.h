@@ -0,0 +1,68 @@
+/*
+
+  Copyright (c) 1997-2025 Victor Lavrenko (v.lavrenko@gmail.com)
+
+  This file is part of YARI.
+
+  YARI is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  YARI is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YARI. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "coll.h"
+
+#ifndef ANN
+#define ANN
+
+// Approximate nearest neighbours (HNSW graph) over the rows of a dense
+// collection: rows are float[] (as written by embed_coll) or dense ix_t,
+// ix_t id j+1 is float [j] as in emb2vec.
+// The index is one file: header, row ids, levels, vectors, links. It is
+// built in memory and searched through a read-only mmap.
+// Similarity is cosine (rows and queries L2-normalised) or raw dot product.
+
+typedef struct {
+  char  magic[8]; // "YARIANN1"
+  uint  n;        // number of indexed rows
+  uint  dim;      // dimensions
+  uint  M;        // max links per node on upper layers
+  uint  M0;       // max links per node on layer 0
+  uint  top;      // highest layer
+  uint  entry;    // entry node (on the highest layer)
+  uint  metric;   // 'c': cosine, 'd': dot product
+  uint  pad;
+  ulong nup;      // uints in the upper-layer link area
+} ann_hdr_t;
+
+typedef struct {
+  ann_hdr_t *hdr; // mapped file, or NULL while building
+  ulong size;     // bytes mapped
+  uint  n, dim, M, M0, metric;
+  volatile uint top, entry;
+  uint  *ids;     // ids[node] = row in the source collection
+  uchar *lev;     // lev[node] = highest layer of the node
+  float *V;       // V[node*dim .. +dim] = vector
+  uint  *L0;      // L0[node*(M0+1)] = count, then links on layer 0
+  ulong *upo;     // upo[node] = offset of its upper links in UP
+  uint  *UP;      // per node: lev x (M+1) = count, then links
+  ulong nup;      // uints in UP
+  volatile int *lk, glk; // build only: per-node and global spinlocks
+} ann_t;
+
+void   ann_build  (char *path, coll_t *X, char *prm) ; // prm: M=16,efc=200,threads=1,dot
+ann_t *open_ann   (char *path) ;
+void   free_ann   (ann_t *A) ;
+ix_t  *ann_query  (ann_t *A, void *vec, uint top, uint ef) ; // thread-safe; x = similarity
+float *dense_row  (void *vec, uint dim) ; // float[] or ix_t[] row -> float[dim]
+
+#endif
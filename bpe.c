@@ -5,13 +5,24 @@ int load_tokens (char *out, char *hash) {
   ulong NR = 0;
   ushort *O = open_vec (out, "w", sizeof(ushort));
   hash_t *H = open_hash (hash, "r");
-  char tok[1000];
-  while (fgets (tok, 999, stdin)) {
-    noeol(tok); // strip newline
-    ushort id = key2id(H,tok);
-    if (id) O = append_vec (O, &id);
-    if (((++NR)>>20) & 1) show_progress ((NR>>20), 0, "M tokens"); 
+  char tok[1000], **T = new_vec (0, sizeof(char*));
+  uint *I = new_vec (1<<16, sizeof(uint)), k;
+  while (1) {
+    for (len(T) = 0; len(T) < len(I) && fgets (tok, 999, stdin); ) {
+      noeol(tok); // strip newline
+      char *t = strdup (tok);
+      T = append_vec (T, &t);
+    }
+    if (!len(T)) break;
+    key2id_batch (H, T, len(T), I, 1); // one block of tokens
+    for (k = 0; k < len(T); ++k) {
+      ushort id = I[k];
+      if (id) O = append_vec (O, &id);
+      if (((++NR)>>20) & 1) show_progress ((NR>>20), 0, "M tokens");
+      free (T[k]);
+    }
   }
+  free_vec (T); free_vec (I);
   fprintf(stderr, "\nDONE: %ld tokens -> %s\n", NR, out);
   free_vec(O);
   free_hash(H);
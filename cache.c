@@ -20,3 +20,285 @@
 */
 #include "cache.h"
 
+#include "synq.h"
+
+cache_t *new_cache (uint max, ulong cap, void (*free)(void*),
+		    void *(*copy)(void*), ulong (*size)(void*)) {
+  cache_t *C = calloc (1, sizeof (cache_t));
+  C->keys = open_hash_inmem ();
+  C->queue = new_vec (MAX(max,1), sizeof(uint));
+  C->values = new_vec (1, sizeof(void*));
+  C->bytes = new_vec (1, sizeof(ulong));
+  C->ref = new_vec (1, sizeof(char));
+  C->free = free;
+  C->copy = copy;
+  C->size = size;
+  C->cap = cap;
+  return C;
+}
+
+void free_cache (cache_t *C) {
+  if (!C) return;
+  cache_clear (C);
+  free_hash (C->keys);
+  free_vec (C->queue);
+  free_vec (C->values);
+  free_vec (C->bytes);
+  free_vec (C->ref);
+  memset (C, 0, sizeof (cache_t));
+  free (C);
+}
+
+// make sure per-slot arrays cover slot s
+static void chk_slot (cache_t *C, uint s) {
+  if (s < len(C->values)) return;
+  C->values = resize_vec (C->values, s+1);
+  C->bytes = resize_vec (C->bytes, s+1);
+  C->ref = resize_vec (C->ref, s+1);
+}
+
+// drop the value in queue position p
+static void evict (cache_t *C, uint p) {
+  uint s = C->queue[p];
+  if (!s) return;
+  C->free (C->values[s]);
+  C->used -= C->bytes[s];
+  C->values[s] = NULL;
+  C->bytes[s] = C->ref[s] = 0;
+  C->queue[p] = 0;
+  C->count--;
+}
+
+// CLOCK: skip (and un-reference) recently used values, evict the first
+// unreferenced one, return its position in the queue
+static uint victim (cache_t *C) {
+  uint n = len(C->queue);
+  while (1) {
+    uint p = C->hand, s = C->queue[p];
+    C->hand = (p+1) % n;
+    if (s && C->ref[s]) { C->ref[s] = 0; continue; }
+    if (s) { evict (C, p); C->evictions++; }
+    return p;
+  }
+}
+
+// a free position in the queue, evicts only if every position is taken
+static uint free_pos (cache_t *C) {
+  uint n = len(C->queue), p;
+  if (C->count >= n) return victim (C);
+  for (p = C->hand; C->queue[p]; p = (p+1) % n);
+  return p;
+}
+
+// evicted keys stay in the hash: rebuild it when most of them are stale
+static void compact (cache_t *C) {
+  uint n = len(C->queue), p;
+  if (nkeys(C->keys) < 4 * n + 1000) return;
+  hash_t *H = open_hash_inmem ();
+  void **V = new_vec (C->count+1, sizeof(void*));
+  ulong *B = new_vec (C->count+1, sizeof(ulong));
+  char *R = new_vec (C->count+1, sizeof(char));
+  for (p = 0; p < n; ++p) {
+    uint s = C->queue[p], t;
+    if (!s) continue;
+    C->queue[p] = t = key2id (H, id2key (C->keys, s));
+    V[t] = C->values[s]; B[t] = C->bytes[s]; R[t] = C->ref[s];
+  }
+  free_hash (C->keys); free_vec (C->values); free_vec (C->bytes); free_vec (C->ref);
+  C->keys = H; C->values = V; C->bytes = B; C->ref = R;
+}
+
+void *cache_get (cache_t *C, char *key) {
+  void *val = NULL;
+  lock (&C->busy);
+  uint s = has_key (C->keys, key);
+  if (s && s < len(C->values) && C->values[s]) {
+    val = C->copy (C->values[s]);
+    C->ref[s] = 1;
+    C->hits++;
+  } else C->misses++;
+  unlock (&C->busy);
+  return val;
+}
+
+void cache_put (cache_t *C, char *key, void *value) {
+  ulong sz = C->size (value);
+  if (C->cap && sz > C->cap) { C->free (value); return; } // would flush all
+  lock (&C->busy);
+  uint s = has_key (C->keys, key), p;
+  if (s && s < len(C->values) && C->values[s]) { // raced with another put
+    for (p = 0; C->queue[p] != s; ++p);
+    evict (C, p);
+  }
+  while (C->cap && C->count && C->used + sz > C->cap) evict (C, victim (C));
+  p = free_pos (C);
+  compact (C);
+  s = key2id (C->keys, key);
+  chk_slot (C, s);
+  C->queue[p] = s;
+  C->values[s] = value;
+  C->bytes[s] = sz;
+  C->ref[s] = 0;
+  C->used += sz;
+  C->count++;
+  unlock (&C->busy);
+}
+
+static void clear_all (cache_t *C) {
+  uint p, n = len(C->queue);
+  for (p = 0; p < n; ++p) evict (C, p);
+  C->hand = 0;
+}
+
+void cache_clear (cache_t *C) {
+  lock (&C->busy);
+  clear_all (C);
+  unlock (&C->busy);
+}
+
+int cache_stamp (cache_t *C, time_t stamp) {
+  if (C->stamp == stamp) return 0;
+  lock (&C->busy);
+  int changed = (C->stamp != stamp);
+  if (changed && C->stamp) clear_all (C);
+  C->stamp = stamp;
+  unlock (&C->busy);
+  return changed;
+}
+
+void show_cache (cache_t *C, char *name) {
+  ulong n = C->hits + C->misses;
+  fprintf (stderr, "[%s] %u values %.1fMB, %lu hits %lu misses (%.0f%%) %lu evicted\n",
+	   name, C->count, C->used/1E6, C->hits, C->misses,
+	   n ? 100. * C->hits / n : 0, C->evictions);
+}
+
+// ------------------------- hot vectors -------------------------
+
+hot_t *new_hot (ulong cap, uint nids) {
+  hot_t *H = calloc (1, sizeof (hot_t));
+  uint w = 1 << 10;
+  while (w < nids && w < (1<<22)) w <<= 1;
+  H->width = w;
+  H->cms = new_vec (4 * w, sizeof(uchar));
+  H->slot = new_vec (nids+1, sizeof(hent_t*));
+  H->ref = new_vec (nids+1, sizeof(char));
+  H->res = new_vec (0, sizeof(uint));
+  H->cap = cap;
+  return H;
+}
+
+void free_hot (hot_t *H) {
+  if (!H) return;
+  uint i;
+  for (i = 0; i < len(H->res); ++i) {
+    hent_t *e = H->slot[H->res[i]];
+    free_vec (e->vec); free (e);
+  }
+  free_vec (H->slot); free_vec (H->ref); free_vec (H->res); free_vec (H->cms);
+  memset (H, 0, sizeof (hot_t));
+  free (H);
+}
+
+static inline uint cms_cell (hot_t *H, uint id, uint k) { // row k
+  return k * H->width + (murmur3uint (id ^ (k * 0x9e3779b9)) & (H->width - 1));
+}
+
+// count one request for id, halve all counts every 10*width requests
+static void cms_add (hot_t *H, uint id) {
+  uint k, i;
+  for (k = 0; k < 4; ++k) if (H->cms [i = cms_cell (H, id, k)] < 255) H->cms[i]++;
+  if (++H->seen < 10 * H->width) return;
+  for (i = 0; i < len(H->cms); ++i) H->cms[i] >>= 1;
+  H->seen = 0;
+}
+
+static uint cms_freq (hot_t *H, uint id) {
+  uint k, f = 255;
+  for (k = 0; k < 4; ++k) f = MIN (f, H->cms [cms_cell (H, id, k)]);
+  return f;
+}
+
+static void hot_slots (hot_t *H, uint id) {
+  if (id < len(H->slot)) return;
+  H->slot = resize_vec (H->slot, id+1);
+  H->ref = resize_vec (H->ref, id+1);
+}
+
+// CLOCK: position in res of the first pinned vector not used recently
+static uint hot_victim (hot_t *H) {
+  uint n = len(H->res);
+  while (1) {
+    uint p = H->hand % n, id = H->res[p];
+    H->hand = p + 1;
+    if (!H->ref[id]) return p;
+    H->ref[id] = 0;
+  }
+}
+
+// unpin res[p]: freed now, or by the last put_hot
+static void hot_evict (hot_t *H, uint p) {
+  uint id = H->res[p];
+  hent_t *e = H->slot[id];
+  H->slot[id] = NULL;
+  H->res[p] = H->res[len(H->res)-1]; len(H->res)--;
+  H->used -= e->bytes;
+  H->evictions++;
+  if (e->refs) e->gone = 1;
+  else { free_vec (e->vec); free (e); }
+}
+
+// pin e unless the vectors it would displace were requested as often
+static int hot_admit (hot_t *H, hent_t *e) {
+  if (e->bytes > H->cap) return 0;
+  uint f = cms_freq (H, e->id);
+  while (H->used + e->bytes > H->cap) {
+    uint p = hot_victim (H);
+    if (cms_freq (H, H->res[p]) >= f) return 0;
+    hot_evict (H, p);
+  }
+  H->slot[e->id] = e;
+  H->res = append_vec (H->res, &(e->id));
+  H->used += e->bytes;
+  return 1;
+}
+
+ix_t *get_hot (hot_t *H, coll_t *c, uint id, void **pin) {
+  *pin = NULL;
+  if (!H) return get_vec_ro (c, id);
+  ix_t *V = get_vec_view (c, id); // already zero-copy: nothing to pin
+  if (V) { atomic_fetch_add_explicit (&H->views, 1, memory_order_relaxed); return V; }
+  lock (&H->busy);
+  cms_add (H, id);
+  hot_slots (H, id);
+  hent_t *e = H->slot[id];
+  if (e) { e->refs++; H->ref[id] = 1; H->hits++; }
+  else H->misses++;
+  unlock (&H->busy);
+  if (e) return *pin = e, e->vec;
+  e = calloc (1, sizeof (hent_t));
+  e->vec = get_vec_mp (c, id);
+  e->bytes = sizeof(vec_t) + len(e->vec) * sizeof(ix_t);
+  e->id = id;
+  e->refs = 1;
+  lock (&H->busy);
+  if (H->slot[id] || !hot_admit (H, e)) { e->gone = 1; H->rejects++; } // private copy
+  unlock (&H->busy);
+  return *pin = e, e->vec;
+}
+
+void put_hot (hot_t *H, void *pin) {
+  hent_t *e = pin;
+  if (!e) return;
+  lock (&H->busy);
+  uint last = (--e->refs == 0) && e->gone;
+  unlock (&H->busy);
+  if (last) { free_vec (e->vec); free (e); }
+}
+
+void show_hot (hot_t *H, char *name) {
+  ulong n = H->hits + H->misses;
+  fprintf (stderr, "[%s] %u pinned %.1f/%.1fMB, %lu hits %lu misses (%.0f%%) %lu rejected %lu evicted %lu zero-copy\n",
+	   name, len(H->res), H->used/1E6, H->cap/1E6, H->hits, H->misses,
+	   n ? 100. * H->hits / n : 0, H->rejects, H->evictions, (ulong) H->views);
+}
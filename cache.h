@@ -19,16 +19,77 @@
 
 */
 
-#include "coll.h"
+#include <stdatomic.h>
+#include "hash.h"
 
 #ifndef CACHE
 #define CACHE
 
+// Bounded key -> value cache with CLOCK (second-chance) eviction.
+// Keeps at most max values and at most cap bytes of them (per size()).
+// Values are owned by the cache: cache_get hands out copy(value).
+// All calls are thread-safe (one spinlock per cache).
+
 typedef struct {
-  hash_t *keys;
-  uint *queue;
-  void **values;
+  hash_t *keys;   // key -> slot, in-memory, compacted when mostly stale
+  uint *queue;    // CLOCK ring: queue[pos] = slot, 0 = empty position
+  void **values;  // values[slot], NULL if not cached
   void (*free)(void*); // function to deallocate values
+  void *(*copy)(void*); // function to copy values for the caller
+  ulong (*size)(void*); // bytes held by a value
+  ulong *bytes;   // bytes[slot]
+  char *ref;      // ref[slot]: CLOCK reference bit
+  uint hand;      // next position in queue to look at
+  uint count;     // number of cached values
+  ulong used;     // bytes held by cached values
+  ulong cap;      // limit on used (0 = none)
+  time_t stamp;   // source timestamp, see cache_stamp
+  ulong hits, misses, evictions;
+  volatile int busy; // lock
 } cache_t;
 
+cache_t *new_cache (uint max, ulong cap, void (*free)(void*),
+		    void *(*copy)(void*), ulong (*size)(void*)) ;
+void free_cache (cache_t *C) ;
+void *cache_get (cache_t *C, char *key) ; // copy of cached value, or NULL
+void cache_put (cache_t *C, char *key, void *value) ; // cache owns value
+void cache_clear (cache_t *C) ; // drop all values, keep counters
+int cache_stamp (cache_t *C, time_t stamp) ; // clear if stamp changed
+void show_cache (cache_t *C, char *name) ; // counters -> stderr
+
+// Decoded vectors of a coll (e.g. postings of WORDxDOC) pinned in memory
+// under a byte budget. TinyLFU admission: a new vector displaces CLOCK
+// victims only if it was requested more often (count-min sketch of
+// recent requests, halved every 10 * width requests). Callers get
+// read-only views, valid until put_hot (pin).
+
+typedef struct {
+  ix_t *vec;  // decoded vector
+  ulong bytes;
+  uint id;
+  uint refs;  // views handed out and not yet released
+  char gone;  // evicted: free when refs drops to 0
+} hent_t;
+
+typedef struct {
+  hent_t **slot;  // slot[id]: pinned vector, or NULL
+  uint *res;      // ids of pinned vectors, CLOCK order
+  char *ref;      // ref[id]: CLOCK reference bit
+  uchar *cms;     // count-min sketch: 4 rows of width counters
+  uint width;     // power of 2
+  uint seen;      // requests since the last halving
+  uint hand;
+  ulong used, cap; // bytes pinned, budget
+  ulong hits, misses, rejects, evictions;
+  _Atomic ulong views; // plain lists of an "rs" coll: zero-copy, never cached
+  volatile int busy; // lock
+} hot_t;
+
+hot_t *new_hot (ulong cap, uint nids) ; // nids: expected number of ids
+void free_hot (hot_t *H) ;
+// read-only view of c[id]: pinned, or shared mmap, or a private copy
+ix_t *get_hot (hot_t *H, coll_t *c, uint id, void **pin) ; // H=0: get_vec_ro
+void put_hot (hot_t *H, void *pin) ; // release a view from get_hot
+void show_hot (hot_t *H, char *name) ; // counters -> stderr
+
 #endif
@@ -22,6 +22,8 @@
 #include "math.h"
 #include "cluster.h"
 #include "hl.h"
+#include "simd.h"
+#include "synq.h"
 
 // ------------------------- sims -------------------------
 
@@ -313,6 +315,219 @@ void cluster_signatures (coll_t *KxW) {
 }
 
 
+// ------------------------- dense k-means -------------------------
+
+// Spherical k-means: docs are L2-normalised on the fly, centroids are
+// unit-length dense float arrays, similarity is the dot product.
+// Centroids are stored word-major in blocks of KB clusters: row w of
+// block b holds KB floats, so a doc's scores for one block stay in L1
+// while simd_axpy adds one contiguous row per word in the doc.
+
+typedef struct {
+  coll_t *DxW;
+  uint D, W, K, KB, nb; // docs, words, clusters, clusters per block, blocks
+  float *C;      // centroids, see km_row
+  float **S;     // S[t]: sum of docs assigned in thread t, same layout
+  uint **N;      // N[t][k]: number of docs assigned to k in thread t
+  double *aff;   // aff[t]: sum of similarities in thread t
+  ulong *seen;   // seen[k]: docs assigned to k so far (mini-batch rate)
+  jix_t *A;      // A[d] = {j:cluster, i:doc, x:similarity}
+  uint *docs;    // docs for this pass, NULL: all
+  uint nd, nt;   // docs in this pass, threads
+  char batch;    // mini-batch update
+} km_t;
+
+static inline float *km_row (km_t *M, float *C, uint b, uint w) {
+  return C + ((ulong) b * (M->W+1) + w) * M->KB;
+}
+
+// best centroid for doc (in s: KB scratch floats), returns similarity
+static float km_best (km_t *M, ix_t *doc, float *s, uint *best) {
+  float bx = -Infinity; uint b, k;
+  for (b = 0; b < M->nb; ++b) {
+    uint nk = MIN (M->KB, M->K - b * M->KB);
+    memset (s, 0, M->KB * sizeof(float));
+    for (ix_t *v = doc; v < doc + len(doc); ++v)
+      if (v->i <= M->W) simd_axpy (v->x, km_row (M, M->C, b, v->i), s, nk);
+    for (k = 0; k < nk; ++k) if (s[k] > bx) { bx = s[k]; *best = b * M->KB + k; }
+  }
+  return bx;
+}
+
+// thread t: assign its share of docs, add them to S[t]
+static int km_assign (uint t, void *arg) {
+  km_t *M = arg;
+  float *s = new_vec (M->KB, sizeof(float)), *S = M->S[t];
+  uint i, lo = (ulong) M->nd * t / M->nt, hi = (ulong) M->nd * (t+1) / M->nt;
+  for (i = lo; i < hi; ++i) {
+    uint d = M->docs ? M->docs[i] : i+1, k = 0;
+    ix_t *doc = get_vec_mp (M->DxW, d), *v;
+    double n = sqrt (sum2 (doc));
+    if (n > 0) {
+      float x = km_best (M, doc, s, &k) / n;
+      uint b = k / M->KB, kb = k % M->KB;
+      M->A[d] = (jix_t) {k+1, d, x};
+      for (v = doc; v < doc + len(doc); ++v)
+	if (v->i <= M->W) km_row (M, S, b, v->i) [kb] += v->x / n;
+      M->N[t][k]++;
+      M->aff[t] += x;
+    }
+    free_vec (doc);
+  }
+  free_vec (s);
+  return 0;
+}
+
+// block b: merge thread sums into new centroids, renormalise
+// full pass: c = sum of assigned docs; mini-batch: c moves towards the
+// mean of the batch by n/seen (n: docs in batch, seen: docs so far)
+static int km_update (uint b, void *arg) {
+  km_t *M = arg;
+  uint KB = M->KB, k, t, w, nk = MIN (KB, M->K - b * KB);
+  double *norm = calloc (KB, sizeof(double));
+  float *keep = calloc (KB, sizeof(float)), *step = calloc (KB, sizeof(float));
+  for (k = 0; k < nk; ++k) {
+    ulong n = 0, *seen = M->seen + b*KB + k;
+    for (t = 0; t < M->nt; ++t) n += M->N[t][b*KB+k];
+    *seen += n;
+    if (!n) { keep[k] = 1; step[k] = 0; } // no docs: old centroid
+    else if (M->batch) { keep[k] = 1 - (double) n / *seen; step[k] = 1. / *seen; }
+    else { keep[k] = 0; step[k] = 1; }
+  }
+  for (w = 1; w <= M->W; ++w) {
+    float *c = km_row (M, M->C, b, w);
+    for (k = 0; k < nk; ++k) c[k] *= keep[k];
+    for (t = 0; t < M->nt; ++t) {
+      float *s = km_row (M, M->S[t], b, w);
+      for (k = 0; k < nk; ++k) c[k] += step[k] * s[k];
+      memset (s, 0, KB * sizeof(float));
+    }
+    for (k = 0; k < nk; ++k) norm[k] += c[k] * c[k];
+  }
+  for (k = 0; k < nk; ++k) norm[k] = norm[k] ? 1 / sqrt (norm[k]) : 0;
+  for (w = 1; w <= M->W; ++w) {
+    float *c = km_row (M, M->C, b, w);
+    for (k = 0; k < nk; ++k) c[k] *= norm[k];
+  }
+  free (norm); free (keep); free (step);
+  return 0;
+}
+
+// centroid k = doc d (L2-normalised)
+static void km_seed (km_t *M, uint k, ix_t *doc) {
+  double n = sqrt (sum2 (doc)); ix_t *v;
+  for (v = doc; v < doc + len(doc); ++v)
+    if (v->i <= M->W) km_row (M, M->C, k / M->KB, v->i) [k % M->KB] = v->x / n;
+}
+
+// K random non-empty docs as seeds
+static void km_seed_random (km_t *M) {
+  uint k, tries = 0;
+  for (k = 0; k < M->K && tries < 100 * M->K; ++tries) {
+    ix_t *doc = get_vec_mp (M->DxW, 1 + random() % M->D);
+    if (len(doc) && sum2 (doc) > 0) km_seed (M, k++, doc);
+    free_vec (doc);
+  }
+}
+
+// k-means++: seeds from a sample of docs, each picked with probability
+// proportional to its squared distance from the nearest seed so far
+static void km_seed_pp (km_t *M, uint ns) {
+  uint i, k, tries = 0;
+  ix_t **X = new_vec (0, sizeof(ix_t*));
+  while (len(X) < ns && tries++ < 100 * ns) { // sample of non-empty docs
+    uint d = 1 + random() % M->D;
+    ix_t *doc = get_vec_mp (M->DxW, d);
+    double n = sqrt (sum2 (doc));
+    if (n > 0) { vec_x_num (doc, '/', n); X = append_vec (X, &doc); }
+    else free_vec (doc);
+  }
+  if (!(ns = len(X))) { free_vec (X); return km_seed_random (M); } // (nearly) all empty
+  float *near = new_vec (ns, sizeof(float)), *F = new_vec (M->W+1, sizeof(float));
+  for (i = 0; i < ns; ++i) near[i] = -1; // cosine to the nearest seed
+  ix_t *seed = X [random() % ns];
+  for (k = 0; k < M->K; ++k) {
+    km_seed (M, k, seed);
+    for (ix_t *v = seed; v < seed + len(seed); ++v) if (v->i <= M->W) F[v->i] = v->x;
+    double total = 0;
+    for (i = 0; i < ns; ++i) { // ||x-c||^2 = 2 - 2 cos for unit x,c
+      float x = simd_gather (X[i], len(X[i]), F);
+      if (x > near[i]) near[i] = MIN (x, 1); // rounding: keep D^2 >= 0
+      total += 2 - 2*near[i];
+    }
+    for (ix_t *v = seed; v < seed + len(seed); ++v) if (v->i <= M->W) F[v->i] = 0;
+    double r = rnd() * total;
+    if (total > 0) for (i = 0; i < ns-1; ++i) { if ((r -= 2 - 2*near[i]) <= 0) break; }
+    else i = random() % ns; // every doc sits on a seed
+    seed = X[i];
+    if (!(k % 100)) show_progress (k, M->K, " k-means++ seeds");
+  }
+  free_2D ((void**)X); free_vec (near); free_vec (F);
+}
+
+// k=10,iter=10,threads=1: spherical k-means over rows of DxW, read in
+// parallel chunks. KxD[k,d] = cosine of doc d to its centroid k. KxW:
+// centroids (optional). pp: k-means++ seeding over sample=20000 docs,
+// batch=B: mini-batch k-means, B random docs per iteration, then one
+// pass over all docs to assign them. KB=256: clusters per block.
+// Each thread sums its own share of docs, so float rounding (and, near a
+// tie, an assignment) can differ with the number of threads.
+void k_means_dense (coll_t *DxW, coll_t *KxD, coll_t *KxW, char *prm) {
+  km_t M; memset (&M, 0, sizeof (km_t));
+  uint iter = getprm (prm,"iter=",10), batch = getprm (prm,"batch=",0), i, t, it;
+  M.DxW = DxW; M.D = num_rows (DxW); M.W = num_cols (DxW);
+  M.K = MAX (1, getprm (prm,"k=",10));
+  M.KB = MIN (M.K, getprm (prm,"KB=",256));
+  M.KB = (M.KB + 7) & ~7; // whole SIMD vectors
+  M.nb = (M.K + M.KB - 1) / M.KB;
+  M.nt = MAX (1, getprm (prm,"threads=",1));
+  M.batch = batch > 0;
+  ulong cells = (ulong) M.nb * (M.W+1) * M.KB;
+  fprintf (stderr, "k-means: %s [%dx%d] -> %d clusters, %d threads, %.1fGB of centroids\n",
+	   DxW->path, M.D, M.W, M.K, M.nt, (M.nt+1) * cells * sizeof(float) / 1E9);
+  M.C = calloc (cells, sizeof(float));
+  M.S = new_vec (M.nt, sizeof(float*));
+  M.N = new_vec (M.nt, sizeof(uint*));
+  for (t = 0; t < M.nt; ++t) {
+    M.S[t] = calloc (cells, sizeof(float));
+    M.N[t] = new_vec (M.K, sizeof(uint));
+  }
+  M.aff = new_vec (M.nt, sizeof(double));
+  M.seen = new_vec (M.K, sizeof(ulong));
+  M.A = new_vec (M.D+1, sizeof(jix_t));
+  if (strstr (prm,"pp")) km_seed_pp (&M, MIN (M.D, MAX (M.K, getprm (prm,"sample=",20000))));
+  else km_seed_random (&M);
+  if (batch) M.docs = new_vec (batch, sizeof(uint));
+  for (it = 1; it <= iter; ++it) {
+    if (batch) for (i = 0; i < batch; ++i) M.docs[i] = 1 + random() % M.D;
+    M.nd = batch ? batch : M.D;
+    for (t = 0; t < M.nt; ++t) { memset (M.N[t], 0, M.K * sizeof(uint)); M.aff[t] = 0; }
+    parallel (M.nt, M.nt, km_assign, &M, NULL);
+    parallel (M.nt, M.nb, km_update, &M, NULL);
+    double aff = 0; for (t = 0; t < M.nt; ++t) aff += M.aff[t];
+    fprintf (stderr, "[%.0fs] iteration %d: affinity %.4f\n", vtime(), it, aff / M.nd);
+  }
+  if (batch) { // final assignment of all docs, centroids unchanged
+    free_vec (M.docs); M.docs = NULL; M.nd = M.D;
+    parallel (M.nt, M.nt, km_assign, &M, NULL);
+  }
+  sort_vec (M.A, cmp_jix);
+  chop_jix (M.A); // empty docs
+  append_jix (KxD, M.A);
+  if (KxW) for (i = 0; i < M.K; ++i) { // dense centroid -> sparse row
+    ix_t *vec = new_vec (0, sizeof(ix_t)); uint w;
+    for (w = 1; w <= M.W; ++w) {
+      float x = km_row (&M, M.C, i / M.KB, w) [i % M.KB];
+      if (x) vec = append_vec (vec, &(ix_t){w, x});
+    }
+    put_vec (KxW, i+1, vec);
+    free_vec (vec);
+  }
+  for (t = 0; t < M.nt; ++t) { free (M.S[t]); free_vec (M.N[t]); }
+  free (M.C); free_vec (M.S); free_vec (M.N); free_vec (M.aff);
+  free_vec (M.seen); free_vec (M.A);
+}
+
 // keep only 1st doc in each clump
 // replace clump id (j) with number of docs in the clump
 void one_per_clump(jix_t *C) {
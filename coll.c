@@ -20,7 +20,10 @@
 */
 
 #include <utime.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "coll.h"
+#include "pvec.h"
 
 off_t MIN_OFFS = 8;
 
@@ -38,6 +41,27 @@ coll_t *open_coll_if_exists (char *path, char *access) {
   return coll_exists (path) ? open_coll (path, access) : NULL;
 }
 
+static void read_info (char *path, uint *vers, uint *rdim, uint *cdim) {
+  char x[9999];
+  FILE *info = fopen(fmt(x,"%s/coll.info",path), "r");
+  if (!info || !fscanf(info,"vers: %d\n", vers)) *vers = COLL_VERSION;
+  if (!info || !fscanf(info,"rows: %d\n", rdim)) *rdim = 0;
+  if (!info || !fscanf(info,"cols: %d\n", cdim)) *cdim = 0;
+  if (info) fclose(info);
+}
+
+static void read_coll_info (coll_t *c) { read_info (c->path, &c->version, &c->rdim, &c->cdim); }
+
+// "rs": private copies of offs/next, then all of coll.vecs (which covers them)
+static void load_shared (coll_t *c, off_t **offs, uint **next, mmap_t **vecs) {
+  char x[9999], hint = c->access[2];
+  *offs = read_vec (fmt(x,"%s/coll.offs",c->path));
+  *next = file_exists (fmt(x,"%s/coll.next",c->path)) ? read_vec (x) : NULL;
+  *vecs = open_mmap (fmt(x,"%s/coll.vecs",c->path), (hint == '!') ? "r!" : "r", 0);
+  if (hint == '~') madvise ((*vecs)->data, (*vecs)->size, MADV_RANDOM);
+  assert ((*offs)[0] <= (*vecs)->flen);
+}
+
 coll_t *open_coll (char *path, char *access) {
   if (!path) return open_coll_inmem ();
   coll_t *c = safe_calloc (sizeof(coll_t));
@@ -45,12 +69,9 @@ coll_t *open_coll (char *path, char *access) {
   c->access = strdup (access);
   c->path = path = strdup (path);
   char x[9999];
-  FILE *info = fopen(fmt(x,"%s/coll.info",path), "r");
-  if (!info || !fscanf(info,"vers: %d\n", &(c->version))) c->version = COLL_VERSION;
-  if (!info || !fscanf(info,"rows: %d\n", &(c->rdim)))    c->rdim = 0;
-  if (!info || !fscanf(info,"cols: %d\n", &(c->cdim)))    c->cdim = 0;
-  if (info) fclose(info);
+  read_coll_info (c);
   if (c->version != COLL_VERSION) { fprintf (stderr, "ERROR: version of %s: %d != %d\n", path, c->version, COLL_VERSION); exit(1); }
+  if (is_shared(c)) { load_shared (c, &c->offs, &c->next, &c->vecs); return c; }
   c->vecs = open_mmap (fmt(x,"%s/coll.vecs",path), access, MAP_SIZE);
   c->offs = open_vec (fmt(x,"%s/coll.offs",path), access, sizeof(off_t));
   if (access[0] == 'r') {
@@ -69,6 +90,48 @@ coll_t *open_coll (char *path, char *access) {
   return c;
 }
 
+// "rs": new snapshot of offs/next/vecs, e.g. after a writer appended vectors.
+// Readers see either the old or the new one (never a mix), old snapshots
+// stay mapped until free_coll. Only one thread at a time may refresh.
+uint refresh_coll (coll_t *c) {
+  assert (is_shared(c));
+  off_t *offs; uint *next, vers, rdim, cdim; mmap_t *vecs;
+  read_info (c->path, &vers, &rdim, &cdim); // before the snapshot: dims may only lag it
+  load_shared (c, &offs, &next, &vecs);
+  if (vecs->flen == c->vecs->flen) { free_mmap (vecs); vecs = c->vecs; } // same extent
+  void *old[3] = {c->offs, c->next, (vecs == c->vecs) ? NULL : c->vecs};
+  uint i;
+  for (i = 0; i < 3; ++i) c->old = append_vec (c->old ? c->old : new_vec (0, sizeof(void*)), old+i);
+  // dims only grow and go live before the postings that need them, so a
+  // reader that sizes its accumulator after this never sees a larger id
+  if (rdim > c->rdim) __atomic_store_n (&c->rdim, rdim, __ATOMIC_RELEASE);
+  if (cdim > c->cdim) __atomic_store_n (&c->cdim, cdim, __ATOMIC_RELEASE);
+  atomic_fetch_add (&c->gen, 1); // odd: readers retry
+  c->offs = offs; c->next = next; c->vecs = vecs;
+  atomic_fetch_add (&c->gen, 1); // even: new snapshot is live
+  return c->gen / 2;
+}
+
+// consistent offs/next/vecs of a shared coll, lock-free
+static inline void shared_snap (coll_t *c, off_t **offs, uint **next, mmap_t **vecs) {
+  uint gen;
+  do {
+    gen = atomic_load (&c->gen);
+    *offs = c->offs; *next = c->next; *vecs = c->vecs;
+    atomic_thread_fence (memory_order_acquire);
+  } while ((gen & 1) || gen != atomic_load (&c->gen));
+}
+
+// "rs": pointer to chunk id inside the whole-file map, or NULL
+static void *get_chunk_shared (coll_t *c, uint id, off_t *size) {
+  off_t *offs; uint *next; mmap_t *vecs;
+  shared_snap (c, &offs, &next, &vecs);
+  if (!id || id >= len(offs) || !offs[id]) return NULL;
+  uint nxt = next ? next[id] : (id+1) % len(offs);
+  if (size) *size = offs[nxt] - offs[id];
+  return vecs->data + offs[id];
+}
+
 // copy all vectors from src to trg. inmem or ondisk.
 void copy_mtx_vectors (coll_t *src, coll_t *trg) { 
   uint i = 0, n = nvecs(src);
@@ -129,8 +192,13 @@ static inline void free_coll_inmem (coll_t *c) {
 }
 
 void free_coll (coll_t *c) {
+  uint i;
   if (!c) return;
+  for (i = 0; i < 4; ++i) free_vec (c->dec[i]);
   if (!c->path) return free_coll_inmem (c);
+  for (i = 0; c->old && i < len(c->old); i += 3) {
+    free_vec (c->old[i]); free_vec (c->old[i+1]); free_mmap (c->old[i+2]); }
+  free_vec (c->old);
   free_mmap (c->vecs);
   free_vec (c->offs);
   free_vec (c->prev);
@@ -205,6 +273,8 @@ static inline void put_chunk_inmem (coll_t *c, uint id, void *buf, off_t size) {
 }
 
 off_t chunk_sz (coll_t *c, uint id) {
+  off_t size = 0;
+  if (is_shared(c)) return get_chunk_shared (c, id, &size) ? size : 0;
   assert (c->path && has_vec (c,id));
   uint next = c->next ? c->next[id] : (id+1) % len(c->offs);
   return c->offs[next] - c->offs[id];
@@ -247,17 +317,31 @@ static inline void mov_chunk (coll_t *c, uint id, off_t sz) { // NEVER call dire
 }
 
 // return pointer to chunk linked by id, or NULL
-void *get_chunk (coll_t *c, uint id) {
+void *get_chunk (coll_t *c, uint id) { // thread-unsafe unless "rs"
   if (!c->path) return get_chunk_inmem(c,id);
+  if (is_shared(c)) return get_chunk_shared (c, id, NULL);
   if (!has_vec(c,id)) return NULL;
   uint next = c->next ? c->next[id] : (id+1) % len(c->offs);
   off_t size = c->offs[next] - c->offs[id];
   return move_mmap (c->vecs, c->offs[id], size);
 }
 
+// chunk linked by id if it is already mapped, NULL otherwise: never remaps
+void *peek_chunk (coll_t *c, uint id) {
+  if (!c->path) return get_chunk_inmem(c,id);
+  if (is_shared(c)) return get_chunk_shared (c, id, NULL);
+  if (!has_vec(c,id)) return NULL;
+  mmap_t *M = c->vecs; off_t offs = c->offs[id];
+  return (offs >= M->offs && offs < M->offs + M->size) ? M->data + (offs - M->offs) : NULL;
+}
+
 // return a copy of chunk linked by id, or NULL => must be freed
 void *get_chunk_pread (coll_t *c, uint id) {
   if (!c->path) return get_chunk_inmem(c,id);
+  if (is_shared(c)) {
+    off_t size = 0; void *src = get_chunk_shared (c, id, &size);
+    return src ? memcpy (safe_malloc (size), src, size) : NULL;
+  }
   if (!has_vec(c,id)) return NULL;
   uint next = c->next ? c->next[id] : (id+1) % len(c->offs);
   off_t offs = c->offs[id], size = c->offs[next] - offs;
@@ -270,6 +354,23 @@ void *get_chunk_pread (coll_t *c, uint id) {
   return trg;
 }
 
+// readahead hint for chunks ids[0..n), e.g. documents about to be read
+void prefetch_chunks (coll_t *c, uint *ids, uint n) { // thread-unsafe unless "rs"
+  if (!c->path) return;
+  off_t *offs = c->offs; uint *next = c->next, i; mmap_t *vecs = c->vecs;
+  if (is_shared(c)) shared_snap (c, &offs, &next, &vecs);
+  for (i = 0; i < n; ++i) {
+    uint id = ids[i];
+    if (!id || id >= len(offs) || !offs[id]) continue;
+    uint nxt = next ? next[id] : (id+1) % len(offs);
+    off_t beg = offs[id], end = offs[nxt];
+    if (is_shared(c)) { // all of coll.vecs is mapped
+      off_t pg = page_align (beg,'<');
+      madvise (vecs->data + pg, end - pg, MADV_WILLNEED);
+    } else posix_fadvise (vecs->file, beg, end - beg, POSIX_FADV_WILLNEED);
+  }
+}
+
 static inline void *map_chunk (coll_t *c, uint id, off_t size) {
   if (!c->path) return map_chunk_inmem (c,id,size);
   mov_chunk (c, id, size);
@@ -289,52 +390,142 @@ void put_chunk_pwrite (coll_t *c, uint id, void *chunk, off_t size) {
   safe_pwrite (c->vecs->file, chunk, size, c->offs[id]);
 }
 
-vec_t nullvec = {0, 0, 0, 0, {}};
+vec_t nullvec = {0, 0, 0, 2, {}}; // file 2: free_vec leaves it alone
+
+#define is_coded(hdr) (is_packed(hdr) || is_dense_chunk(hdr))
+
+static void *dense2vec (float *F, uint n) { // ids 1..n, zeros included
+  ix_t *V = new_vec (n, sizeof(ix_t)); uint j;
+  for (j = 0; j < n; ++j) { V[j].i = j+1; V[j].x = F[j]; }
+  return V;
+}
+
+// chunk hdr (packed or dense) -> new ix_t vector
+static void *decode_chunk (vec_t *hdr) {
+  return is_packed(hdr) ? unpack_vec (hdr->data, hdr->count) : dense2vec ((float*) hdr->data, hdr->count);
+}
+
+// copy of the vector in chunk hdr, decoded if packed or dense
+static inline void *copy_chunk_vec (vec_t *hdr) {
+  return is_coded(hdr) ? decode_chunk (hdr) : copy_vec (hdr->data);
+}
 
 void *get_vec (coll_t *c, uint id) {
   vec_t *hdr = get_chunk (c, id);
-  return hdr ? copy_vec (hdr->data) : new_vec (0, 0);
+  return hdr ? copy_chunk_vec (hdr) : new_vec (0, 0);
 }
 
 void *get_vec_read (coll_t *c, uint id) {
   vec_t *hdr = get_chunk_pread (c, id);
   if (!hdr) return new_vec (0,0);
+  if (is_coded(hdr)) { void *V = decode_chunk (hdr); free (hdr); return V; }
   hdr->file = 0; // TODO: FIX THIS!
   return hdr->data;
 }
 
+typedef struct { void *dec[4]; uint ndec; } dec_t;
+
+static void free_dec (dec_t *D) { uint i; for (i = 0; i < 4; ++i) free_vec (D->dec[i]); free (D); }
+
+static pthread_key_t DEC_KEY;
+static pthread_once_t DEC_ONCE = PTHREAD_ONCE_INIT;
+static void dec_key_init () { pthread_key_create (&DEC_KEY, (void (*)(void*)) free_dec); }
+
+// "rs": packed/dense vectors decoded by get_vec_ro go to a per-thread ring
+static dec_t *thread_dec () {
+  pthread_once (&DEC_ONCE, dec_key_init);
+  dec_t *D = pthread_getspecific (DEC_KEY);
+  if (!D) pthread_setspecific (DEC_KEY, (D = safe_calloc (sizeof(dec_t))));
+  return D;
+}
+
 /* redundant: new get_vec() will always copy */
-void *get_vec_ro (coll_t *c, uint id) {
+void *get_vec_ro (coll_t *c, uint id) { // thread-unsafe: c->dec (safe if "rs")
   vec_t *hdr = get_chunk (c, id);
-  return hdr ? hdr->data : (&nullvec)->data;
+  if (!hdr) return (&nullvec)->data;
+  if (!is_coded(hdr)) return hdr->data;
+  void **dec = c->dec; uint *ndec = &c->ndec;
+  if (is_shared(c)) { dec_t *D = thread_dec (); dec = D->dec; ndec = &D->ndec; }
+  uint k = (*ndec)++ % 4; // decoded copy lives until 4 more packed reads
+  free_vec (dec[k]);
+  return dec[k] = decode_chunk (hdr);
 }
 /**/
 
-/* redundant: new get_vec() will always pread */
-void *get_vec_mp (coll_t *c, uint id) { // thread-safe
-  if (!has_vec(c,id)) return new_vec (0, sizeof(ix_t));
-  if (!c->path) { // in-memory
-    vec_t *vec = NULL + c->offs[id];
-    return copy_vec (vec->data);
+// zero-copy view of c[id] when that is thread-safe: shared ("rs") and
+// not packed or dense. NULL otherwise: use get_vec_mp.
+void *get_vec_view (coll_t *c, uint id) {
+  if (!is_shared(c)) return NULL;
+  vec_t *hdr = get_chunk_shared (c, id, NULL);
+  if (!hdr) return (&nullvec)->data;
+  return is_coded(hdr) ? NULL : hdr->data;
+}
+
+// copy of c[id], dense rows stay float[] if keep
+static void *copy_row_mp (coll_t *c, uint id, char keep) {
+  if (is_shared(c)) {
+    vec_t *hdr = get_chunk_shared (c, id, NULL);
+    if (hdr && keep && is_dense_chunk(hdr)) return copy_vec (hdr->data);
+    return hdr ? copy_chunk_vec (hdr) : new_vec (0, sizeof(ix_t));
   }
-  mmap_t *M = c->vecs;
-  uint next = c->next ? c->next[id] : (id+1) % len(c->offs);
-  off_t offs = c->offs[id], size = c->offs[next] - offs;
-  if (offs >= M->offs && (offs+size) <= (M->offs + M->size)) { // in mmap
-    vec_t *vec = (vec_t*) (M->data + (offs - M->offs));
-    return copy_vec (vec->data);
+  if (!has_vec(c,id)) return new_vec (0, sizeof(ix_t));
+  vec_t *vec = NULL;
+  if (!c->path) vec = NULL + c->offs[id]; // in-memory
+  else {
+    mmap_t *M = c->vecs;
+    uint next = c->next ? c->next[id] : (id+1) % len(c->offs);
+    off_t offs = c->offs[id], size = c->offs[next] - offs;
+    if (offs >= M->offs && (offs+size) <= (M->offs + M->size)) // in mmap
+      vec = (vec_t*) (M->data + (offs - M->offs));
+    else {
+      vec = malloc(size);
+      safe_pread (M->file, vec, size, offs);
+      if (is_coded(vec) && !(keep && is_dense_chunk(vec))) {
+	void *V = decode_chunk (vec); free (vec); return V; }
+      vec->file = 0; // vector in memory
+      return vec->data;
+    }
   }
-  vec_t *vec = malloc(size);
-  safe_pread (M->file, vec, size, offs);
-  vec->file = 0; // vector in memory
-  return vec->data;
+  if (keep && is_dense_chunk(vec)) return copy_vec (vec->data);
+  return copy_chunk_vec (vec);
 }
+
+/* redundant: new get_vec() will always pread */
+void *get_vec_mp (coll_t *c, uint id) { return copy_row_mp (c, id, 0); } // thread-safe
 /**/
 
+void *get_row_mp (coll_t *c, uint id) { return copy_row_mp (c, id, 1); }
+
+// borrowed c[id]: a view into the map if "rs" and not packed (dense too,
+// for borrow_row), valid until free_coll, else a copy as get_vec_mp
+void *borrow_vec (coll_t *c, uint id) {
+  void *V = get_vec_view (c, id);
+  return V ? V : copy_row_mp (c, id, 0);
+}
+
+void *borrow_row (coll_t *c, uint id) {
+  if (!is_shared(c)) return copy_row_mp (c, id, 1);
+  vec_t *hdr = get_chunk_shared (c, id, NULL);
+  if (!hdr) return (&nullvec)->data;
+  return is_packed(hdr) ? decode_chunk (hdr) : hdr->data;
+}
+
+void release_vec (void *vec) { if (vec && !vect(vec)->file) free_vec (vec); }
+
+int has_dense (coll_t *c, uint id) {
+  vec_t *hdr = has_vec(c,id) ? get_chunk (c,id) : NULL;
+  return hdr && is_dense_chunk(hdr);
+}
+
+float *get_dense_ro (coll_t *c, uint id) {
+  vec_t *hdr = has_vec(c,id) ? get_chunk (c,id) : NULL;
+  return (hdr && is_dense_chunk(hdr)) ? (float*) hdr->data : NULL;
+}
+
 /**/
 void *get_or_new_vec (coll_t *c, uint id, uint esize) {
   vec_t *hdr = get_chunk (c, id);
-  return hdr ? copy_vec (hdr->data) : new_vec (0, esize);
+  return hdr ? copy_chunk_vec (hdr) : new_vec (0, esize);
 }
 /**/
 
@@ -370,6 +561,37 @@ void put_vec_write (coll_t *c, uint id, void *vec) {
   src->file = file;
 }
 
+// block-compress vec (sorted by id) and write to c[id], q: see pvec.h
+void put_vec_pack (coll_t *c, uint id, ix_t *vec, uint q) {
+  byte *P = pack_vec (vec, q);
+  if (!P) return put_vec_write (c, id, vec); // not sorted => as is
+  vec_t *hdr = safe_malloc (sizeof(vec_t) + len(P));
+  hdr->count = len(vec); hdr->limit = 0;
+  hdr->esize = sizeof(ix_t); hdr->file = PACK_FILE;
+  memcpy (hdr->data, P, len(P));
+  put_chunk_pwrite (c, id, hdr, sizeof(vec_t) + len(P));
+  update_dims (c, id, vec, len(vec), sizeof(ix_t));
+  free (hdr); free_vec (P);
+}
+
+// store a dense ix_t row (ids 1..n, see is_dense) or float[] as n floats,
+// anything else as is
+void put_vec_dense (coll_t *c, uint id, void *vec) {
+  if (!vec || !len(vec)) return del_vec (c,id);
+  uint n = len(vec), j;
+  ix_t *V = vec;
+  if (vesize(vec) == sizeof(ix_t) && V[n-1].i != n) return put_vec_write (c, id, vec);
+  vec_t *hdr = safe_malloc (sizeof(vec_t) + n * sizeof(float));
+  hdr->count = n; hdr->limit = 0;
+  hdr->esize = sizeof(float); hdr->file = DENSE_FILE;
+  float *F = (float*) hdr->data;
+  if (vesize(vec) == sizeof(float)) memcpy (F, vec, n * sizeof(float));
+  else for (j = 0; j < n; ++j) F[j] = V[j].x;
+  put_chunk_pwrite (c, id, hdr, sizeof(vec_t) + n * sizeof(float));
+  update_dims (c, id, vec, n, sizeof(float));
+  free (hdr);
+}
+
 void *map_vec (coll_t *c, uint id, uint n, uint sz) { // TODO : remove this (used by transpose only)
   off_t size = (off_t)sizeof(vec_t) + ((off_t) n) * sz;
   vec_t *vec = map_chunk (c, id, size);
@@ -380,12 +602,9 @@ void *map_vec (coll_t *c, uint id, uint n, uint sz) { // TODO : remove this (use
   return vec->data;
 }
 
-uint len_vec (coll_t *M, uint id) {
-  if (!has_vec(M,id)) return 0;
-  void *V = get_vec(M,id);
-  uint n = len(V);
-  free_vec(V);
-  return n;
+uint len_vec (coll_t *M, uint id) { // from the chunk header, no copy
+  vec_t *hdr = has_vec(M,id) ? get_chunk (M,id) : NULL;
+  return hdr ? hdr->count : 0; // packed: number of elements too
 }
 
 /*
@@ -402,7 +621,8 @@ void defrag_coll (char *SRC, char *TRG) {
   for (id = 1; id <= nvecs(S); ++id) {
     vec_t *src = get_chunk(S,id);
     if (!src) continue;
-    off_t size = (off_t)sizeof(vec_t) + (off_t) src->count * src->esize;
+    off_t size = (is_packed(src) ? chunk_sz (S,id) : // count = postings, not bytes
+		  (off_t)sizeof(vec_t) + (off_t) src->count * src->esize);
     put_chunk (T,id,src,size);
   }
   free_coll (S);
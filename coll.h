@@ -37,11 +37,22 @@ typedef struct {
   uint version;
   uint    rdim; // number of rows
   uint    cdim; // number of columns
+  void  *dec[4]; // last few packed vectors decoded by get_vec_ro
+  uint    ndec;
+  _Atomic uint gen; // "rs": snapshot generation, odd while refresh_coll swaps it
+  void  **old; // "rs": snapshots replaced by refresh_coll, freed by free_coll
 } coll_t;
 
 #define nvecs(c) (len((c)->offs)-1)
 
+// access "rs" = shared read-only: coll.vecs is mapped whole, once, and
+// offs/next are copied to memory, so get_chunk, get_vec_ro and get_vec_mp
+// never remap and are safe from any number of threads (no copies unless
+// packed). "rs!" also pre-faults the map, "rs~" tells the kernel to expect
+// random access. refresh_coll picks up vectors appended by a writer.
+#define is_shared(c) ((c)->access && (c)->access[0] == 'r' && (c)->access[1] == 's')
 coll_t *open_coll (char *_path, char *access) ;
+uint refresh_coll (coll_t *c) ; // "rs" only, returns new generation
 coll_t *reopen_coll (coll_t *c, char *access) ;
 void free_coll (coll_t *c) ;
 void free_colls (coll_t *c1, ...) ;
@@ -60,6 +71,7 @@ coll_t *read_mtx (char *path) ;
 coll_t *read_kvs (char *path) ;
 
 void *get_chunk (coll_t *c, uint id) ;
+void *peek_chunk (coll_t *c, uint id) ; // get_chunk if mapped already, else NULL
 void del_chunk (coll_t *c, uint id) ;
 void put_chunk (coll_t *c, uint id, void *chunk, off_t size) ;
 void put_chunk_pwrite (coll_t *c, uint id, void *chunk, off_t size) ;
@@ -70,15 +82,35 @@ void *get_vec (coll_t *c, uint id) ;
 void del_vec (coll_t *c, uint id) ;
 void put_vec (coll_t *c, uint id, void *vec) ;
 void put_vec_write (coll_t *c, uint id, void *vec) ;
+void put_vec_pack (coll_t *c, uint id, ix_t *vec, uint q) ; // see pvec.h
+void put_vec_dense (coll_t *c, uint id, void *vec) ; // see DENSE_FILE
 void *next_vec (coll_t *c, uint *id);
 void *get_or_new_vec (coll_t *c, uint id, uint esize);
-void *get_vec_ro (coll_t *c, uint id) ;
+void *get_vec_ro (coll_t *c, uint id) ; // packed/dense: decoded into c->dec, one thread only unless "rs"
 void *get_vec_mp (coll_t *c, uint id) ;
+void *get_vec_view (coll_t *c, uint id) ; // "rs", not packed: no copy, else NULL
 uint len_vec (coll_t *M, uint id) ;
 
+// Dense rows: chunk header file = DENSE_FILE, count floats, float [j] is
+// column j+1. get_vec*() expand them to ix_t with ids 1..count (zeros kept),
+// get_row_mp() and get_dense_ro() give the floats without expanding.
+#define DENSE_FILE 4
+#define is_dense_chunk(hdr) ((hdr)->file == DENSE_FILE)
+void *get_row_mp (coll_t *c, uint id) ; // thread-safe, float[] if dense, else as get_vec_mp
+float *get_dense_ro (coll_t *c, uint id) ; // zero-copy, NULL if not dense; thread-unsafe (safe if "rs")
+int has_dense (coll_t *c, uint id) ; // thread-unsafe (safe if "rs")
+
+// Borrowed rows for read-heavy loops: a view into the map of an "rs" coll
+// (valid until free_coll, refresh_coll keeps old snapshots), a copy when
+// packed or not "rs". Thread-safe. Never free_vec a borrowed row: release_vec.
+void *borrow_vec (coll_t *c, uint id) ; // ix_t, as get_vec_mp
+void *borrow_row (coll_t *c, uint id) ; // float[] if dense, as get_row_mp
+void release_vec (void *vec) ; // frees copies only
+
 void defrag_coll (char *SRC, char *TRG) ;
 
 void *get_chunk_pread (coll_t *c, uint id) ; // malloc + pread
+void prefetch_chunks (coll_t *c, uint *ids, uint n) ; // madvise/fadvise WILLNEED
 
 
 /*
@@ -49,6 +49,8 @@ void slice_to_mtx (coll_t *M, uint r0, uint c0, uint nr, uint nc, float *S) {
 // M [r0:r0+nr, c0:c0+nc] -> S: pre-allocated to [nr * nc]  floats
 void mtx_to_slice (coll_t *M, uint r0, uint c0, uint nr, uint nc, float *S) {
   for (uint r = 0; r < nr; ++r) {
+    float *F = get_dense_ro (M,r0+r+1); // stored dense: copy the floats
+    if (F && len(F) >= c0+nc) { memcpy (S + r*nc, F + c0, nc * sizeof(float)); continue; }
     ix_t *row = get_vec_ro (M,r0+r+1);
     assert (is_dense(row));
     for (uint c = 0; c < nc; ++c) S[r*nc + c] = row[c0+c].x;
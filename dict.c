@@ -97,6 +97,7 @@ char *usage =
   "                 -i2k DICT id\n"
   "                 size DICT\n"
   "                 -dbg DICT\n"
+  "                 -grp DICT ... convert hash.indx to hash.grp\n"
   "               -inmap MAP < src_trg_pairs\n"
   "              -outmap MAP\n"
   "        -usemap,col=1 MAP < tab_separated_lines\n"
@@ -326,8 +327,30 @@ int main (int argc, char *argv[]) {
     return 0;
   }
 
+  if (!strcmp(argv[1], "-grp")) {
+    hash_indx2grp (argv[2]);
+    return 0;
+  }
+
   if (!strcmp(argv[1], "-dbg")) {
     hash_t *h = open_hash (argv[2], "r");
+    if (h->grp) {
+      uint ng = len(h->grp), g, k, used = 0;
+      printf ("keys: %u\n", nvecs(h->keys));
+      printf ("code: %u\n", len(h->code));
+      printf ("grp: %u x 16\n", ng);
+      printf ("#%9s %10s %4s %10s %10s %s\n", "id", "group", "tag", "code&n", "code", "key");
+      for (g = 0; g < ng; ++g)
+	for (k = 0; k < 16; ++k) {
+	  uint id = h->grp[g].id[k], code = h->code[id];
+	  if (!h->grp[g].tag[k]) continue;
+	  printf ("%10u %10u %4x %10u %10u %s\n", id, g, h->grp[g].tag[k], code & (ng-1), code, (char*) get_chunk (h->keys, id));
+	  ++used;
+	}
+      printf ("load: %.2f\n", (double) used / (16. * ng));
+      free_hash (h);
+      return 0;
+    }
     uint *I = h->indx, n = len(I), i;
     printf ("keys: %u\n", nvecs(h->keys));
     printf ("code: %u\n", len(h->code));
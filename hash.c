@@ -19,18 +19,23 @@
 
 */
 
+#include <emmintrin.h>
 #include "hash.h"
 #include "timeutil.h"
+#include "synq.h"
 
 //float HASH_LOAD = 0.9;
 //uint  HASH_FUNC = 0; // 0:multiadd 1:murmur3 2:OneAtATime
 //uint  HASH_PROB = 0;  // 0:linear 1:quadratic 2:secondary
 ulong COLLISIONS = 0;
 
+static void grp_rehash (hash_t *h, uint n) ;
+
 hash_t *copy_hash (hash_t *src) {
   hash_t *trg = safe_calloc (sizeof (hash_t));
   trg->code = copy_vec (src->code);
   trg->indx = copy_vec (src->indx);
+  trg->grp  = copy_vec (src->grp);
   trg->access = strdup ("w");
   trg->keys = open_coll_inmem ();
   copy_kvs_strings (src->keys, trg->keys);
@@ -40,9 +45,10 @@ hash_t *copy_hash (hash_t *src) {
 hash_t *open_hash_inmem () {
   hash_t *h = safe_calloc (sizeof (hash_t));
   h->keys = open_coll_inmem ();
-  h->indx = new_vec (1024, sizeof(uint));
+  h->grp = new_vec (0, sizeof(hgrp_t));
   h->code = new_vec (0, sizeof(uint));
   h->access = strdup ("w");
+  grp_rehash (h, 0);
   return h;
 }
 
@@ -75,18 +81,41 @@ hash_t *open_hash (char *_path, char *_access) {
   h->path = path;
   h->keys = open_coll (path, access); // expect_random_access (h->keys->vecs,1<<20);
   h->code = open_vec (fmt(x,"%s/hash.code",path), access, sizeof(uint));
-  h->indx = open_vec (fmt(x,"%s/hash.indx",path), access, sizeof(uint));
-  if (0 == len(h->indx)) h->indx = resize_vec (h->indx, 1023);
+  int old = file_exists ("%s/hash.indx",path) && !file_exists ("%s/hash.grp",path);
+  if (old && *access != 'w') { // old format: probe and extend hash.indx as before
+    h->indx = open_vec (fmt(x,"%s/hash.indx",path), access, sizeof(uint));
+    if (0 == len(h->indx)) h->indx = resize_vec (h->indx, 1023);
+    return h;
+  }
+  h->grp = open_vec (fmt(x,"%s/hash.grp",path), access, sizeof(hgrp_t));
+  if (0 == len(h->grp)) grp_rehash (h, nkeys(h)); // new
+  if (old) unlink (fmt(x,"%s/hash.indx",path)); // "w": stale
   //h->data = open_mmap (path, access, 0); grow_mmap (h->data, 0);
   //MAP_MODE = MAP_OLD; // default MMAP flags
   return h;
 }
 
+// convert a dictionary from hash.indx to hash.grp (older binaries can't
+// read it after this). hash.grp is rebuilt from hash.code and renamed into
+// place before hash.indx goes, so an interrupted run leaves a readable dir.
+void hash_indx2grp (char *path) {
+  char x[9999], y[9999];
+  hash_t *h = open_hash (path, "r");
+  if (!h->indx) return free_hash (h); // already groups
+  h->grp = new_vec (0, sizeof(hgrp_t));
+  grp_rehash (h, nkeys(h));
+  write_vec (h->grp, fmt(x,"%s/hash.grp.tmp",path));
+  free_hash (h);
+  if (rename (x, fmt(y,"%s/hash.grp",path))) return perror (y);
+  unlink (fmt(x,"%s/hash.indx",path));
+}
+
 void write_hash (hash_t *h, char *path) {
   char _[9999];
   mkdir_parent(fmt(_,"%s/",path));
   write_vec (h->code, fmt(_,"%s/hash.code",path));
-  write_vec (h->indx, fmt(_,"%s/hash.indx",path));
+  if (h->grp) write_vec (h->grp, fmt(_,"%s/hash.grp",path));
+  else write_vec (h->indx, fmt(_,"%s/hash.indx",path));
   write_kvs (h->keys, path);
 }
 
@@ -94,7 +123,8 @@ hash_t *read_hash (char *path) {
   char _[9999];
   hash_t *h = safe_calloc (sizeof (hash_t));
   h->code = read_vec (fmt(_,"%s/hash.code",path));
-  h->indx = read_vec (fmt(_,"%s/hash.indx",path));
+  if (file_exists ("%s/hash.grp",path)) h->grp = read_vec (fmt(_,"%s/hash.grp",path));
+  else h->indx = read_vec (fmt(_,"%s/hash.indx",path));
   h->keys = read_kvs (path);
   h->access = strdup ("w");
   return h;
@@ -106,6 +136,7 @@ void free_hash (hash_t *h) {
   if (h->keys) free_coll (h->keys);
   if (h->code) free_vec  (h->code);
   if (h->indx) free_vec  (h->indx);
+  if (h->grp)  free_vec  (h->grp);
   if (h->access) free (h->access);
   if (h->path) free (h->path);
   memset (h, 0, sizeof(hash_t));
@@ -158,6 +189,41 @@ uint *href (hash_t *h, char *key, uint code) { // TODO: code % N -> code & (1 <<
   return H+o;
 }
 
+#define grp_tag(code) (0x80 | ((code) >> 25))
+
+// find key in the groups: pointer to its id, or to the empty slot it would take
+static uint *gref (hash_t *h, char *key, uint code, uchar **tag) {
+  hgrp_t *G = h->grp; uint mask = len(G) - 1, g = code & mask, k, m;
+  __m128i want = _mm_set1_epi8 ((char) grp_tag(code)), none = _mm_setzero_si128 ();
+  for (;; g = (g+1) & mask) { // load <= 7/8 => some group has an empty slot
+    __m128i t = _mm_loadu_si128 ((__m128i*) G[g].tag);
+    for (m = _mm_movemask_epi8 (_mm_cmpeq_epi8 (t, want)); m; m &= m-1) {
+      k = __builtin_ctz (m); // 1 in 8 tag matches is a different key
+      if (!strcmp (key, get_chunk (h->keys, G[g].id[k]))) break;
+    }
+    if (!m) m = _mm_movemask_epi8 (_mm_cmpeq_epi8 (t, none)); // no deletions:
+    if (!m) continue; // key is not past the first group with an empty slot
+    *tag = G[g].tag + (k = __builtin_ctz (m));
+    return G[g].id + k;
+  }
+}
+
+// add id to the first empty slot on its probe sequence (no key compares)
+static void grp_put (hgrp_t *G, uint code, uint id) {
+  uint mask = len(G) - 1, g = code & mask, k;
+  for (;; g = (g+1) & mask)
+    for (k = 0; k < 16; ++k)
+      if (!G[g].tag[k]) { G[g].tag[k] = grp_tag(code); G[g].id[k] = id; return; }
+}
+
+// size groups for n keys at <= 7/8 load, re-insert all ids using code[]
+static void grp_rehash (hash_t *h, uint n) {
+  uint ng = MAX (64, next_pow2 ((ulong) n * 8 / 7 / 16 + 1)), id, nk = nkeys(h);
+  h->grp = resize_vec (h->grp, ng);
+  memset (h->grp, 0, ((ulong)ng) * sizeof(hgrp_t));
+  for (id = 1; id <= nk; ++id) grp_put (h->grp, h->code[id], id);
+}
+
 void hrehash (hash_t *h) {
   ulong N = next_pow2(2*(ulong)(len(h->indx))) - 1;
   uint id, n = nvecs(h->keys);
@@ -175,7 +241,8 @@ void hrehash (hash_t *h) {
 uint has_key (hash_t *h, char *key) { // TODO: arg3 = len(key)
   if (!h || !key) return 0;
   uint code = murmur3 (key, strlen(key)); // TODO: _128
-  uint *slot = href (h, key, code);
+  uchar *tag;
+  uint *slot = h->grp ? gref (h, key, code, &tag) : href (h, key, code);
   return *slot;
 }
 
@@ -204,10 +271,21 @@ static uint add_new_key (hash_t *h, char *key, uint code) {
 // tweak constants inside hash-f
 // crc32unroll / crc32+sse/avx: 4 bytes
 
+static uint grp_key2id (hash_t *h, char *key, uint code) {
+  uchar *tag;
+  uint *slot = gref (h, key, code, &tag);
+  if (*slot || h->access[0] == 'r') return *slot; // key already in table
+  uint id = add_new_key (h, key, code);
+  if ((ulong) id * 8 > (ulong) len(h->grp) * 16 * 7) grp_rehash (h, 2*id); // adds id
+  else { *tag = grp_tag(code); *slot = id; }
+  return id;
+}
+
 uint key2id (hash_t *h, char *key) { // TODO: arg3 = len(key)
   if (!h || !key) return 0;
   if (h->access[0] == 'T') return str2time (key);
   uint code = murmur3 (key, strlen(key)); // TODO: _128
+  if (h->grp) return grp_key2id (h, key, code);
   uint *slot = href (h, key, code);
   if (*slot || h->access[0] == 'r') return *slot; // key already in table
   uint id = add_new_key (h, key, code);
@@ -222,6 +300,69 @@ uint id2id (hash_t *src, uint id, hash_t *trg) {
   return key ? key2id (trg,key) : 0;
 }
 
+////////// batch version of key2id: prefetch ahead
+
+#define BATCH_AHEAD 8 // keys between group prefetch, key prefetch and probe
+
+typedef struct {
+  hash_t *h;
+  char **keys;
+  uint *code; // code[k] = murmur3 (keys[k])
+  uint *ids;
+  uint n, nt;
+} batch_t;
+
+static inline void grp_prefetch (hgrp_t *G, uint code) {
+  hgrp_t *g = G + (code & (len(G)-1));
+  __builtin_prefetch (g->tag);
+  __builtin_prefetch (g->id + 15); // hgrp_t spans two cache lines
+}
+
+// group should be in cache by now: prefetch the first key with our tag
+static inline void key_prefetch (hash_t *h, uint code) {
+  hgrp_t *g = h->grp + (code & (len(h->grp)-1));
+  __m128i t = _mm_loadu_si128 ((__m128i*) g->tag);
+  uint m = _mm_movemask_epi8 (_mm_cmpeq_epi8 (t, _mm_set1_epi8 ((char) grp_tag(code))));
+  char *key = m ? peek_chunk (h->keys, g->id [__builtin_ctz (m)]) : NULL; // a hint: no remap
+  if (key) __builtin_prefetch (key);
+}
+
+// probe keys [a..b) of part t: 2 x AHEAD ahead fetch the group, AHEAD ahead the key
+static int probe_part (uint t, void *arg) {
+  batch_t *B = arg; hash_t *h = B->h; uint *C = B->code;
+  uint a = (ulong) B->n * t / B->nt, b = (ulong) B->n * (t+1) / B->nt, D = BATCH_AHEAD, k;
+  for (k = a; k < b && k < a+2*D; ++k) grp_prefetch (h->grp, C[k]);
+  for (k = a; k < b; ++k) {
+    if (k+2*D < b) grp_prefetch (h->grp, C[k+2*D]); // h->grp may be
+    if (k+D < b) key_prefetch (h, C[k+D]); // re-allocated by inserts
+    char *key = B->keys[k];
+    B->ids[k] = (key && *key) ? grp_key2id (h, key, C[k]) : 0;
+  }
+  return 0;
+}
+
+// ids[k] = key2id (h, keys[k]) for k < n, NULL or empty keys -> 0.
+// New keys get the same ids as calling key2id in order. Tables opened
+// "rs" split a large batch over nt threads. Returns ids (new if NULL).
+uint *key2id_batch (hash_t *h, char **keys, uint n, uint *ids, uint nt) {
+  if (!ids) ids = new_vec (n, sizeof(uint));
+  uint k, rs = (h->access[0] == 'r') && (h->access[1] == 's');
+  if (!h->grp || h->access[0] == 'T') { // old format, time keys
+    for (k = 0; k < n; ++k) ids[k] = (keys[k] && *keys[k]) ? key2id (h, keys[k]) : 0;
+    return ids;
+  }
+  batch_t B = {h, keys, malloc (n * sizeof(uint)), ids, n, 1};
+  for (k = 0; k < n; ++k) {
+    char *key = keys[k];
+    B.code[k] = (key && *key) ? murmur3 (key, strlen(key)) : 0;
+  }
+  if (rs && nt > 1 && n >= 4096) B.nt = nt;
+  if (B.nt > 1) parallel (B.nt, B.nt, probe_part, &B, NULL);
+  else probe_part (0, &B);
+  free (B.code);
+  return ids;
+}
+
 ////////// batch version of key2id: sort + merge
 
 char **hash_keys (char *path) {
@@ -276,6 +417,26 @@ static it_t *codes2hypos (it_t *codes, uint *indx) {
   return hypos;
 }
 
+// same for groups: ids with a matching tag along the probe sequence
+static it_t *codes2hypos_grp (it_t *codes, hgrp_t *G) {
+  fprintf (stderr, "codes2hypos(%d)\n", len(codes));
+  it_t *hypos = new_vec (0, sizeof(it_t)), *c;
+  uint mask = len(G) - 1, n = len(codes), done = 0, g, k, stop;
+  for (c = codes; c < codes+n; ++c) {
+    uchar tag = grp_tag(c->t);
+    for (g = c->t & mask, stop = 0; !stop; g = (g+1) & mask)
+      for (k = 0; k < 16; ++k) {
+	if (!G[g].tag[k]) stop = 1;
+	else if (G[g].tag[k] == tag) { it_t new = {c->i, G[g].id[k]}; hypos = append_vec (hypos, &new); }
+      }
+    if (0==++done%10) show_progress (done,n,"codes2hypos");
+  }
+  fprintf(stderr," sorting %d hypos", len(hypos));
+  sort_vec (hypos, cmp_it_t); // sort by hypothesized id
+  fprintf(stderr," done\n");
+  return hypos;
+}
+
 static uint *hypos2ids (it_t *hypos, char **keys, coll_t *hkeys) {
   fprintf (stderr, "hypos2ids(%d)\n", len(hypos));
   uint nk = len(keys), nh = len(hypos), done = 0;
@@ -303,8 +464,8 @@ static void fill_ids (char **keys, uint *ids, hash_t *h) {
 
 uint *keys2ids (hash_t *h, char **keys) {
   //vtime();
-  it_t *codes = keys2codes (keys, len(h->indx));       //fprintf (stderr, "[%.2fs] keys -> codes[%d]\n", vtime(), len(codes));
-  it_t *hypos = codes2hypos (codes, h->indx);          //fprintf (stderr, "[%.2fs] codes -> hypos[%d]\n", vtime(), len(hypos));
+  it_t *codes = keys2codes (keys, h->grp ? 0 : len(h->indx)); //fprintf (stderr, "[%.2fs] keys -> codes[%d]\n", vtime(), len(codes));
+  it_t *hypos = h->grp ? codes2hypos_grp (codes, h->grp) : codes2hypos (codes, h->indx); //fprintf (stderr, "[%.2fs] codes -> hypos[%d]\n", vtime(), len(hypos));
   uint *ids = hypos2ids (hypos, keys, h->keys);        //fprintf (stderr, "[%.2fs] hypos -> ids[%d]\n", vtime(), len(ids));
   if (h->access[0] != 'r') fill_ids (keys, ids, h);    //fprintf (stderr, "[%.2fs] filled ids\n", vtime());
   free_vec (codes); free_vec (hypos);
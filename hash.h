@@ -24,12 +24,19 @@
 #ifndef HASHTABLE
 #define HASHTABLE
 
+// Swiss-table group: 16 one-byte tags probed at once (SSE2), then ids
+typedef struct {
+  uchar tag [16]; // 0 = empty, else 0x80 | top 7 bits of the hashcode
+  uint  id  [16]; // id of the key in the slot
+} hgrp_t;
+
 // note: putting offs_t into indx won't save any space:
 // indx is half-full: 2N * offs_t == N * offs_t + 2N * uint
 typedef struct {
   char *access;
   char   *path;
-  uint   *indx; // indx[code] -> id
+  uint   *indx; // indx[code] -> id (old format, dirs without grp)
+  hgrp_t  *grp; // grp[code & (len-1)] -> id, linear probing over groups
   uint   *code; // code[id] = hashcode
   coll_t *keys; // keys[id] = string
   char mlock;
@@ -49,6 +56,7 @@ hash_t *open_hash_inmem () ;
 
 void write_hash (hash_t *h, char *path) ;
 hash_t *read_hash (char *path) ;
+void hash_indx2grp (char *path) ; // old hash.indx -> hash.grp, in place
 
 char *id2str (hash_t *h, uint id) ; // strdup (key2id | itoa(id))
 char *id2key (hash_t *h, uint i) ;
@@ -56,6 +64,7 @@ uint  key2id (hash_t *h, char *key) ;
 uint has_key (hash_t *h, char *key) ;
 uint id2id (hash_t *src, uint id, hash_t *trg) ;
 uint *keys2ids (hash_t *h, char **keys) ; // batch version of key2id
+uint *key2id_batch (hash_t *h, char **keys, uint n, uint *ids, uint nt) ; // prefetched
 char **hash_keys (char *path) ; // list all keys in a hashtable
 uint *hash2hash (char *src, char *trg, char *access) ; // map ids: src -> trg
 uint *backmap (uint *map); // inverse map: map[i]==j <-> inv[j]==i
@@ -42,8 +42,9 @@ void dump_raw_ret (char *C, char *RH, char *prm) {
     if ((eol = strchr(line,'\n'))) *eol = '\0';
     if (2 != sscanf (line, "%s %s", qryid, docid)) continue;
     uint i = key2id(h,docid);
-    char *raw = get_chunk(c,i);
+    char *raw = get_doc(c,i);
     printf ("%s\t%s\n",line,raw);
+    free(raw);
   }
   free_coll(c); free_hash(h); free(tag);
 }
@@ -56,11 +57,13 @@ void dump_rnd (char *C, char *prm) {
   uint N = nvecs(c);
   while (--num > 0) {
     uint i = 1 + random() % N;
-    char *s = get_chunk(c,i);
+    char *doc = get_doc(c,i), *s = doc;
+    if (!doc) continue;
     s += strcspn (s,">") + 1;
     char *end = strrchr(s,'<');
-    fwrite (s, 1, end-s, stdout);
+    if (end > s) fwrite (s, 1, end-s, stdout);
     fwrite ("\n", 1, 1, stdout);
+    free(doc);
     //fprintf(stderr,"doc %d\n",i);
   }
   free_coll(c);
@@ -76,12 +79,12 @@ void dump_ids (char *C, char *RH, char *prm) {
   fprintf(stderr, "%s: %d keys\n", RH, len(ids));
   coll_t *c = open_coll (C, "r+");
   for (id = ids; id < ids + len(ids); ++id) {
-    char *doc = USE_ZSTD ? get_string_zst(c,*id) : get_chunk(c,*id);
+    char *doc = USE_ZSTD ? get_string_zst(c,*id) : get_doc(c,*id);
     if (!doc) continue;
     fputs(doc, stdout);
     fputc(EOD, stdout);
     ++chunks;
-    if (USE_ZSTD) free(doc);
+    free(doc);
   }
   fprintf(stderr, "%s: %d / %d chunks\n", C, chunks, len(ids));
   free_coll(c);
@@ -97,11 +100,11 @@ void dump_raw (char *C, char *RH, char *id, char *prm) {
   uint n = *id ? i : nvecs(c);
   //printf ("%s %s %d %d\n", C, RH, i, n);
   for (; i <= n; ++i) {
-    char *doc = USE_ZSTD ? get_string_zst(c,i) : get_chunk(c,i);
+    char *doc = USE_ZSTD ? get_string_zst(c,i) : get_doc(c,i);
     if (!doc) continue;
     fputs(doc, stdout);
     fputc(EOD, stdout);
-    if (USE_ZSTD) free(doc);
+    free(doc);
   }
   free_coll(c); free_hash(h);
 }
@@ -145,8 +148,8 @@ void load_json (char *C, char *RH, char *prm) { //
     uint id = key2id (rh, docid);
     free(docid);
     if (!id) { ++noid; continue; }
-    char *old = get_chunk (c,id);
-    if (old && skip) continue;
+    char *old = get_doc (c,id);
+    if (old && skip) { free(old); continue; }
     if (old && join) { // append old JSON to new JSON
       char *close = endchr (json,'}',sz); if (!close) fprintf (stderr, "ERR: %s\n", json); // have: {new}{old}
       char *open = strchr (old,'{');      if (!open)  fprintf (stderr, "ERR: %s\n", old);  // want: {new,old}
@@ -155,6 +158,7 @@ void load_json (char *C, char *RH, char *prm) { //
       sz = strlen (json);
       ++dups;
     }
+    free(old);
     //if (has_vec(c,id)) ++dups; else
     put_chunk (c, id, json, sz+1);
   }
@@ -186,15 +190,17 @@ void load_xml_or_json (char *C, char *RH, char *prm) {
     uint id = key2id (rh, docid);
     free(docid);
     if (!id) { ++noid; continue; }
-    char *old = get_chunk (c,id);
+    char *old = USE_ZSTD ? get_string_zst(c,id) : get_doc(c,id);
     if (old) ++dups;
-    if (old && skip) continue; // keep old
-    if (old && Long && ((size_t)sz < strlen(old))) continue; // old is longer -> keep it
-    if (old && join) { // append old to new
+    int keep = old && (skip || // keep old
+		       (Long && ((size_t)sz < strlen(old)))); // old is longer -> keep it
+    if (old && !keep && join) { // append old to new
       if (jsonp) append_json (&buf, &SZ, old);
       else       append_sgml (&buf, &SZ, old);
       sz = strlen(buf);
     }
+    free(old);
+    if (keep) continue;
     if (USE_ZSTD) put_chunk_zst (c, id, buf, sz+1);
     else          put_chunk     (c, id, buf, sz+1);
     *buf = '\0';
@@ -226,14 +232,14 @@ void merge_colls (char *_C, char *_A, char *_B) { // C = A + B
   uint nA = nvecs(A), nB = nvecs(B), n = MAX(nA,nB), i;
   fprintf (stderr, "merge: %s[%d] + %s[%d] -> %s\n", _A, nA, _B, nB, _C);
   for (i=1; i<=n; ++i) {
-    char *a = USE_ZSTD ? get_string_zst(A,i) : get_chunk(A,i);
-    char *b = USE_ZSTD ? get_string_zst(B,i) : get_chunk(B,i);
+    char *a = USE_ZSTD ? get_string_zst(A,i) : get_doc(A,i);
+    char *b = USE_ZSTD ? get_string_zst(B,i) : get_doc(B,i);
     if (a && b) buf = merge_blobs (buf,a,b);
     char *c = (a && b) ? buf : a ? a : b;
     uint sz = c ? (strlen(c)+1) : 0;
-    if (!c) continue;
-    if (USE_ZSTD) put_chunk_zst (C, i, c, sz);
-    else          put_chunk     (C, i, c, sz);
+    if (c && USE_ZSTD) put_chunk_zst (C, i, c, sz);
+    else if (c)        put_chunk     (C, i, c, sz);
+    free(a); free(b);
     if (!(i%10)) show_progress (i,n," blobs merged");
   }
   fprintf (stderr, "done: %s[%d]\n", _C, nvecs(C));
@@ -264,6 +270,7 @@ void rekey_coll (char *_A, char *_H, char *_B, char *_G, char *prm) { // A[j] =
   coll_t *B = open_coll (_B, "r+");
   uint i, j, nB = nvecs(B); assert (nB <= len(map));
   fprintf (stderr, "rekey: %s[%d] -> %s using map[%d]\n", _B, nB, _A, len(map));
+  zdoc_copy_dict (B, _A);
   for (i=1; i<=nB; ++i) {
     if (!(i%10)) show_progress (i,nB," blobs rekeyed");
     j = map[i-1];
@@ -275,7 +282,7 @@ void rekey_coll (char *_A, char *_H, char *_B, char *_G, char *prm) { // A[j] =
     } else {
       char *b = get_chunk(B,i);
       if (!b) continue;
-      put_chunk (A, j, b, strlen(b)+1);
+      put_chunk (A, j, b, chunk_sz(B,i)); // zdoc frames are not strings
     }
   }
   fprintf (stderr, "done: %s[%d]\n", _A, nvecs(A));
@@ -288,6 +295,7 @@ void mask_coll (char *_A, char *_B, char *_H) { // A[i] = B[i] for ids read from
   hash_t *H = _H ? open_hash (_H, "r") : NULL;
   char *key = NULL; size_t ksz = 0; ssize_t kn;
   uint done = 0;
+  zdoc_copy_dict (B, _A);
   while ((kn = getline (&key, &ksz, stdin)) > 0) {
     if (key[kn-1] == '\n') key[--kn] = '\0';
     uint id = H ? has_key(H, key) : (uint)atoi(key);
@@ -299,7 +307,7 @@ void mask_coll (char *_A, char *_B, char *_H) { // A[i] = B[i] for ids read from
     } else {
       char *b = get_chunk(B,id);
       if (!b) continue;
-      put_chunk (A, id, b, strlen(b)+1);
+      put_chunk (A, id, b, chunk_sz(B,id)); // zdoc frames are not strings
     }
     if (!(++done%100)) show_progress (done, 0, " blobs masked");
   }
@@ -337,9 +345,10 @@ void do_merge2 (char *_A, char *_H, char *_B, char *_G, char *prm) { // A[j] +=
     uint j = map ? map[i-1] : i; // if no map: same ids in A,B
     //uint j = (H&&G) ? id2id (G, i, H) : i;
     if (!j) continue; // not addnew and key not in A[H]
-    char *a = get_chunk(A,j), *b = get_chunk(B,i);
-    if (a && b) b = buf = merge_blobs (buf,a,b);
-    if (b) put_chunk (A, j, b, strlen(b)+1);
+    char *a = get_doc(A,j), *b = get_doc(B,i), *c = b;
+    if (a && b) c = buf = merge_blobs (buf,a,b);
+    if (c) put_chunk (A, j, c, strlen(c)+1);
+    free(a); free(b);
   }
   free_coll(A); free_coll(B); free_vec(buf); free_vec(map); // free_hash(H); free_hash(G);
   fprintf (stderr, "\n");
@@ -350,12 +359,19 @@ void do_rekey (char *_A, char *_H, char *_B, char *_G, char *prm) { // A[j] = B[
   uint *map = hash2hash (_G, _H, access), drop = 0;
   coll_t *A = open_coll (_A, "a+");
   coll_t *B = open_coll (_B, "r+");
+  int zdoc = is_zdoc (B);
   uint i, j, nB = nvecs(B); assert (nB <= len(map));
   fprintf (stderr, "rekey: %s[%d] -> %s using map[%d]\n", _B, nB, _A, len(map));
   for (i=1; i<=nB; ++i) {
     if (!(i%10)) show_progress (i,nB," blobs rekeyed");
     j = map[i-1];
     if (!j) { ++drop; continue; } // key not in A[H]
+    if (zdoc) { // A may have its own dictionary: store plain text
+      char *b = get_doc(B,i);
+      if (b) put_chunk (A, j, b, strlen(b)+1);
+      free(b);
+      continue;
+    }
     char *b = get_chunk(B,i);
     off_t sz = chunk_sz(B,i); // strlen(b)+1 only works for strings
     if (b) put_chunk (A, j, b, sz);
@@ -436,7 +452,8 @@ void do_out (ix_t *rnk, char *TEXT, char *RNDR){ // unsafe: system()
   system("mkdir src");
   for (r = rnk; r < rnk + len(rnk); ++r) {
     uint rank = r-rnk+1;
-    char *txt = get_chunk (text, r->i), path[1000];
+    char *txt = get_doc (text, r->i), path[1000];
+    if (!txt) txt = strdup ("");
 
     //printf ("# rank %6d doc %6d score %.4f\n", rank, r->i, r->x);
     if (RNDR && *RNDR) {
@@ -449,12 +466,11 @@ void do_out (ix_t *rnk, char *TEXT, char *RNDR){ // unsafe: system()
       system (path);
     }
 
-    txt = strdup (txt);
     csub (txt, "\r\n", ' '); //for (t = txt; *t; ++t) if (*t == '\n') *t = ' '; // chop newlines
     //erase_between (txt, "<DOC ", ">", ' ');
     printf ("<DOC id=\"%d\">", rank);
     printf ("%s\n", txt);
-    free(txt); // we made a copy
+    free(txt); // get_doc made a copy
     //    if (docs && dict) { // dump vectors from collection
     //      ix_t *doc = get_vec (docs, r->i), *d;
     //      sort_vec (doc, cmp_ix_X);
@@ -1341,14 +1357,14 @@ void xsum_chunks (char *C, char *H) {
   hash_t *h = *H ? open_hash (H, "r") : NULL;
   uint i, n = nvecs(c);
   for (i = 1; i <= n; ++i) {
-    char *doc = USE_ZSTD ? get_string_zst(c,i) : get_chunk(c,i);
+    char *doc = USE_ZSTD ? get_string_zst(c,i) : get_doc(c,i);
     if (!doc) continue;
     char *id = id2str(h,i);
     uint sz = strlen(doc);
     ulong cksum = sdbm_hash (doc, sz, 1);
     printf("%016lx\t%d\t%s\n", cksum, sz, id);
     free(id);
-    if (USE_ZSTD) free(doc);
+    free(doc);
   }
   free_coll(c); free_hash(h);
 }
@@ -1361,8 +1377,9 @@ void do_cksum (char *prm, int nC, char *_C[]) {
     ulong cksum = 1;
     for (i=I; i < I+len(I); ++i) {
       uint id = (*i % nvecs(C)) + 1;
-      char *s = get_chunk(C, id);
-      cksum = sdbm_hash (s, strlen(s), cksum);
+      char *s = get_doc(C, id); // same sum for plain and zdoc copies
+      if (s) cksum = sdbm_hash (s, strlen(s), cksum);
+      free(s);
     }
     printf("%016lx\t%s\n", cksum, _C[c]);
     fflush(stdout);
@@ -1391,6 +1408,9 @@ char *usage =
   "                                prm: addnew ... add new keys if not in a\n"
   "  -mask A = B [H] < ids       - read keys or ids from stdin, set A[i] = B[i]\n"
   "  -xsum XML [HASH]            - dump id + checksum for every doc in XML\n"
+  "  -zdoc XML ZXML [prm]        - XML -> ZXML, zstd with a trained dictionary\n"
+  "                                prm: dict=112640,level=5,sample=10000 docs\n"
+  "                                -dump, -xsum, query read ZXML as XML\n"
   //"  -stat XML HASH              - stats (cf,df) from collection XML -> stdout\n"
   "  -dmap XML HASH [prm]        - stdin: qryid docid, stdout: qryid XML[docid]\n"
   "  -qry 'query' DICT stem=L    - parse query\n"
@@ -1446,6 +1466,7 @@ int main (int argc, char *argv[]) {
     if (!strcmp (a(0), "-dmap")) dump_raw_ret (a(1), a(2), a(3));
     if (!strcmp (a(0), "size")) do_size (a(1));
     if (!strcmp (a(0), "-xsum")) xsum_chunks (a(1), a(2));
+    if (!strcmp (a(0), "-zdoc")) zdoc_build (a(1), a(2), a(3));
     if (!strncmp (a(0), "cksum", 5)) do_cksum (a(0), argc-1, argv+1);
     //if (!strcmp (a(0), "-stat")) do_stats (a(1), a(2));
     if (!strcmp (a(0), "-qry")) qry = do_qry (QRY=a(1), DICT=a(2), a(3));
@@ -21,10 +21,13 @@
 
 #include <math.h>
 #include <immintrin.h>
+#include <pthread.h>
 #include "bitvec.h"
 #include "matrix.h"
 #include "hash.h"
 #include "textutil.h"
+#include "synq.h"
+#include "simd.h"
 
 jix_t *ix2jix (uint j, ix_t *ix) {
   ix_t *v; jix_t *jix = new_vec (0, sizeof(jix_t));
@@ -47,31 +50,60 @@ uint vec_is_sorted (ix_t *V) {
   return 1;
 }
 
+#define SCAN_BLOCK (1<<16) // lines per key2id_batch in scan_jix
+
+// keys -> ids for one block of lines: row and col ids in line order
+static void scan_jix_ids (char **R, char **C, hash_t *rows, hash_t *cols, uint *J, uint *I) {
+  uint k, n = len(R);
+  if (rows && rows == cols) { // one table: interleave to keep key2id order
+    char **RC = new_vec (2*n, sizeof(char*));
+    uint *ID = new_vec (2*n, sizeof(uint));
+    for (k = 0; k < n; ++k) { RC[2*k] = R[k]; RC[2*k+1] = C[k]; }
+    key2id_batch (rows, RC, 2*n, ID, 1);
+    for (k = 0; k < n; ++k) { J[k] = ID[2*k]; I[k] = ID[2*k+1]; }
+    free_vec (RC); free_vec (ID);
+    return;
+  }
+  if (rows) key2id_batch (rows, R, n, J, 1);
+  else for (k = 0; k < n; ++k) J[k] = atol(R[k]);
+  if (cols) key2id_batch (cols, C, n, I, 1);
+  else for (k = 0; k < n; ++k) I[k] = atol(C[k]);
+}
+
 jix_t *scan_jix (FILE *in, uint maxlen, hash_t *rows, hash_t *cols) {
   jix_t *buf = new_vec (0, sizeof(jix_t)), new = {0,0,0};
-  char line[1000];
-  uint fskip=0, rskip=0, cskip=0, vskip=0;
-  while (fgets (line, 999, in)) {
-    if (!strcmp(line,"# END\n")) break; // end of block
-    if (*line == '#') continue; // skip over comments
-    char *row = tsv_value(line,1);
-    char *col = tsv_value(line,2);
-    char *val = tsv_value(line,3);
-    if (!row || !col || !val) {
-      if (++fskip<9) fprintf (stderr, "cannot parse: %100.100s...\n", line);
-      free(row); free(col); free(val);
-      continue;
+  char line[1000], **R = new_vec (0, sizeof(char*));
+  char **C = new_vec (0, sizeof(char*)), **X = new_vec (0, sizeof(char*));
+  uint *J = new_vec (SCAN_BLOCK, sizeof(uint)), *I = new_vec (SCAN_BLOCK, sizeof(uint));
+  uint fskip=0, rskip=0, cskip=0, vskip=0, end = 0, k;
+  while (!end) {
+    uint want = maxlen ? MIN (SCAN_BLOCK, maxlen - len(buf)) : SCAN_BLOCK;
+    len(R) = len(C) = len(X) = 0;
+    while (len(R) < want && !(end = !fgets (line, 999, in))) {
+      if (!strcmp(line,"# END\n")) { end = 1; break; } // end of block
+      if (*line == '#') continue; // skip over comments
+      char *row = tsv_value(line,1);
+      char *col = tsv_value(line,2);
+      char *val = tsv_value(line,3);
+      if (!row || !col || !val) {
+	if (++fskip<9) fprintf (stderr, "cannot parse: %100.100s...\n", line);
+	free(row); free(col); free(val);
+	continue;
+      }
+      R = append_vec (R, &row); C = append_vec (C, &col); X = append_vec (X, &val);
+    }
+    scan_jix_ids (R, C, rows, cols, J, I); // row id, column id -> integer
+    for (k = 0; k < len(R); ++k) {
+      new.j = J[k]; new.i = I[k]; new.x = atof(X[k]);
+      if      (!new.j) {if (++rskip<9) fprintf(stderr, "skipping row [%s] %s\t%s\t%s\n", R[k], R[k], C[k], X[k]);}
+      else if (!new.i) {if (++cskip<9) fprintf(stderr, "skipping col [%s] %s\t%s\t%s\n", C[k], R[k], C[k], X[k]);}
+      //else if (!new.x) { if (++vskip<9) fprintf (stderr, "skipping zero val %s", line); }
+      else buf = append_vec (buf, &new); // keep zero values
+      free(R[k]); free(C[k]); free(X[k]);
     }
-    new.j = rows ? key2id(rows, row) : atol(row); // row id -> integer
-    new.i = cols ? key2id(cols, col) : atol(col); // column id -> integer
-    new.x = atof(val);
-    if      (!new.j) {if (++rskip<9) fprintf(stderr, "skipping row [%s] %s", row, line);}
-    else if (!new.i) {if (++cskip<9) fprintf(stderr, "skipping col [%s] %s", col, line);}
-    //else if (!new.x) { if (++vskip<9) fprintf (stderr, "skipping zero val %s", line); }
-    else buf = append_vec (buf, &new); // keep zero values
-    free(row); free(col); free(val);
     if (maxlen && len(buf) >= maxlen) break;
   }
+  free_vec (R); free_vec (C); free_vec (X); free_vec (J); free_vec (I);
   sort_vec (buf, cmp_jix); // rsort?
   if (fskip || rskip || cskip)
     fprintf (stderr, "skipped posts: %d format, %d row, %d col, %d val\n", fskip, rskip, cskip, vskip);
@@ -981,18 +1013,17 @@ ix_t *parse_as_ngrams (char *str, hash_t *ids, int ngramsz, char *positional, ch
   return vec;
 }
 
-ix_t *parse_vec_txt (char *str, char **id, hash_t *ids, char *prm) { // thread-unsafe: stop_toks
-  char *positional = strstr (prm, "position");
+// tokens of a txt document after stemming, stopping and pairing, zero-copy:
+// they point into str, *buf (free after use) or the thread arena (reset here)
+static char **parse_toks_inplace (char *str, char **id, char *prm, char **_buf) {
   char *stemmer = getprmp (prm, "stem=", "L");
   uint gram = getprm (prm,"gram=",0), gram_hi = getprm (prm,":",gram);
   uint step = getprm (prm,"char=",1);
   uint toklen = getprm (prm, "toklen=", 50);
-  int ngramsz = getprm (prm,"ngramsz=",0);
   char *stop = strstr (prm, "stop");
   char *nowb = strstr (prm, "nowb");
   char *buf = 0, *ws = strstr(prm,"tokw") ? " \t\r\n" : NULL;
   if (id) *id = strdup (next_token (&str, " \t"));
-  if (ngramsz) return parse_as_ngrams (str, ids, ngramsz, positional, stop);
   if (nowb) squeeze (str, NULL, NULL); // squeeze out punctuation and spaces
   if (gram) {
     buf = malloc (1<<26);
@@ -1000,22 +1031,54 @@ ix_t *parse_vec_txt (char *str, char **id, hash_t *ids, char *prm) { // thread-u
     cgrams (str, gram, gram_hi, step, buf, 1<<26); // character n-grams
     str = buf; ws = " ";
   }
-  char **toks = str2toks (str, ws, toklen); // strdup (position lost)
-  if (stemmer) stem_toks (toks, stemmer); // free & strdup
-  if (stop)    stop_toks (toks); // free
-  char **pairs = strstr (prm,"w=") ? toks2pairs (toks,prm) : NULL;
-  ix_t *vec = toks2vec (pairs?pairs:toks, ids), *v;
-  if (positional) // sequential token positions
+  arena_reset ();
+  char **toks = str2toks_inplace (str, ws, toklen); // position lost
+  if (stemmer) stem_toks_inplace (toks, stemmer);
+  if (stop)    stop_toks_inplace (toks);
+  char **pairs = strstr (prm,"w=") ? toks2pairs_inplace (toks,prm) : NULL;
+  if (pairs) { free_vec (toks); toks = pairs; }
+  *_buf = buf;
+  return toks;
+}
+
+// same, but the tokens are copies: the part of parse_vec_txt that needs no
+// dictionary, safe to run in many threads
+char **parse_toks_txt (char *str, char **id, char *prm) {
+  char *buf = NULL, **toks = parse_toks_inplace (str, id, prm, &buf), **t;
+  for (t = toks; t < toks + len(toks); ++t) *t = strdup (*t);
+  free (buf);
+  return toks;
+}
+
+// look up the tokens: positions or frequencies, as in parse_vec_txt
+ix_t *toks2vec_txt (char **toks, hash_t *ids, char *prm) {
+  ix_t *vec = toks2vec (toks, ids), *v;
+  if (strstr (prm, "position")) // sequential token positions
     for (v = vec; v < vec + len(vec); ++v) v->x = v - vec + 1;
   else
     sort_uniq_vec (vec);
-  //if (stemmer) free(stemmer);
-  if (buf) free(buf);
-  free_toks (pairs);
-  free_toks (toks);
   return vec;
 }
 
+ix_t *parse_vec_txt (char *str, char **id, hash_t *ids, char *prm) {
+  int ngramsz = getprm (prm,"ngramsz=",0);
+  if (ngramsz) {
+    if (id) *id = strdup (next_token (&str, " \t"));
+    return parse_as_ngrams (str, ids, ngramsz, strstr (prm, "position"), strstr (prm, "stop"));
+  }
+  char *buf = NULL, **toks = parse_toks_inplace (str, id, prm, &buf);
+  ix_t *vec = toks2vec_txt (toks, ids, prm); // hashes the tokens where they are
+  free_vec (toks); free (buf);
+  return vec;
+}
+
+char **parse_toks_xml (char *str, char **id, char *prm) {
+  if (id) *id = get_xml_docid (str);
+  erase_between (str, "<DOCID>", "</DOCID>", ' ');
+  no_xml_tags (str);
+  return parse_toks_txt (str, NULL, prm); // normal text, but no docid
+}
+
 ix_t *parse_vec_xml (char *str, char **id, hash_t *ids, char *prm) {
   if (id) *id = get_xml_docid (str);
   erase_between (str, "<DOCID>", "</DOCID>", ' ');
@@ -1064,9 +1127,13 @@ uint *len_cols (coll_t *rows) {
   uint id, nr = num_rows(rows), nc = num_cols (rows);
   uint *X = new_vec (nc+1, sizeof(uint));
   for (id = 1; id <= nr; ++id) {
-    ix_t *row = get_vec_ro (rows,id), *end = row + len(row), *r = row-1;
-    assert (end == row || end[-1].i <= nc); // check out-of-range [DEBUG]
-    while (++r < end) X[r->i] += 1;
+    float *F = get_dense_ro (rows,id); uint j, n = F ? MIN (len(F), nc) : 0;
+    if (F) for (j = 1; j <= n; ++j) X[j] += 1; // dense: zeros count too, no ix_t copy
+    else {
+      ix_t *row = get_vec_ro (rows,id), *end = row + len(row), *r = row-1;
+      assert (end == row || end[-1].i <= nc); // check out-of-range [DEBUG]
+      while (++r < end) X[r->i] += 1;
+    }
     if (0 == id%100) show_progress (id, nr, "rows (len_cols)");
   }
   return X;
@@ -1112,6 +1179,15 @@ float *norm_cols (coll_t *rows, float p, float root) {
   uint id, nr = num_rows(rows), nc = num_cols(rows);
   float *X = new_vec (nc+1, sizeof(float));
   for (id = 1; id <= nr; ++id) {
+    float *F = get_dense_ro (rows,id); uint j, n = F ? MIN (len(F), nc) : 0;
+    if (F) { // dense: floats in place, no ix_t copy
+      if      (p == 1) for (j = 0; j < n; ++j) X[j+1] += ABS(F[j]);
+      else if (p == 2) for (j = 0; j < n; ++j) X[j+1] += F[j] * F[j];
+      else if (p == 0) for (j = 0; j < n; ++j) X[j+1] += (F[j] != 0);
+      else if (p ==.5) for (j = 0; j < n; ++j) X[j+1] += sqrt (ABS(F[j]));
+      else             for (j = 0; j < n; ++j) X[j+1] += powa (F[j], p);
+      continue;
+    }
     ix_t *row = get_vec_ro (rows, id), *end = row + len(row), *r = row-1;
     if      (p == 1) while (++r<end) X[r->i] += ABS(r->x);
     else if (p == 2) while (++r<end) X[r->i] += r->x * r->x;
@@ -1242,6 +1318,7 @@ void free_stats (stats_t *s) {
   if (s->df) free_vec (s->df);
   if (s->cf) free_vec (s->cf);
   if (s->s2) free_vec (s->s2);
+  if (s->mx) free_vec (s->mx);
   memset (s, 0, sizeof(stats_t));
   free_vec (s);
 }
@@ -1260,6 +1337,7 @@ static inline void grow_stats (stats_t *s, uint id) {
   if (s->df) s->df = resize_vec (s->df, id+1);
   if (s->cf) s->cf = resize_vec (s->cf, id+1);
   if (s->s2) s->s2 = resize_vec (s->s2, id+1);
+  if (s->mx) s->mx = resize_vec (s->mx, id+1);
 }
 
 void update_stats_from_vec (stats_t *s, ix_t *vec) {
@@ -1270,6 +1348,7 @@ void update_stats_from_vec (stats_t *s, ix_t *vec) {
     if (s->df) s->df [v->i] += (v->x != 0);
     if (s->cf) s->cf [v->i] += v->x;
     if (s->s2) s->s2 [v->i] += v->x * v->x;
+    if (s->mx) s->mx [v->i] = MAX (s->mx [v->i], v->x);
     s->nposts += v->x;
   }
   s->ndocs += 1;
@@ -1278,6 +1357,7 @@ void update_stats_from_vec (stats_t *s, ix_t *vec) {
 stats_t *coll_stats (coll_t *c) {
   uint r, nr = num_rows (c);
   stats_t *s = blank_stats (1,1,1,0);
+  s->mx = new_vec (0, sizeof(float));
   for (r = 1; r <= nr; ++r) {
     ix_t *vec = get_vec_ro (c, r);
     update_stats_from_vec (s, vec);
@@ -1334,13 +1414,20 @@ void save_stats (stats_t *s, char *path) {
   write_vec (s,     fmt(x,"%s.stats",path));
   write_vec (s->df, fmt(x,"%s.df",path));
   write_vec (s->cf, fmt(x,"%s.cf",path));
+  if (s->mx) write_vec (s->mx, fmt(x,"%s.mx",path));
 }
 
 stats_t *open_stats (char *path) {
   char x[1000];
   stats_t *s = read_vec (fmt(x,"%s.stats",path));
+  if (vesize(s) < sizeof(stats_t)) { // saved before stats_t grew
+    stats_t *old = s; s = new_vec (1, sizeof(stats_t));
+    memcpy (s, old, vesize(old));
+    free_vec (old);
+  }
   s->df      = read_vec (fmt(x,"%s.df",path));
   s->cf      = read_vec (fmt(x,"%s.cf",path));
+  s->mx = file_exists ("%s.mx",path) ? read_vec (fmt(x,"%s.mx",path)) : NULL;
   s->s2 = NULL;
   return s;
 }
@@ -1706,6 +1793,7 @@ void weigh_mtx_or_vec (coll_t *M, ix_t *V, char *prm, stats_t *s) {
   uint i=0, n = M ? num_rows (M) : 1;
   while (++i <= n) {
     ix_t *vec = M ? get_vec (M, i) : V;
+    char dense = M && has_dense (M, i);
     if (lmj) weigh_vec_lmj (vec, s);
     if (lmd) weigh_vec_lmd (vec, s);
     if (inq) weigh_vec_inq (vec, s);
@@ -1720,7 +1808,9 @@ void weigh_mtx_or_vec (coll_t *M, ix_t *V, char *prm, stats_t *s) {
     //if (r01) { vec_x_num (vec, '-', R.x); vec_x_num (vec, '/', R.y-R.x); }
     if (r01) weigh_vec_range01 (vec);
     if (l2p) softmax (vec);
-    if (M) { put_vec (M, i, vec); free_vec (vec); }
+    if (M && dense && is_dense (vec)) put_vec_dense (M, i, vec);
+    else if (M) put_vec (M, i, vec);
+    if (M) free_vec (vec);
   }
 }
 
@@ -1957,6 +2047,110 @@ void transpose_mtx (coll_t *rows, coll_t *cols) {
   free (buf); free (beg); free_vec (df);
 }
 
+// -------------------- external transpose --------------------
+
+typedef struct {
+  coll_t *rows; // opened "rs" if on disk => thread-safe, zero-copy reads
+  uint *beg;    // run r holds rows beg[r] ... beg[r+1]-1
+  ulong *np;    // run r holds np[r] postings
+  char *path;   // run r is spilled to path.run.r
+} runs_t;
+
+// number of postings in row id, read from the chunk header only
+static inline uint row_len (coll_t *rows, uint id) {
+  vec_t *hdr = has_vec (rows,id) ? get_chunk (rows, id) : NULL;
+  return hdr ? hdr->count : 0;
+}
+
+// worker: transpose one run of rows in memory, sort by (column,row), spill
+static int spill_run (uint r, void *arg) {
+  runs_t *R = arg; char x[9999]; uint id, shared = (R->rows->path != NULL);
+  jix_t *buf = new_vec (R->np[r], sizeof(jix_t)), *b = buf;
+  for (id = R->beg[r]; id < R->beg[r+1]; ++id) {
+    ix_t *row = shared ? get_vec_ro (R->rows, id) : get_vec_mp (R->rows, id), *d;
+    for (d = row; d < row + len(row); ++d, ++b) { b->j = d->i; b->i = id; b->x = d->x; }
+    if (!shared) free_vec (row);
+  }
+  assert (b == buf + len(buf));
+  sort_vec (buf, cmp_jix);
+  write_vec (buf, fmt (x, "%s.run.%d", R->path, r));
+  free_vec (buf);
+  return 0;
+}
+
+// heap of runs, smallest (column, run) on top: ties keep rows in order
+static inline int run_less (jix_t **cur, uint a, uint b) {
+  return (cur[a]->j != cur[b]->j) ? (cur[a]->j < cur[b]->j) : (a < b);
+}
+
+static void run_down (uint *H, uint n, jix_t **cur, uint k) {
+  uint c, top = H[k];
+  for (; (c = 2*k+1) < n; k = c) {
+    if (c+1 < n && run_less (cur, H[c+1], H[c])) ++c;
+    if (!run_less (cur, H[c], top)) break;
+    H[k] = H[c];
+  }
+  H[k] = top;
+}
+
+// one parallel pass over rows spilling sorted runs within mem=G, then
+// a single K-way merge writing the columns. prm: threads=N, mem=G
+void transpose_mtx_runs (coll_t *rows, coll_t *cols, char *prm) {
+  uint nt = MAX (1, getprm (prm,"threads=",0)), nr = num_rows (rows), nc = num_cols (rows);
+  ulong mem = getprm (prm,"mem=",0) * (1<<30);
+  if (!mem) mem = physical_memory () / 2;
+  ulong BS = MIN (mem / nt / sizeof(jix_t), 1lu<<31), np = 0, done = 0, tmp = 0;
+  cols->rdim = rows->cdim;
+  cols->cdim = rows->rdim;
+  runs_t R = {rows, new_vec (1, sizeof(uint)), new_vec (1, sizeof(ulong)), NULL};
+  char x[9999], msg[999]; uint id, r, K = 0;
+  if (rows->path) R.rows = open_coll (rows->path, "rs");
+  R.path = cols->path ? cols->path : "";
+  R.beg[0] = 1;
+  for (id = 1; id <= nr; ++id) { // cut rows into runs of <= BS postings
+    ulong n = row_len (R.rows, id);
+    if (R.np[K] && R.np[K] + n > BS) {
+      R.beg = append_vec (R.beg, &id);
+      R.np = append_vec (R.np, &n);
+      ++K;
+    } else R.np[K] += n;
+    np += n;
+  }
+  R.beg = append_vec (R.beg, &id); // nr+1
+  ++K;
+  fprintf (stderr, "[%.0fs] transposing %s [%d x %d]: %ldM posts in %d runs of <= %ldM, %d threads\n",
+	   vtime(), rows->path, nr, nc, np>>20, K, BS>>20, nt);
+  parallel (nt, K, spill_run, &R, "runs");
+  jix_t **run = new_vec (K, sizeof(jix_t*)), **cur = new_vec (K, sizeof(jix_t*));
+  uint *H = new_vec (K, sizeof(uint)), nH = 0;
+  for (r = 0; r < K; ++r) {
+    cur[r] = run[r] = open_vec (fmt (x, "%s.run.%d", R.path, r), "r", sizeof(jix_t));
+    tmp += vsizeof (vect (run[r]));
+    if (len(run[r])) H[nH++] = r;
+    if (len(run[r])) nc = MAX (nc, run[r][len(run[r])-1].j);
+  }
+  for (r = nH/2; r-- > 0;) run_down (H, nH, cur, r);
+  sprintf (msg, " posts merged from %d runs, %ldMB temp", K, tmp>>20);
+  ix_t *col = new_vec (0, sizeof(ix_t));
+  for (id = 1; id <= nc; ++id) { // column id <= heads of all runs
+    len(col) = 0;
+    while (nH && cur[r = H[0]]->j == id) {
+      jix_t *c = cur[r], *end = run[r] + len(run[r]);
+      for (; c < end && c->j == id; ++c) { ix_t p = {c->i, c->x}; col = append_vec (col, &p); }
+      if ((cur[r] = c) == end) H[0] = H[--nH];
+      run_down (H, nH, cur, 0);
+    }
+    ix_t *trg = map_vec (cols, id, len(col), sizeof(ix_t));
+    memcpy (trg, col, len(col) * sizeof(ix_t));
+    show_progress ((done += len(col)), np, msg);
+  }
+  assert (!nH && done == np);
+  for (r = 0; r < K; ++r) { free_vec (run[r]); unlink (fmt (x, "%s.run.%d", R.path, r)); }
+  fprintf (stderr, "\n[%.0fs] transposed %ldM posts -> %d cols, freed %ldMB temp\n", vtime(), np>>20, nc, tmp>>20);
+  if (R.rows != rows) free_coll (R.rows);
+  free_vec (R.beg); free_vec (R.np); free_vec (run); free_vec (cur); free_vec (H); free_vec (col);
+}
+
 coll_t *transpose (coll_t *M) {
   coll_t *T;
   char *path = M->path ? acat2(M->path,".T") : NULL;
@@ -1972,11 +2166,84 @@ coll_t *transpose (coll_t *M) {
   return T;
 }
 
-float *chk_SCORE (uint N) { // thread-unsafe: static
-  static float *SCORE = 0;
-  if (!SCORE) SCORE = new_vec (N+1, sizeof(float));
-  if (N+1 > len(SCORE)) SCORE = resize_vec (SCORE, N+1);
-  return SCORE;
+accum_t *new_accum (uint n) {
+  accum_t *A = safe_calloc (sizeof(accum_t));
+  A->S = new_vec (n+1, sizeof(float));
+  A->I = new_vec (n+1, sizeof(uint));
+  A->B = new_vec ((n>>6)+1, sizeof(ulong));
+  A->n = n;
+  return A;
+}
+
+void free_accum (accum_t *A) {
+  if (!A) return;
+  free_vec (A->S); free_vec (A->I); free_vec (A->B);
+  free (A);
+}
+
+accum_t *grow_accum (accum_t *A, uint n) {
+  if (!A) return new_accum (n);
+  if (n <= A->n) return A;
+  assert (!A->nI && "grow_accum: accumulator in use");
+  free_accum (A);
+  return new_accum (n);
+}
+
+static pthread_key_t ACCUM_KEY;
+static pthread_once_t ACCUM_ONCE = PTHREAD_ONCE_INIT;
+static void accum_key_init () { pthread_key_create (&ACCUM_KEY, (void (*)(void*)) free_accum); }
+
+// one accumulator per thread, freed when the thread exits
+accum_t *thread_accum (uint n) {
+  pthread_once (&ACCUM_ONCE, accum_key_init);
+  accum_t *A = pthread_getspecific (ACCUM_KEY), *B = grow_accum (A, n);
+  if (B != A) pthread_setspecific (ACCUM_KEY, B);
+  return B;
+}
+
+void clear_accum (accum_t *A) {
+  uint *i = A->I-1, *end = A->I + A->nI;
+  while (++i < end) { A->S[*i] = 0; A->B[*i >> 6] = 0; }
+  A->nI = A->nD = 0;
+}
+
+// dense row F: ids 1..n are marked touched once, then one SIMD pass
+void accum_axpy (accum_t *A, float a, float *F, uint n) {
+  uint id;
+  if (n > A->n) n = A->n;
+  for (id = A->nD + 1; id <= n; ++id) accum_at (A, id);
+  if (n > A->nD) A->nD = n;
+  simd_axpy (a, F, A->S + 1, n);
+}
+
+// touched ids -> sorted vector of non-zero scores, same as full2vec
+// how: 'I' sort the touched ids, 'B' walk the bitmap, 0: pick by density
+ix_t *accum2vec (accum_t *A, char how) {
+  uint nI = A->nI, *I = A->I, *i, *end = I + nI;
+  if (!how) how = (nI < (A->n >> 5)) ? 'I' : 'B'; // >3% touched => bitmap
+  ix_t *vec = new_vec (nI, sizeof(ix_t)), *v = vec;
+  if (how == 'I') {
+    qsort (I, nI, sizeof(uint), cmp_u);
+    for (i = I; i < end; ++i) {
+      if (*i && A->S[*i]) { v->i = *i; v->x = A->S[*i]; ++v; }
+      A->S[*i] = 0; A->B[*i >> 6] = 0;
+    }
+  } else {
+    ulong *b = A->B-1, *bEnd = A->B + len(A->B);
+    while (++b < bEnd) {
+      if (!*b) continue;
+      uint base = (b - A->B) << 6;
+      for (ulong w = *b; w; w &= w-1) {
+	uint id = base + __builtin_ctzl (w);
+	if (id && A->S[id]) { v->i = id; v->x = A->S[id]; ++v; }
+	A->S[id] = 0;
+      }
+      *b = 0;
+    }
+  }
+  A->nI = A->nD = 0;
+  len(vec) = v - vec;
+  return vec;
 }
 
 ix_t *full2vec (float *full) {
@@ -2104,128 +2371,58 @@ ix_t *rows_x_vec (coll_t *rows, ix_t *vec) {
   //float *VEC = vec2full (vec, 0);
   ix_t *out = const_vec (nvecs(rows), 0), *o;
   for (o = out; o < out + len(out); ++o) {
-    ix_t *row = get_vec (rows, o->i);
+    ix_t *row = borrow_vec (rows, o->i);
     o->x = dot(row,vec);
     //o->x = dot_full(row,VEC);
-    free_vec (row);
+    release_vec (row);
   }
   //free_vec (VEC);
   return out;
 }
 
-// same as cols_x_vec, but for short vecs
+// same as cols_x_vec, but for short vecs (thread-safe: get_vec_mp)
 ix_t *vec_x_rows (ix_t *vec, coll_t *rows) {
-  if (len(vec) == 1 && vec[0].x == 1) return get_vec (rows, vec[0].i);
+  if (len(vec) == 1 && vec[0].x == 1) return get_vec_mp (rows, vec[0].i);
   ix_t *sum = new_vec (0, sizeof(ix_t)), *v;
   for (v = vec; v < vec + len(vec); ++v) {
-    ix_t *row = get_vec (rows, v->i), *tmp = sum;
+    ix_t *row = get_vec_mp (rows, v->i), *tmp = sum;
     sum = vec_add_vec (1, sum, v->x, row);
     free_vec (row); free_vec (tmp);
   }
   return sum;
 }
 
-// same, but now we have columns of the matrix
-ix_t *cols_x_vec (coll_t *cols, ix_t *vec) {
-  float *SCORE = new_vec (cols->cdim + 1, sizeof(float)); // safe
+// SCORE[id] += v.x * col[v.i][id] in caller's A, how: see accum2vec
+ix_t *cols_x_vec_acc (accum_t *A, coll_t *cols, ix_t *vec, char how) {
   ix_t *v, *c, *col, *end;
   for (v = vec; v < vec + len(vec); ++v) {
-    //#pragma omp critical // no need if cols in memory
-    { col = get_vec_mp (cols, v->i); end = col + len(col); }
-    //#pragma omp parallel for private(c) // too slow
-    for (c = col; c < end; ++c) SCORE [c->i] += v->x * c->x;
-    free_vec (col);
+    col = borrow_row (cols, v->i); end = col + len(col);
+    if (vesize(col) == sizeof(float)) accum_axpy (A, v->x, (float*) col, len(col));
+    else for (c = col; c < end && c->i <= A->n; ++c) *accum_at (A, c->i) += v->x * c->x; // ids past A->n: appended since A was sized
+    release_vec (col);
   }
-  ix_t *result = full2vec (SCORE);
-  free_vec (SCORE);
-  return result;
+  return accum2vec (A, how);
 }
 
+// same, but now we have columns of the matrix
+ix_t *cols_x_vec (coll_t *cols, ix_t *vec) { return cols_x_vec_acc (thread_accum (cols->cdim), cols, vec, 0); }
+
 ix_t *cols_x_vec_overlap (coll_t *cols, ix_t *vec) { // coordination-level match
-  ix_t *v; float *SCORE = new_vec (cols->cdim + 1, sizeof(float)); // safe
+  accum_t *A = thread_accum (cols->cdim); ix_t *v;
   for (v = vec; v < vec + len(vec); ++v) {
     if (!v->x) continue;
-    ix_t *C = get_vec (cols, v->i), *c = C-1, *end = C+len(C);
-    while (++c < end) if (c->x) SCORE [c->i] += 1;
-    free_vec (C);
+    ix_t *C = borrow_vec (cols, v->i), *c = C-1, *end = C+len(C);
+    while (++c < end) if (c->x) *accum_at (A, c->i) += 1;
+    release_vec (C);
   }
-  ix_t *result = full2vec (SCORE);
-  free_vec (SCORE);
-  return result;
+  return accum2vec (A, 0);
 }
 
-void lock (int *x); // in synq.c
-void unlock (int *x);
-
-// static SCORE + seen ids
-ix_t *cols_x_vec_iseen (coll_t *cols, ix_t *V) {
-  static int mutex = 0;
-  static float *S = NULL; // persist across calls
-  lock (&mutex);
-  uint nS = cols->cdim + 1; // largest possible id
-  uint nR = nS / 100; // estimate number of results b
-  uint *I = new_vec (nR, sizeof(uint)), *i=I, *iEnd = I+len(I);
-  S = new_or_resize_vec(S, nS, sizeof(float));
-  ix_t *v, *vEnd = V+len(V), *R=NULL;
-  for (v = V; v < vEnd; ++v) {
-    ix_t *C = get_vec_ro (cols, v->i), *cEnd = C+len(C), *c;
-    for (c = C; c < cEnd; ++c) {
-      float x = c->x * v->x;
-      uint id = c->i;
-      if (i < iEnd && !S[id] && x) *i++ = id; // track id
-      S[id] += x;
-    }
-  }
-  if (i >= iEnd) R = full2vec(S); // ran out of space in I
-  else { // I contains all indices of S with nonzero scores
-    len(I) = i-I;
-    sort_vec (I, cmp_u);
-    R = ids2vec (I,0);
-    vec_x_full (R, '=', S);
-  }
-  free_vec (I);
-  unlock (&mutex);
-  return R;
-}
+// always sort the list of seen ids
+ix_t *cols_x_vec_iseen (coll_t *cols, ix_t *V) { return cols_x_vec_acc (thread_accum (cols->cdim), cols, V, 'I'); }
 
-// static SCORE + skip-lists
-ix_t *cols_x_vec_iskip (coll_t *cols, ix_t *V) {
-  static int mutex = 0;
-  static float *S=NULL; // persist across calls
-  static char *A=NULL, *B=NULL, *C=NULL, *D=NULL; // skip-lists
-  lock (&mutex);
-  const int a=4, b=8, c=12, d=16; //
-  uint nS = cols->cdim, i, di = 1;
-  S = new_or_resize_vec(S, 1+nS, sizeof(float));
-  A = new_or_resize_vec(A, 1+(nS>>a), sizeof(char)); // skip 16 at-a-time
-  B = new_or_resize_vec(B, 1+(nS>>b), sizeof(char)); // skip 256
-  C = new_or_resize_vec(C, 1+(nS>>c), sizeof(char)); // skip 4096
-  D = new_or_resize_vec(D, 1+(nS>>d), sizeof(char)); // skip 65536
-  memset (A, 1, len(A));
-  memset (B, 1, len(B));
-  memset (C, 1, len(C));
-  memset (D, 1, len(D));
-  ix_t *v, *vEnd = V+len(V);
-  for (v = V; v < vEnd; ++v) {
-    ix_t *U = get_vec_ro (cols, v->i), *uEnd = U+len(U), *u;
-    for (u = U; u < uEnd; ++u) {
-      i = u->i;
-      S[i] += u->x * v->x; // score
-      A[i>>a] = B[i>>b] = C[i>>c] = D[i>>d] = 0; // mark
-    }
-  }
-  ix_t *R = new_vec(0, sizeof(ix_t));
-  for (i=1; i<nS; i += di) {
-    ix_t new = {i, S[i]};
-    if (S[i]) R = append_vec(R, &new);
-    di = (D[i>>d] ? (1<<d) :
-	  C[i>>c] ? (1<<c) :
-	  B[i>>b] ? (1<<b) :
-	  A[i>>a] ? (1<<a) : 1);
-  }
-  unlock (&mutex);
-  return R;
-}
+// always walk the bitmap of seen ids
+ix_t *cols_x_vec_iskip (coll_t *cols, ix_t *V) { return cols_x_vec_acc (thread_accum (cols->cdim), cols, V, 'B'); }
 
 void rows_x_cols (coll_t *out, coll_t *rows, coll_t *cols) {
   //coll_t *cols = copy_coll (_cols); // in-memory
@@ -2247,11 +2444,11 @@ void rows_x_cols (coll_t *out, coll_t *rows, coll_t *cols) {
 void rows_x_rows (coll_t *P, coll_t *A, coll_t *B) {
   uint i = 0;
   while (++i <= num_rows (A)) {
-    ix_t *a = get_vec (A, i);
+    ix_t *a = borrow_vec (A, i);
     ix_t *p = rows_x_vec (B, a);
     chop_vec (p);
     put_vec (P, i, p);
-    free_vec (a); free_vec (p);
+    release_vec (a); free_vec (p);
   }
 }
 
@@ -2366,10 +2563,9 @@ void kmeans (coll_t *X, coll_t *M, coll_t *P, uint iter) {
 */
 
 double dot_full (ix_t *vec, float *full) {
-  double s = 0; uint n = len(full);
-  ix_t *v = vec-1, *end = vec+len(vec);
-  while (++v < end && v->i < n) s += v->x * full[v->i];
-  return s;
+  uint n = len(full), k = 0, nv = len(vec);
+  while (k < nv && vec[k].i < n) ++k; // stop at first id outside full
+  return simd_gather (vec, k, full);
 }
 
 double dot_dense (ix_t *vec, ix_t *dense) {
@@ -2381,6 +2577,7 @@ double dot_dense (ix_t *vec, ix_t *dense) {
 
 double dot (ix_t *A, ix_t *B) {
   if (!A || !B) return 0;
+  else if (is_dense(A) && is_dense(B) && len(A) == len(B)) return simd_dot_ix (A, B, len(A));
   else if (is_dense(A)) return dot_dense (B,A);
   else if (is_dense(B)) return dot_dense (A,B);
   double s = 0;
@@ -2427,8 +2624,7 @@ double pnorm_full (float p, ix_t *A, ix_t *B) { // faster version for full vecto
   double norm = 0, dx = 0;
   uint i = 0, n = len(A), m = len(B);
   assert ((n==m) && "full vector dimensions must agree");
-  if      (p==2)  for (; i<n; ++i) { dx = ABS(A[i].x - B[i].x); norm += dx * dx;   }
-  else if (p==1)  for (; i<n; ++i) { dx = ABS(A[i].x - B[i].x); norm += ABS(dx);   }
+  if      (p==2 || p==1) norm = simd_dist_ix (A, B, n, p);
   else if (p==0)  for (; i<n; ++i) { dx = ABS(A[i].x - B[i].x); norm += (dx!=0);   }
   else if (p==.5) for (; i<n; ++i) { dx = ABS(A[i].x - B[i].x); norm += sqrt(ABS(dx)); }
   else            for (; i<n; ++i) { dx = ABS(A[i].x - B[i].x); norm += powa(dx,p); }
@@ -2562,8 +2758,7 @@ uint *maxi (uint *V) {
 double sumf (float *V, float p) {
   float *end = V + len(V), *v = V-1;
   double s = 0;
-  if      (p == 1) while (++v < end) s += *v;
-  else if (p == 2) while (++v < end) s += *v * *v;
+  if (p == 1 || p == 2) return simd_sum (V, len(V), p);
   else if (p == 0) while (++v < end) s += (*v != 0);
   else if (p ==.5) while (++v < end) s += sqrt (*v);
   else             while (++v < end) s += powf (*v,p);
@@ -2575,18 +2770,7 @@ double dotf (float *A, float *B) {
   for (i=0; i<k; ++i) result += A[i] * B[i];
   return result; }
 
-double dotf_avx (float *A, float *B) {
-  uint n = len(A), m = len(B), k = MIN(m,n), i = 0;
-  __m256 sum = _mm256_setzero_ps();
-  for (; i + 8 <= k; i += 8) {
-    __m256 a = _mm256_loadu_ps(A + i);
-    __m256 b = _mm256_loadu_ps(B + i);
-    sum = _mm256_add_ps(sum, _mm256_mul_ps(a, b));
-  }
-  float tmp[8]; _mm256_storeu_ps(tmp, sum);
-  double result = tmp[0]+tmp[1]+tmp[2]+tmp[3]+tmp[4]+tmp[5]+tmp[6]+tmp[7];
-  for (; i < k; ++i) result += A[i] * B[i];
-  return result; }
+double dotf_avx (float *A, float *B) { return simd_dot (A, B, MIN(len(A),len(B))); }
 
 float *maxf (float *V) {
   float *end = V + len(V), *v = V-1, *m = V;
@@ -3005,32 +3189,108 @@ void vec_x_set (ix_t *vec, char op, char *set) {
   len(vec) = u - vec;
 }
 
+// ---------- intersections of sorted lists ----------
+
+// first element of [p,end) with id >= i, galloping then binary search
+ix_t *gallop_ix (ix_t *p, ix_t *end, uint i) {
+  uint step = 1;
+  if (p >= end || p->i >= i) return p;
+  while (p + step < end && p[step].i < i) { p += step; step <<= 1; }
+  ix_t *hi = (p + step < end) ? p + step : end; // p->i < i <= hi->i
+  while (hi - p > 1) { ix_t *mid = p + (hi - p) / 2; if (mid->i < i) p = mid; else hi = mid; }
+  return hi;
+}
+
+#define SKEW 32 // one list this many times longer => gallop through it
+
+// v is in F: append to w unless the result is zero (as chop_vec)
+static inline ix_t *keep_ix (ix_t *w, ix_t *v, ix_t *f, int sum) {
+  float x = sum ? (v->x + f->x) : v->x;
+  if (x && v->i) { w->i = v->i; w->x = x; ++w; }
+  return w;
+}
+
+#ifdef __SSE2__
+static inline __m128i ids4 (ix_t *p) { // p[0..3].i
+  __m128 a = _mm_loadu_ps ((float*) p), b = _mm_loadu_ps ((float*) (p+2));
+  return _mm_castps_si128 (_mm_shuffle_ps (a, b, _MM_SHUFFLE(2,0,2,0)));
+}
+
+// which of the ids in a are also in b (bit k: lane k)
+static inline uint match4 (__m128i a, __m128i b) {
+  __m128i m0 = _mm_cmpeq_epi32 (a, b);
+  __m128i m1 = _mm_cmpeq_epi32 (a, _mm_shuffle_epi32 (b, _MM_SHUFFLE(0,3,2,1)));
+  __m128i m2 = _mm_cmpeq_epi32 (a, _mm_shuffle_epi32 (b, _MM_SHUFFLE(1,0,3,2)));
+  __m128i m3 = _mm_cmpeq_epi32 (a, _mm_shuffle_epi32 (b, _MM_SHUFFLE(2,1,0,3)));
+  __m128i m = _mm_or_si128 (_mm_or_si128 (m0, m1), _mm_or_si128 (m2, m3));
+  return _mm_movemask_ps (_mm_castsi128_ps (m));
+}
+#endif
+
+// V = V AND F in place (sum: add F's weights), zero results dropped.
+// Galloping through the longer list when sizes are skewed, else a merge
+// that compares blocks of 4 ids against 4 at once.
+static void intersect (ix_t *V, ix_t *F, int sum) {
+  uint nV = len(V), nF = len(F);
+  ix_t *v = V, *f = F, *w = V, *endV = V + nV, *endF = F + nF;
+  if (nF / SKEW > nV) { // V rare: look up each v in F
+    for (; v < endV && f < endF; ++v) {
+      f = gallop_ix (f, endF, v->i);
+      if (f < endF && f->i == v->i) w = keep_ix (w, v, f++, sum);
+    }
+  } else if (nV / SKEW > nF) { // F rare: look up each f in V
+    for (; f < endF && v < endV; ++f) {
+      v = gallop_ix (v, endV, f->i);
+      if (v < endV && v->i == f->i) w = keep_ix (w, v++, f, sum);
+    }
+  } else {
+#ifdef __SSE2__
+    while (v + 4 <= endV && f + 4 <= endF) {
+      uint vmax = v[3].i, fmax = f[3].i, m = match4 (ids4 (v), ids4 (f)), k;
+      ix_t *g = f;
+      for (k = 0; m; ++k, m >>= 1) if (m & 1) { // w <= v+k: safe in place
+	while (g->i < v[k].i) ++g;
+	w = keep_ix (w, v+k, g, sum);
+      }
+      if (vmax <= fmax) v += 4;
+      if (fmax <= vmax) f += 4;
+    }
+#endif
+    while (v < endV && f < endF) {
+      if      (v->i > f->i) ++f; // f but not v => ignore
+      else if (v->i < f->i) ++v; // v not in f => skip
+      else { w = keep_ix (w, v, f, sum); ++v; ++f; } // v in f => keep
+    }
+  }
+  ix_t *V2 = resize_vec (V, w - V);
+  assert (V2 == V);
+}
+
 void filter_and (ix_t *V, ix_t *F) {
   if (!V || !F) return;
-  ix_t *v = V, *f = F, *endV = V + len(V), *endF = F + len(F);
-  while (v < endV && f < endF) {
-    if      (v->i >  f->i) { ++f; } // f but not v => ignore
-    else if (v->i <  f->i) { v->i = 0;  ++v; } // v not in f => skip
-    else if (v->i == f->i) { ++v; ++f; } // v in f => keep it
-  }
-  len(V) = v-V; // drop remaining elements in V (if any)
-  chop_vec (V);
+  intersect (V, F, 0);
 }
 
 void filter_not (ix_t *V, ix_t *F) {
   if (!V || !F) return;
-  ix_t *v = V, *f = F, *endV = V + len(V), *endF = F + len(F);
-  //fprintf (stderr, "# V[%d] - F[%d]", len(V), len(F));
-  //uint hit = 0;
-  while (v < endV && f < endF) {
+  uint nV = len(V), nF = len(F);
+  ix_t *v = V, *f = F, *endV = V + nV, *endF = F + nF;
+  if (nF / SKEW > nV) { // V rare: look up each v in F
+    for (; v < endV && f < endF; ++v) {
+      f = gallop_ix (f, endF, v->i);
+      if (f < endF && f->i == v->i) v->i = 0;
+    }
+  } else if (nV / SKEW > nF) { // F rare: look up each f in V
+    for (; f < endF && v < endV; ++f) {
+      v = gallop_ix (v, endV, f->i);
+      if (v < endV && v->i == f->i) (v++)->i = 0;
+    }
+  } else while (v < endV && f < endF) {
     if      (v->i >  f->i) { ++f; } // f but not v => ignore
     else if (v->i <  f->i) { ++v; } // v not in f => keep
     else if (v->i == f->i) { v->i = 0; ++v; ++f; } // v in f => skip
   } // keep remaining elements in V (they're not in F)
-  //fprintf (stderr, " -> V[%d]", len(V));
-  //uint leftV = endV - v, leftF = endF - f;
   chop_vec (V);
-  //fprintf (stderr, " -> V[%d] hit: %d leftV: %d leftF: %d\n", len(V), hit, leftV, leftF);
 }
 
 void filter_set (ix_t *V, ix_t *F, float def) {
@@ -3047,14 +3307,7 @@ void filter_set (ix_t *V, ix_t *F, float def) {
 
 void filter_and_sum (ix_t *V, ix_t *F) { // Boolean AND + SUM the scores
   if (!V || !F) return;
-  ix_t *v = V, *f = F, *endV = V + len(V), *endF = F + len(F);
-  while (v < endV && f < endF) {
-    if      (v->i >  f->i) { ++f; } // f but not v => ignore
-    else if (v->i <  f->i) { v->i = 0;  ++v; } // v not in f => skip
-    else if (v->i == f->i) { v->x += f->x; ++v; ++f; } // v in f => SUM
-  }
-  len(V) = v-V;
-  chop_vec (V);
+  intersect (V, F, 1);
 }
 
 void filter_sum (ix_t **V, ix_t *F) { // OR + sum scores + free old vec
@@ -39,6 +39,7 @@ typedef struct {
   double *s2; // sum of squares in each column
   double  k; // free parameter
   double  b; // free parameter
+  float  *mx; // largest value in each column: wand_qry bounds
 } stats_t;
 
 void uniq_jix (jix_t *vec) ;
@@ -97,6 +98,9 @@ ix_t *parse_vec_svm (char *str, char **id, hash_t *ids) ;
 ix_t *parse_vec_csv (char *str, char **id) ;
 ix_t *parse_vec_txt (char *str, char **id, hash_t *ids, char *prm) ;
 ix_t *parse_vec_xml (char *str, char **id, hash_t *ids, char *prm) ;
+char **parse_toks_txt (char *str, char **id, char *prm) ; // no dictionary:
+char **parse_toks_xml (char *str, char **id, char *prm) ; // thread-safe
+ix_t *toks2vec_txt (char **toks, hash_t *ids, char *prm) ; // -> parse_vec_txt
 ix_t *parse_as_ngrams (char *str, hash_t *ids, int ngramsz, char *pos, char *stop);
 
 void print_mtx (coll_t *rows, hash_t *rh, hash_t *ch, char *how) ;
@@ -111,6 +115,7 @@ void print_hdr_csv (hash_t *H, uint ncols);
 void transpose_mtx   (coll_t *rows, coll_t *cols) ;
 void transpose_mtx_1 (coll_t *rows, coll_t *cols) ;
 void transpose_mtx_2 (coll_t *rows, coll_t *cols) ;
+void transpose_mtx_runs (coll_t *rows, coll_t *cols, char *prm) ;
 coll_t *transpose (coll_t *M) ;
 
 uint last_id (ix_t *vec) ;
@@ -185,8 +190,30 @@ double log_sum_exp (ix_t *vec) ;
 void softmax (ix_t *vec) ; // log2posterior
 void col_softmax (coll_t *trg, coll_t *M) ;
 
-float *chk_SCORE (uint N) ;
-
+typedef struct {
+  float *S; // S[id] = accumulated score, zero unless id was touched
+  uint  *I; // touched ids, in order of first touch
+  ulong *B; // bitmap: bit id is set iff id is in I
+  uint  nI; // number of touched ids
+  uint   n; // ids 0..n fit into the accumulator
+  uint  nD; // ids 1..nD are touched (dense rows added by accum_axpy)
+} accum_t; // sparse accumulator: dense scores + touched ids
+
+accum_t *new_accum (uint n) ;
+void free_accum (accum_t *A) ;
+accum_t *grow_accum (accum_t *A, uint n) ; // A must be clear
+accum_t *thread_accum (uint n) ; // per-thread accumulator, reused across calls
+void clear_accum (accum_t *A) ; // zero touched scores in O(touched)
+ix_t *accum2vec (accum_t *A, char how) ; // non-zero scores, clears A
+void accum_axpy (accum_t *A, float a, float *F, uint n) ; // S[1..n] += a * F[0..n-1]
+
+static inline float *accum_at (accum_t *A, uint id) { // &S[id], mark id touched
+  ulong *b = A->B + (id >> 6), m = 1lu << (id & 63);
+  if (!(*b & m)) { *b |= m; A->I[A->nI++] = id; }
+  return A->S + id;
+}
+
+uint is_dense (ix_t *V) ; // ids are exactly 1..len(V)
 ix_t *full2vec (float *full) ;
 ix_t *double2vec (double *full) ;
 ix_t *full2vec_keepzero (float *full) ;
@@ -206,6 +233,7 @@ void filter_rows (coll_t *rows, char op, ix_t *mask) ;
 void rows_x_num (coll_t *rows, char op, double num) ;
 ix_t *cols_x_vec_iseen (coll_t *cols, ix_t *V) ; // SCORE + list of seen ids
 ix_t *cols_x_vec_iskip (coll_t *cols, ix_t *V) ; // SCORE + skip-lists
+ix_t *cols_x_vec_acc (accum_t *A, coll_t *cols, ix_t *V, char how) ; // A: caller's, ids < A->n
 
 void dedup_items (ix_t *set, coll_t *VECS, float thresh, uint limit) ;
 
@@ -281,6 +309,7 @@ void vec_x_num (ix_t *A, char op, double b) ;
 void vec_x_range (ix_t *A, char op, xy_t R) ;
 ix_t *vec_add_vec (float x, ix_t *X, float y, ix_t *Y) ;
 void vec_mul_vec (ix_t *V, ix_t *F) ; // fast, sparse, in-place
+ix_t *gallop_ix (ix_t *p, ix_t *end, uint i) ; // first in [p,end) with id >= i
 void filter_and (ix_t *V, ix_t *F) ; // in-place
 void filter_not (ix_t *V, ix_t *F) ; // in-place
 void filter_set (ix_t *V, ix_t *F, float def) ;
@@ -22,11 +22,18 @@
 #include <stdio.h>
 #include <math.h>
 #include <err.h>
+#include <sched.h>
+#include <pthread.h>
 //#include <omp.h>
 #include "matrix.h"
 #include "textutil.h"
+#include "timeutil.h"
 #include "svm.h"
 #include "zvec.h"
+#include "synq.h"
+#include "simd.h"
+#include "cluster.h"
+#include "ann.h"
 
 //void mtx_reset_corrupt (char *C) { free_coll (open_coll (C,"a")); } // now in testvec
 
@@ -42,6 +49,38 @@ void mtx_copy (char *SRC, char *TRG) {
   free_coll (S); free_coll (T);
 }
 
+// block-compress rows of SRC (see pvec.h), "B = A" unpacks them
+void mtx_pack (char *TRG, char *SRC, char *prm) {
+  uint q = getprm (prm,"q=",0);
+  coll_t *S = open_coll (SRC, "r+"), *T = open_coll (TRG, "w+");
+  uint id, n = num_rows(S);
+  for (id = 1; id <= n; ++id) {
+    ix_t *vec = get_vec(S,id);
+    if (len(vec)) put_vec_pack(T,id,vec,q);
+    if (!(id%10)) show_progress (id, n, " rows packed");
+    free_vec(vec);
+  }
+  fprintf (stderr, "[%.0fs] %s: %.1fMB -> %s: %.1fMB\n", vtime(),
+	   SRC, S->offs[0]/1E6, TRG, T->offs[0]/1E6);
+  free_coll (S); free_coll (T);
+}
+
+void mtx_dense (char *TRG, char *SRC) {
+  coll_t *S = open_coll (SRC, "r+"), *T = open_coll (TRG, "w+");
+  uint id, n = num_rows(S), nd = 0;
+  T->rdim = S->rdim; T->cdim = S->cdim;
+  for (id = 1; id <= n; ++id) {
+    ix_t *vec = get_vec(S,id);
+    if (len(vec)) put_vec_dense(T,id,vec); // rows not dense are kept as they are
+    if (len(vec) && (vesize(vec) == sizeof(float) || is_dense(vec))) ++nd;
+    if (!(id%10)) show_progress (id, n, " rows");
+    free_vec(vec);
+  }
+  fprintf (stderr, "[%.0fs] %s: %.1fMB -> %s: %.1fMB, %d of %d rows dense\n", vtime(),
+	   SRC, S->offs[0]/1E6, TRG, T->offs[0]/1E6, nd, n);
+  free_coll (S); free_coll (T);
+}
+
 void mtx_size (char *_M, char *prm) {
   coll_t *M = open_coll (_M,"r+");
   if      (strstr(prm,":r")) printf ("%u\n", num_rows(M));
@@ -143,6 +182,85 @@ void mtx_from_kvs (char *_MTX, char *_COL, char *_KVS, char *prm) {
   free_hash(COL);
 }
 
+// parallel load:txt / load:xml: reader thread -> pool of tokenisers ->
+// writer (the caller). The writer puts documents back in input order and
+// does all dictionary lookups, so ids come out as in the serial loader.
+
+#define LOAD_WINDOW 1024 // documents in flight
+
+typedef struct {
+  char *prm, *BEG, *END;
+  int xml;
+  synq_t *in, *out;
+  _Atomic ulong read; // documents read from stdin
+  _Atomic ulong done; // documents written
+  _Atomic int eof;
+} load_t;
+
+typedef struct {
+  ulong seq; // position in the input
+  char *doc; // raw text, NULL once tokenised
+  char *id;
+  char **toks;
+  load_t *L;
+} ldoc_t;
+
+static void *load_reader (void *arg) {
+  load_t *L = arg;
+  char *buf = malloc(1<<24);
+  while (read_doc (stdin, buf, 1<<24, L->BEG, L->END)) {
+    if (!L->xml && *buf == '#') continue; // skip comments (lines starting with '#')
+    ulong seq = atomic_load (&L->read);
+    while (seq - atomic_load (&L->done) >= LOAD_WINDOW) sched_yield(); // writer behind
+    ldoc_t *d = safe_calloc (sizeof (ldoc_t));
+    d->seq = seq; d->doc = strdup (buf); d->L = L;
+    while (!synq_push (L->in, d)) sched_yield();
+    atomic_store (&L->read, seq+1);
+  }
+  atomic_store (&L->eof, 1);
+  free (buf);
+  return NULL;
+}
+
+static void *load_tokenise (void *arg) {
+  ldoc_t *d = arg; load_t *L = d->L;
+  d->toks = (L->xml ? parse_toks_xml (d->doc, &d->id, L->prm) :
+	     parse_toks_txt (d->doc, &d->id, L->prm));
+  free (d->doc); d->doc = NULL;
+  return d;
+}
+
+static void mtx_load_parallel (coll_t *m, hash_t *rh, hash_t *ch, char *xml, char ifdup, char *prm, uint nt) {
+  load_t L = {prm, (xml ? "<DOC" : ""), (xml ? "</DOC>" : "\n"), (xml != NULL),
+	      synq_new (LOAD_WINDOW), synq_new (LOAD_WINDOW), 0, 0, 0};
+  ldoc_t **ring = safe_calloc (LOAD_WINDOW * sizeof (ldoc_t*)), *d;
+  char *sparse = strstr(prm,"sparse");
+  pool_t *P = new_pool (nt, L.in, L.out, load_tokenise);
+  pthread_t reader;
+  pthread_create (&reader, NULL, load_reader, &L);
+  ulong done = 0;
+  while (1) {
+    while ((d = synq_pop (L.out))) ring [d->seq % LOAD_WINDOW] = d;
+    if (!(d = ring [done % LOAD_WINDOW])) { // next document not ready
+      if (atomic_load (&L.eof) && done == atomic_load (&L.read)) break;
+      sched_yield(); continue;
+    }
+    ring [done % LOAD_WINDOW] = NULL;
+    ix_t *vec = toks2vec_txt (d->toks, ch, prm);
+    if (sparse) chop_vec (vec);
+    uint rowid = rh ? key2id(rh,d->id) : (uint) atoi(d->id);
+    mtx_append (m, rowid, vec, ifdup);
+    free (d->id); free_toks (d->toks); free (d);
+    free_vec (vec);
+    atomic_store (&L.done, ++done);
+    show_progress (done, 0, " rows");
+  }
+  pthread_join (reader, NULL);
+  stop_pool (P);
+  synq_free (L.in); synq_free (L.out);
+  free (ring);
+}
+
 void mtx_load (char *M, char *RH, char *CH, char *type, char *prm) {
   ulong done = 0;
   char *buf = malloc(1<<24), *id = 0;
@@ -166,7 +284,12 @@ void mtx_load (char *M, char *RH, char *CH, char *type, char *prm) {
   fprintf (stderr, "[%.0fs] stdin --> %s [%s x %s] permissions: %s,%s,%s\n", vtime(),
 	   m->path, (rh ? rh->path : "numbers"), (ch ? ch->path : "numbers"),
 	   m->access, (rh ? rh->access : "-"),  (ch ? ch->access : "-"));
+  uint nt = getprm (prm,"threads=",1);
+  char *stemcache = getprms (prm,"stemcache=",NULL,",");
+  if (stemcache) stem_cache_load (stemcache);
   if (rcv) scan_mtx (m, NULL, rh, ch, prm);
+  else if (nt > 1 && (txt || xml) && !getprm (prm,"ngramsz=",0))
+    mtx_load_parallel (m, rh, ch, xml, ifdup, prm, nt);
   else while (read_doc (stdin, buf, 1<<24, BEG, END)) {
       if (!xml && *buf == '#') continue; // skip comments (lines starting with '#')
       ix_t *vec = (xml ? parse_vec_xml (buf, &id, ch, prm) :
@@ -187,10 +310,16 @@ void mtx_load (char *M, char *RH, char *CH, char *type, char *prm) {
   //if (symlink (RH, cat(M,"/hash.rows"))) perror (RH);
   //if (symlink (CH, cat(M,"/hash.cols"))) perror (CH);
   fprintf (stderr, "[%.0fs] %d rows, %d cols\n", vtime(), num_rows(m), num_cols(m));
+  ulong hits, misses;
+  stem_cache_stats (&hits, &misses);
+  if (hits + misses) fprintf (stderr, "[%.0fs] stem cache: %lu lookups, %.1f%% hits\n",
+			      vtime(), hits + misses, 100. * hits / (hits + misses));
+  if (stemcache) stem_cache_save (stemcache);
   free_coll (m);
   free_hash (rh);
   if (ch!=rh) free_hash (ch);
   if (p) free(p);
+  if (stemcache) free(stemcache);
   free (buf);
 }
 
@@ -560,6 +689,7 @@ void mtx_weigh (char *TRG, char *prm, char *SRC, char *STATS) { // thread-unsafe
     show_progress (id, nv, " vecs");
     if (!has_vec (src, id)) continue;
     ix_t *vec = get_vec (src, id), *tmp = 0; // *e = vec + len(vec), *v = vec-1;
+    char dense = has_dense (src, id);
     if (!len(vec)) { free_vec (vec); continue; }
     if      (inq) weigh_vec_inq (vec, stats);
     else if (idf) weigh_vec_idf (vec, stats);
@@ -620,7 +750,8 @@ void mtx_weigh (char *TRG, char *prm, char *SRC, char *STATS) { // thread-unsafe
     if      (sorti) sort_vec (vec, cmp_ix_i);
     else if (sortx) sort_vec (vec, cmp_ix_x);
     else if (sortX) sort_vec (vec, cmp_ix_X);
-    put_vec (trg, id, vec);
+    if (dense && is_dense (vec)) put_vec_dense (trg, id, vec); // keep dense rows dense
+    else put_vec (trg, id, vec);
     free_vec (vec);
   }
 
@@ -637,10 +768,10 @@ void mtx_transpose (char *prm, char *src, char *trg) {
   coll_t *T = open_coll (trg, "w+");
   float MB = M->offs[0] / (1<<20), ETA = MB/1400;
   fprintf (stderr, "transposing %s %.0fMB, should be done in %.1f minutes\n", src, MB, ETA);
-  transpose_mtx (M,T); // rdim/cdim updated here
+  if (strstr (prm,"bands")) transpose_mtx (M,T); // rdim/cdim updated here
+  else transpose_mtx_runs (M,T,prm);
   free_coll (T);
   free_coll (M);
-  (void) prm;
 }
 
 void mtx_window (char *PxW, char *DxW, char *MAP, char *prm) {
@@ -825,6 +956,207 @@ void mtx_colset (char *_A, char *_B, char *_H) {
   free_coll (A); free_coll (B);
 }
 
+typedef struct {
+  coll_t *P, *A, *B;    // product P = A x B
+  float *SA, *SB, p;    // row norms of A, column norms of B
+  char sim; int keepz, top; float thresh; uint merge, nA, nB;
+  _Atomic uint next;    // next row of A to be claimed by a worker
+  _Atomic uint wrote;   // all rows <= wrote have been written to P
+  _Atomic(ix_t*) *ring; // finished rows waiting for the writer: ring[id % W]
+  uint W;               // ring size: how far workers can run ahead of writer
+  volatile int lk;      // writer lock
+} product_t;
+
+static ix_t SKIP_ROW; // marks rows of A that produce no output
+
+// compute row id of the product into accumulator S (clear on entry and exit)
+static ix_t *product_row (product_t *c, uint id, accum_t *Acc) {
+  char sim = c->sim; float *SA = c->SA, *SB = c->SB, p = c->p, *S = Acc->S;
+  uint j, nB = c->nB, *i, *iEnd;
+  if (!has_vec(c->A,id)) return &SKIP_ROW;
+  ix_t *_a = borrow_vec (c->A, id), *a = _a-1, *aEnd = _a+len(_a);
+  if (!len(_a)) { release_vec(_a); return &SKIP_ROW; }
+  if (len(_a) < c->merge) {
+    ix_t *_c = (len(_a) == 1) ? get_vec_mp (c->B, _a->i) : vec_x_rows (_a, c->B);
+    release_vec(_a);
+    return _c;
+  }
+  while (++a < aEnd) {
+    ix_t *_b = borrow_row (c->B, a->i), *b, *bEnd; float *s;
+    if (vesize(_b) == sizeof(float)) { // dense row of B
+      if (sim == '2') simd_axpy (a->x, (float*) _b, S+1, MIN (len(_b), nB));
+      else if (index (".CDJ", sim)) accum_axpy (Acc, a->x, (float*) _b, len(_b));
+      if (index (".CDJ2", sim)) { release_vec (_b); continue; }
+      release_vec (_b); _b = borrow_vec (c->B, a->i); // other similarities: as ix_t
+    }
+    b = _b-1; bEnd = _b+len(_b);
+    switch (sim) {
+    case 'H': while (++b<bEnd) *accum_at(Acc,b->i) += sqrt ((a->x / SA[id]) * (b->x / SB[b->i])); break;
+    case 'X': while (++b<bEnd) *accum_at(Acc,b->i) +=  2 / ((SA[id] / a->x) + (SB[b->i] / b->x)); break;
+    case 'n':
+    case 'N': while (++b<bEnd) S[b->i] += powa(a->x-b->x,p) - powa(a->x,p) - powa(b->x,p); break;
+    case '0': while (++b<bEnd) S[b->i] +=    (a->x != b->x) -    (a->x!=0) -    (b->x!=0); break;
+    case '1': while (++b<bEnd) S[b->i] +=    ABS(a->x-b->x) -    ABS(a->x) -    ABS(b->x); break;
+    case '2': while (++b<bEnd) S[b->i] += a->x * b->x;                                     break;
+    case 'C':
+    case 'D':
+    case 'J':
+    case '.': while (++b<bEnd) *accum_at(Acc,b->i) += a->x * b->x;                         break;
+    case 'B': while (++b<bEnd) *accum_at(Acc,b->i) += (a->x > 0) && (b->x > 0);            break;
+    case 'k': while (++b<bEnd) { s = accum_at(Acc,b->i); *s = MAX (*s, MIN (a->x, b->x)); } break;
+    case 's': while (++b<bEnd) *accum_at(Acc,b->i) += MIN (a->x, b->x);                    break;
+    case 'S': while (++b<bEnd) *accum_at(Acc,b->i) += MAX (a->x, b->x);                    break;
+    case 'M': while (++b<bEnd) { s = accum_at(Acc,b->i); *s = MAX (*s, (a->x * b->x)); }   break;
+    case 'm': while (++b<bEnd) { s = accum_at(Acc,b->i); *s = MIN (*s, (a->x * b->x)); }   break;
+    }
+    release_vec (_b);
+  }
+  i = Acc->I - 1; iEnd = Acc->I + Acc->nI; // only touched ids can be non-zero
+  switch (sim) {
+  case 'C': while (++i<iEnd) if (S[*i]) S[*i] /=    sqrt (SA[id] * SB[*i]); break;
+  case 'D': while (++i<iEnd) if (S[*i]) S[*i] /=   0.5 * (SA[id] + SB[*i]); break;
+  case 'J': while (++i<iEnd) if (S[*i]) S[*i] /= (-S[*i] + SA[id] + SB[*i]); break;
+  case 'H': while (++i<iEnd) S[*i] = 1 - sqrt (ABS(1 - S[*i]));             break;
+  //case 'X': for (j=1;j<=nB;++j) S[j] = -(1 - S[j]);                         break;
+  case '0':
+  case '1':
+  case 'N': for (j=1;j<=nB;++j) S[j] =     -(SA[id] + SB[j] +   S[j]);      break;
+  case 'n': for (j=1;j<=nB;++j) S[j] = -powa(SA[id] + SB[j] +   S[j], 1/p); break;
+  case '2': for (j=1;j<=nB;++j) S[j] = -sqrt(SA[id] + SB[j] - 2*S[j]);      break;
+  case 'B': while (++i<iEnd) S[*i] = (S[*i] == len(_a));                    break;
+  case 'k': for (a=_a;a<aEnd;++a) { float *s = accum_at(Acc,a->i); *s = MAX (*s, a->x); } break;
+  }
+  ix_t *_c = c->keepz ? full2vec_keepzero(S) : accum2vec(Acc,0); // zeroes S
+  clear_accum (Acc); // forget ids touched in keepz mode
+  //if (rbf) vec_x_num (_c, 'r', rbf);
+  if (c->top) trim_vec (_c, c->top);
+  if (c->thresh) vec_x_num (_c, 'T', c->thresh);
+  if (!c->keepz) chop_vec (_c);
+  release_vec (_a);
+  return _c;
+}
+
+// write finished rows to P in order of id, so P is identical to a serial run
+static void product_flush (product_t *c) {
+  lock (&c->lk);
+  uint id = atomic_load (&c->wrote) + 1;
+  ix_t *_c;
+  while (id <= c->nA && (_c = atomic_load (&c->ring[id % c->W]))) {
+    atomic_store (&c->ring[id % c->W], NULL);
+    if (_c != &SKIP_ROW) {
+      put_vec_write (c->P, id, _c);
+      free_vec (_c);
+      show_progress (id, c->nA, " rows");
+    }
+    atomic_store (&c->wrote, id++);
+  }
+  unlock (&c->lk);
+}
+
+// worker: own score accumulator, claims rows of A one at a time
+static int product_worker (uint task, void *arg) {
+  product_t *c = arg; (void) task;
+  accum_t *S = new_accum (c->nB);
+  for (;;) {
+    uint id = atomic_fetch_add (&c->next, 1);
+    if (id > c->nA) break;
+    while (id - atomic_load (&c->wrote) >= c->W) sched_yield(); // writer behind
+    atomic_store (&c->ring[id % c->W], product_row (c, id, S));
+    product_flush (c);
+  }
+  free_accum (S);
+  return 0;
+}
+
+// sparse A x dense B (SpMM): B is copied into one float matrix, rows of A
+// are taken in batches and every tile of B rows is swept by the whole batch
+// before moving on, so the tile stays in cache while rows of A scatter into it
+typedef struct {
+  coll_t *A;
+  float *B;       // B [(w-1)*K + k-1] = B[w,k]
+  uint nW, K;     // rows, columns of B
+  uint lo, hi;    // rows of A in this round
+  uint batch;     // rows of A per task
+  uint tile;      // rows of B per tile
+  ix_t **out;     // out [r-lo] = row r of the product
+  int top; float thresh;
+} spmm_t;
+
+static int spmm_task (uint t, void *arg) {
+  spmm_t *c = arg;
+  uint K = c->K, r0 = c->lo + t * c->batch, n = MIN (c->batch, c->hi + 1 - r0), i, k, w0;
+  ix_t **A = c->out + (r0 - c->lo), **pos = safe_calloc (n * sizeof(ix_t*));
+  float *C = safe_calloc ((ulong) n * K * sizeof(float));
+  for (i = 0; i < n; ++i) {
+    A[i] = has_vec (c->A, r0+i) ? get_vec_mp (c->A, r0+i) : NULL;
+    for (k = 1; A[i] && k < len(A[i]); ++k)
+      if (A[i][k].i <= A[i][k-1].i) { sort_vec (A[i], cmp_ix_i); break; }
+    pos[i] = A[i];
+  }
+  for (w0 = 1; w0 <= c->nW; w0 += c->tile) { // tile: rows w0 .. w0+tile-1 of B
+    uint w1 = MIN (w0 + c->tile, c->nW + 1);
+    for (i = 0; i < n; ++i) {
+      if (!A[i]) continue;
+      ix_t *a = pos[i], *end = A[i] + len(A[i]);
+      float *Ci = C + (ulong) i * K;
+      for (; a < end && a->i < w1; ++a)
+	if (a->i) simd_axpy (a->x, c->B + (ulong) (a->i - 1) * K, Ci, K);
+      pos[i] = a;
+    }
+  }
+  for (i = 0; i < n; ++i) { // dense rows of C -> ix_t, as product_row
+    if (!A[i] || !len(A[i])) { free_vec (A[i]); A[i] = NULL; continue; }
+    float *Ci = C + (ulong) i * K;
+    ix_t *p = A[i] = resize_vec (A[i], K), *q = p;
+    for (k = 0; k < K; ++k) if (Ci[k]) { q->i = k+1; q->x = Ci[k]; ++q; }
+    len(p) = q - p;
+    if (c->top) trim_vec (p, c->top);
+    if (c->thresh) vec_x_num (p, 'T', c->thresh);
+    chop_vec (p);
+  }
+  free (pos); free (C);
+  return 0;
+}
+
+// B rows (first 100) stored dense or spanning ids 1..n, and B fits in memory
+static int dense_B (coll_t *B, uint nB) {
+  uint w, n = 0, nW = num_rows (B);
+  if (!nB || nB > 65536 || (ulong) nW * nB * sizeof(float) > physical_memory () / 4) return 0;
+  for (w = 1; w <= nW && n < 100; ++w) {
+    if (!has_vec (B,w)) continue;
+    if (!has_dense (B,w) && !is_dense (get_vec_ro (B,w))) return 0;
+    ++n;
+  }
+  return n > 0;
+}
+
+static void spmm_product (coll_t *P, coll_t *A, coll_t *B, uint nA, uint K, uint nt, int top, float thresh) {
+  uint nW = num_rows (B), w, r, n, batch = 64, round = batch * nt * 4;
+  float *M = safe_calloc ((ulong) nW * K * sizeof(float));
+  for (w = 1; w <= nW; ++w) {
+    float *F = has_dense (B,w) ? get_dense_ro (B,w) : NULL, *Mw = M + (ulong) (w-1) * K;
+    if (F) memcpy (Mw, F, MIN (len(F), K) * sizeof(float));
+    else {
+      ix_t *V = get_vec_ro (B,w), *v;
+      for (v = V; v < V + len(V); ++v) if (v->i && v->i <= K) Mw[v->i-1] = v->x;
+    }
+  }
+  spmm_t c = {.A=A, .B=M, .nW=nW, .K=K, .batch=batch, .tile=MAX (1, (256<<10) / (K * sizeof(float))),
+	      .out=safe_calloc (round * sizeof(ix_t*)), .top=top, .thresh=thresh};
+  fprintf (stderr, "[%.0fs] B is dense [%dx%d]: SpMM, %d rows of A per task, %d rows of B per tile\n",
+	   vtime(), nW, K, c.batch, c.tile);
+  for (c.lo = 1; c.lo <= nA; c.lo += round) {
+    c.hi = MIN (nA, c.lo + round - 1); n = c.hi - c.lo + 1;
+    parallel (nt, (n + batch - 1) / batch, spmm_task, &c, NULL);
+    for (r = 0; r < n; ++r) {
+      if (c.out[r]) put_vec_write (P, c.lo + r, c.out[r]);
+      free_vec (c.out[r]); c.out[r] = NULL;
+    }
+    show_progress (c.hi, nA, " rows");
+  }
+  free (c.out); free (M);
+}
+
 void mtx_product (char *_P, char *_A, char *_B, char *prm) {
   assert (_P && _A && _B && strcmp(_P,_A) && strcmp(_P,_B));
   if (!prm) prm = "";
@@ -842,84 +1174,31 @@ void mtx_product (char *_P, char *_A, char *_B, char *prm) {
   int  top = getprm (prm,"top=",0);
   float thresh = getprm (prm,"thresh=",0);
   //float rbf = getprm (prm,"rbf=",0);
-  uint threads = getprm (prm,"threads=",0), cache = getprm (prm,"cache=",32);
+  uint threads = getprm (prm,"threads=",0);
   coll_t *P = open_coll (_P, "w+");
-  coll_t *A = open_coll (_A, "r+");
-  MAP_SIZE = ((off_t) cache) << 30;
-  coll_t *B = open_coll (_B, "r+");
+  coll_t *A = open_coll (_A, "rs"); // rows are borrowed, not copied
+  coll_t *B = open_coll (_B, "rs");
   P->rdim = A->rdim;
   P->cdim = B->cdim;
   if (A->cdim != B->rdim) warnx("WARNING: incompatible dimensions %s [%d x %d], %s [%d x %d]", _A, A->rdim, A->cdim, _B, B->rdim, B->cdim);
   float *SA = (sim == '.') ? NULL : norm_rows(A,p,0);
   float *SB = (sim == '.') ? NULL : norm_cols(B,p,0);
-  uint id, j, nA = num_rows (A), nB = SB ? (len(SB)-1) : num_cols(B), done=0;
-  fprintf (stderr, "[%.0fs] computing %s [%dx%d]: %.0fM similarities(%c), p=%.2f, top=%d, cache=%dG, %d threads\n",
-	   vtime(), _P, nA, nB, (nA*nB/1E6), sim, p, top, cache, threads);
-  //#pragma omp parallel for private(id) schedule(dynamic) if (threads) num_threads(threads)
-  for (id = 1; id <= nA; ++id) {
-    if (!has_vec(A,id)) continue;
-    //ix_t *_a = get_vec (A, id), *a = _a-1, *aEnd = _a+len(_a); // don't use get_vec_ro
-    ix_t *_a = get_vec_mp (A, id), *a = _a-1, *aEnd = _a+len(_a);
-    if (!len(_a)) { free_vec(_a); continue; }
-    if (len(_a) < merge) {
-      ix_t *_c = (len(_a) == 1) ? get_vec_mp (B, _a->i) : vec_x_rows (_a, B);
-      put_vec_write (P, id, _c);
-      free_vec(_a); free_vec(_c);
-      show_progress (++done, nA, " rows");
-      continue;
-    }
-    float *S = new_vec (nB+1,sizeof(float));
-    while (++a < aEnd) {
-      //ix_t *_b = get_vec_ro (B, a->i), *b = _b-1, *bEnd = _b+len(_b);
-      ix_t *_b = get_vec_mp (B, a->i), *b = _b-1, *bEnd = _b+len(_b);
-      //ix_t *_b = get_vec_read (B, a->i), *b = _b-1, *bEnd = _b+len(_b);
-      switch (sim) {
-      case 'H': while (++b<bEnd) S[b->i] += sqrt ((a->x / SA[id]) * (b->x / SB[b->i]));      break;
-      case 'X': while (++b<bEnd) S[b->i] +=  2 / ((SA[id] / a->x) + (SB[b->i] / b->x));      break;
-      case 'n':
-      case 'N': while (++b<bEnd) S[b->i] += powa(a->x-b->x,p) - powa(a->x,p) - powa(b->x,p); break;
-      case '0': while (++b<bEnd) S[b->i] +=    (a->x != b->x) -    (a->x!=0) -    (b->x!=0); break;
-      case '1': while (++b<bEnd) S[b->i] +=    ABS(a->x-b->x) -    ABS(a->x) -    ABS(b->x); break;
-      case '2':
-      case 'C':
-      case 'D':
-      case 'J':
-      case '.': while (++b<bEnd) S[b->i] += a->x * b->x;                                     break;
-      case 'B': while (++b<bEnd) S[b->i] += (a->x > 0) && (b->x > 0);                        break;
-      case 'k': while (++b<bEnd) S[b->i] = MAX (S[b->i], MIN (a->x, b->x));                  break;
-      case 's': while (++b<bEnd) S[b->i] += MIN (a->x, b->x);                                break;
-      case 'S': while (++b<bEnd) S[b->i] += MAX (a->x, b->x);                                break;
-      case 'M': while (++b<bEnd) S[b->i] = MAX (S[b->i], (a->x * b->x));                     break;
-      case 'm': while (++b<bEnd) S[b->i] = MIN (S[b->i], (a->x * b->x));                     break;
-      }
-      free_vec (_b);
-    }
-    switch (sim) {
-    case 'C': for (j=1;j<=nB;++j) if (S[j]) S[j] /=    sqrt (SA[id] * SB[j]); break;
-    case 'D': for (j=1;j<=nB;++j) if (S[j]) S[j] /=   0.5 * (SA[id] + SB[j]); break;
-    case 'J': for (j=1;j<=nB;++j) if (S[j]) S[j] /= (-S[j] + SA[id] + SB[j]); break;
-    case 'H': for (j=1;j<=nB;++j) S[j] = 1 - sqrt (ABS(1 - S[j]));            break;
-    //case 'X': for (j=1;j<=nB;++j) S[j] = -(1 - S[j]);                         break;
-    case '0':
-    case '1':
-    case 'N': for (j=1;j<=nB;++j) S[j] =     -(SA[id] + SB[j] +   S[j]);      break;
-    case 'n': for (j=1;j<=nB;++j) S[j] = -powa(SA[id] + SB[j] +   S[j], 1/p); break;
-    case '2': for (j=1;j<=nB;++j) S[j] = -sqrt(SA[id] + SB[j] - 2*S[j]);      break;
-    case 'B': for (j=1;j<=nB;++j) S[j] = (S[j] == len(_a));                   break;
-    case 'k': for (a=_a;a<aEnd;++a) S[a->i] = MAX (S[a->i], a->x);            break;
-    }
-    ix_t *_c = keepz ? full2vec_keepzero(S) : full2vec(S);
-    //if (rbf) vec_x_num (_c, 'r', rbf);
-    if (top) trim_vec (_c, top);
-    if (thresh) vec_x_num (_c, 'T', thresh);
-    if (!keepz) chop_vec (_c);
-    //#pragma omp critical
-    put_vec_write (P, id, _c);
-    free_vec (_a);
-    free_vec (_c);
-    free_vec (S);
-    //if (omp_get_thread_num() == 0)
-    show_progress (++done, nA, " rows");
+  uint nA = num_rows (A), nB = SB ? (len(SB)-1) : num_cols(B), nt = MAX(threads,1);
+  fprintf (stderr, "[%.0fs] computing %s [%dx%d]: %.0fM similarities(%c), p=%.2f, top=%d, %d threads\n",
+	   vtime(), _P, nA, nB, (nA*nB/1E6), sim, p, top, threads);
+  if (sim == '.' && !keepz && !merge && !strstr (prm,"nospmm") && dense_B (B, nB))
+    spmm_product (P, A, B, nA, nB, nt, top, thresh);
+  else {
+    product_t ctx = {.P=P, .A=A, .B=B, .SA=SA, .SB=SB, .p=p, .sim=sim, .keepz=keepz,
+		     .top=top, .thresh=thresh, .merge=merge, .nA=nA, .nB=nB};
+    atomic_init (&ctx.next, 1);
+    atomic_init (&ctx.wrote, 0);
+    ctx.W = 64 * nt;
+    ctx.ring = calloc (ctx.W, sizeof(ix_t*));
+    parallel (nt, nt, product_worker, &ctx, NULL);
+    product_flush (&ctx);
+    assert (atomic_load (&ctx.wrote) == nA);
+    free (ctx.ring);
   }
   free_coll (B);
   free_vec (SA);
@@ -930,6 +1209,102 @@ void mtx_product (char *_P, char *_A, char *_B, char *prm) {
   fprintf (stderr, "[%.0fs] %d rows done\n", vtime(), nA);
 }
 
+void mtx_ann_index (char *_X, char *_IDX, char *prm) { // ann:index[,prm] X IDX
+  coll_t *X = open_coll (_X, "r+");
+  ann_build (_IDX, X, prm);
+  free_coll (X);
+}
+
+typedef struct {
+  ann_t *A;
+  ix_t **Q, **P; // queries and their results, one batch
+  uint top, ef;
+} ann_batch_t;
+
+static int ann_worker (uint i, void *arg) {
+  ann_batch_t *B = arg;
+  if (B->Q[i]) B->P[i] = ann_query (B->A, B->Q[i], B->top, B->ef);
+  return 0;
+}
+
+// rows lo..hi-1 of Q -> B->Q[], searched in nt threads, returns seconds
+static double ann_batch (ann_batch_t *B, coll_t *Q, uint lo, uint hi, uint nt) {
+  uint i, n = hi - lo;
+  for (i = 0; i < n; ++i) {
+    B->Q[i] = has_vec (Q,lo+i) ? get_vec (Q,lo+i) : NULL;
+    B->P[i] = NULL;
+  }
+  double t0 = ftime ();
+  parallel (nt, n, ann_worker, B, NULL);
+  return ftime () - t0;
+}
+
+static void ann_batch_free (ann_batch_t *B, uint n) {
+  for (uint i = 0; i < n; ++i) { free_vec (B->Q[i]); free_vec (B->P[i]); B->Q[i] = B->P[i] = NULL; }
+}
+
+void mtx_ann (char *_P, char *_Q, char *_IDX, char *prm) { // P = Q ann IDX [prm]
+  if (!prm) prm = "";
+  uint top = getprm (prm,"top=",10), ef = getprm (prm,"ef=",64);
+  uint nt = MAX(1, getprm (prm,"threads=",1)), bs = 10000, lo, i, nq;
+  ann_t *A = open_ann (_IDX);
+  coll_t *Q = open_coll (_Q, "r+"), *P = open_coll (_P, "w+");
+  ann_batch_t B = {A, safe_calloc (bs * sizeof(ix_t*)), safe_calloc (bs * sizeof(ix_t*)), top, ef};
+  double sec = 0;
+  P->rdim = Q->rdim;
+  P->cdim = A->ids [A->n - 1];
+  nq = nvecs (Q);
+  fprintf (stderr, "[%.0fs] %s: %d queries against %s [%d x %d], top=%d, ef=%d, %d threads\n",
+	   vtime(), _P, nq, _IDX, A->n, A->dim, top, ef, nt);
+  for (lo = 1; lo <= nq; lo += bs) {
+    uint n = MIN (bs, nq+1-lo);
+    sec += ann_batch (&B, Q, lo, lo+n, nt);
+    for (i = 0; i < n; ++i) if (B.P[i]) put_vec (P, lo+i, B.P[i]);
+    ann_batch_free (&B, n);
+    show_progress (lo+n-1, nq, " queries");
+  }
+  fprintf (stderr, "[%.0fs] %d queries: %.0f per second\n", vtime(), nq, nq / MAX(sec,1E-9));
+  free (B.Q); free (B.P);
+  free_coll (P); free_coll (Q); free_ann (A);
+}
+
+static uint common_ids (ix_t *A, ix_t *B) { // both sorted by id
+  ix_t *a = A, *b = B, *endA = A+len(A), *endB = B+len(B); uint n = 0;
+  while (a < endA && b < endB)
+    if (a->i < b->i) ++a; else if (a->i > b->i) ++b; else { ++n; ++a; ++b; }
+  return n;
+}
+
+// recall of the ANN top-k against exact neighbours, e.g. E = Q x X.T cos,top=K
+void mtx_ann_bench (char *_Q, char *_IDX, char *_E, char *prm) { // ann:bench[,prm] Q IDX E
+  uint top = getprm (prm,"top=",10), nt = MAX(1, getprm (prm,"threads=",1));
+  uint nq = getprm (prm,"queries=",1000), i;
+  char *efs = getprms (prm,"ef=","10:20:40:80:160:320",","), *e;
+  ann_t *A = open_ann (_IDX);
+  coll_t *Q = open_coll (_Q, "r+"), *E = open_coll (_E, "r+");
+  nq = MIN (nq, nvecs (Q));
+  ann_batch_t B = {A, safe_calloc (nq * sizeof(ix_t*)), safe_calloc (nq * sizeof(ix_t*)), top, 0};
+  printf ("%s: %d queries against %s [%d x %d], top=%d, %d threads\n", _E, nq, _IDX, A->n, A->dim, top, nt);
+  for (e = strtok (efs, ":"); e; e = strtok (NULL, ":")) {
+    ulong hit = 0, all = 0;
+    B.ef = atoi (e);
+    double sec = ann_batch (&B, Q, 1, nq+1, nt);
+    for (i = 0; i < nq; ++i) {
+      if (!B.Q[i] || !has_vec (E,i+1)) continue;
+      ix_t *exact = get_vec (E,i+1);
+      trim_vec (exact, top);
+      hit += common_ids (B.P[i], exact);
+      all += len(exact);
+      free_vec (exact);
+    }
+    printf ("ef=%-5d recall@%d %.4f  %.3f ms/query  %.0f queries/s\n", B.ef, top,
+	    (all ? (double) hit / all : 0), 1000 * sec * nt / nq, nq / MAX(sec,1E-9));
+    ann_batch_free (&B, nq);
+  }
+  free (B.Q); free (B.P); free (efs);
+  free_coll (Q); free_coll (E); free_ann (A);
+}
+
 ix_t *fill_mask (float *full, ix_t *mask) {
   assert (last_id(mask) < len(full));
   //ix_t *m = mask-1, *end = mask+len(mask);
@@ -1272,7 +1647,7 @@ void mtx_rnd (char *RND, char *prm, char *_R, char *_C) {
   char *sphere = strstr(prm,"sphere"),   *std = strstr(prm,"std");
   char *simplex = strstr(prm,"simplex"), *exp = strstr(prm,"exp");
   char *ones = strstr(prm,"ones"),       *log = strstr(prm,"log");
-  char *boolean = strstr(prm,"boolean");
+  char *boolean = strstr(prm,"boolean"), *dense = strstr(prm,"dense");
   uint top = getprm(prm,"top=",0);
   uint R = parse_dim(_R), C = parse_dim(_C), r;
   fprintf (stderr, "%s = %d x %d %s\n", RND, R, C, (ones?ones:"random"));
@@ -1290,7 +1665,8 @@ void mtx_rnd (char *RND, char *prm, char *_R, char *_C) {
     else if     (top) vec = rand_vec_sparse (C, top);
     else              vec = rand_vec_uni (C, lo, hi);
     if (boolean) vec_x_num (vec, '=', 1);
-    put_vec (rnd, r, vec);
+    if (dense) put_vec_dense (rnd, r, vec);
+    else put_vec (rnd, r, vec);
     free_vec (vec);
     show_progress (r, R, " rows");
   }
@@ -1543,6 +1919,15 @@ void mtx_clump (char *_C, char *_D, char *_T, char *prm) { // C = clump D D.T pr
   fprintf (stderr, "done: %d docs -> %d clusters, thresh: %.2f\n", nd, nc, thresh);
 }
 
+void mtx_kmeans (char *_KxD, char *_DxW, char *_KxW, char *prm) { // KxD = kmeans:prm DxW [KxW]
+  coll_t *DxW = open_coll (_DxW, "rs"); // shared: read from many threads
+  coll_t *KxD = open_coll (_KxD, "w+");
+  coll_t *KxW = _KxW ? open_coll (_KxW, "w+") : NULL;
+  k_means_dense (DxW, KxD, KxW, prm);
+  free_coll (DxW); free_coll (KxD);
+  if (KxW) free_coll (KxW);
+}
+
 // maximum spanning forest of adjacency matrix A (must be symmetric!)
 jix_t *max_span_tree (coll_t *A) {
   uint nr = num_rows(A), nc = num_cols(A), n = 0; assert (nr == nc);
@@ -1991,12 +2376,12 @@ void mtx_dcrm (char *_D, char *_P, char *_X, char *_Y, char *prm) {
 }
 
 // S[j,:] = SUM_w topk (P[j,:] .* A[w,:])
-void mtx_semg (char *_S, char *_P, char *_A, char *prm) { // thread-unsafe: chk_SCORE
+void mtx_semg (char *_S, char *_P, char *_A, char *prm) {
   uint k = getprm (prm,"k=",4);
   coll_t *P = open_coll (_P, "r+"); uint nj = num_rows (P), j;
   coll_t *A = open_coll (_A, "r+"); uint nw = num_rows (A), w;
   coll_t *S = open_coll (_S, "w+"); uint ni = num_cols (P);
-  float *SS = chk_SCORE (ni);
+  accum_t *SS = new_accum (ni);
   for (j = 1; j <= nj; ++j) {
     ix_t *pj = get_vec_ro (P,j);
     float *Pj = vec2full (pj, ni, 0);
@@ -2004,13 +2389,14 @@ void mtx_semg (char *_S, char *_P, char *_A, char *prm) { // thread-unsafe: chk_
       ix_t *Aw = get_vec (A,w), *a;
       vec_x_full (Aw, '*', Pj);
       trim_vec (Aw, k);
-      for (a = Aw; a < Aw+len(Aw); ++a) SS[a->i] += a->x;
+      for (a = Aw; a < Aw+len(Aw); ++a) *accum_at (SS, a->i) += a->x;
       free_vec (Aw);
     }
-    ix_t *Sj = full2vec (SS);
+    ix_t *Sj = accum2vec (SS, 0);
     put_vec (S, j, Sj);
     free_vec (Sj); free_vec (Pj);
   }
+  free_accum (SS);
   free_coll (P); free_coll (A); free_coll (S);
 }
 
@@ -2075,6 +2461,7 @@ char *usage =
   "                              a: read/write, keep existing content\n"
   "                              r: read-only, no new entries, error if doesn't exist\n"
   "                          stem=K,L ... Krovetz,Lowercase stemming (txt,xml)\n"
+  "                          stemcache=D  preload D/FORM,D/STEM stems, update on exit\n"
   "                          gram=4:5 ... character 4- and 5-grams instead of tokens\n"
   "                          gramsz=3 ... go n-grams\n"
   "                          char=1   ... character size (in bytes) for n-grams\n"
@@ -2083,6 +2470,7 @@ char *usage =
   "                          toklen=50... drop tokens longer than 50 characters\n"
   "                          position ... store word positions instead of frequencies\n"
   "                          ow=5,uw=5 ... ordered/unordered pairs in a 5-word window\n"
+  "                          threads=N ... tokenise/stem txt,xml in N threads\n"
   "                          join/skip/replace ... documents with duplicate ids\n"
   "                          nosort    ... rcv: don't sort/trim/dedup cols in each row\n"
   "                 aggr:{1,m,M,s,a,l} ... rcv: take 1st,min,Max,sum,avg,last of dups\n"
@@ -2109,6 +2497,9 @@ char *usage =
   "                               noself ... remove diagonal from Sys, Tru\n"
   " quantiles M [H]        - print quantiles for every row of M\n"
   " transpose M            - transpose matrix M into M.T (eg docs -> inverted lists)\n"
+  "                          :threads=N ... scan rows of M in N threads\n"
+  "                          :mem=G ... spill sorted runs to disk past G gigabytes\n"
+  "                          :bands ... old way: one pass over M per band of columns\n"
   " merge A R C += B S D   - merge B[SxD] into A[RxC], re-mapping the row/column ids\n"
   "                          ,join/skip/replace ... rows with duplicate ids\n"
   "                          ,position ... retain positions (don't sort rows by id)\n"
@@ -2179,6 +2570,7 @@ char *usage =
   "                                sphere    - uniformly over unit sphere\n"
   "                                simplex   - uniformly over unit simplex\n"
   "                                top=K     - U[0,1] over K random dimensions\n"
+  "                                dense     - store rows as float[] (A = dense B)\n"
   " I = eye R              - identity matrix with rows R (R can be hash or matrix)\n"
   " I = diag A [i]         - extract diagonal from A (or put row A[i] onto diagonal)\n"
   " T = triu A             - extract part of A above the diagonal (tril = below)\n"
@@ -2188,6 +2580,12 @@ char *usage =
   " A = paste B C D ...    - concatenates matrices without renumbering rows/columns\n"
   "                          use paste:horz or paste:vert to cat renumbered slices\n"
   " A = shuffle B          - randomly re-order (permute) the rows of B (see -r) buggy!\n"
+  " A = pack:[q=K] B       - block-compress rows of B: delta-coded ids, bit-packed\n"
+  "                          integer weights, q=K quantises other weights to K bits\n"
+  "                          rows are decoded on read, A = B unpacks\n"
+  " A = dense B            - store rows of B with ids 1..n (or float[] rows) as n floats\n"
+  "                          read as ix_t (zeros kept), dense x dense ops use SIMD\n"
+  "                          A = B converts back to ix_t\n"
   " P = permute M c        - permute the values of column c across _all_ rows of M\n"
   " A = sample:[type] B    - down-sample each row to n=N items or with prob. p=P\n"
   " A = subset B [H]       - read ids from stdin and set A[id] = B[id] using hash H\n"
@@ -2207,6 +2605,10 @@ char *usage =
   "                          type: centr,t=0 - agglomerate while ||centr-row|| < t\n"
   " C = clump:[prm] X X.T  - fast clustering algorithm for rows of X\n"
   "                          prm: thresh=0.1\n"
+  " C = kmeans:[prm] X [K] - spherical k-means over rows of X: C[k,d] = cos(k,d)\n"
+  "                          K = dense centroids as rows, prm: k=10,iter=10,\n"
+  "                          threads=1,pp (k-means++ seeds from sample=20000 rows)\n"
+  "                          batch=B (mini-batch of B rows per iteration),KB=256\n"
   " LTR:out,p=1 R Q D      - dump LeToR vectors: Rij |Qi1-Dj1|^p ... |Qin-Djn|^p\n"
   " LTR:SA,p=1 R Q D       - learn LeToR weights via simulated annealing\n"
   " LTR:eval R Q D [W]     - evaluate LeToR, prm: dump,cosi/jacc/chi2/p=0.5,MRR,R@10\n"
@@ -2244,7 +2646,16 @@ char *usage =
   "                                top=K     - keep K highest values in each row of P\n"
   "                                thresh=X  - keep only values > X in each row of P\n"
   "                                merge=L   - linear merge if len(row) < L, dot only\n"
+  "                                threads=N - compute rows of P in N parallel threads\n"
+  "                                nospmm    - dot with dense B: no blocked SpMM\n"
 //"                                keepzero  - keep zero values in the matrix P\n"
+  " ann:index[,prm] X I    - approximate nearest-neighbour (HNSW) index I over rows of X\n"
+  "                          X: dense rows (float[] or ix_t), prm: M=16 links/node,\n"
+  "                          efc=200 build effort, threads=1, dot (default: cosine)\n"
+  " P = Q ann I [prm]      - P[q,x] = similarity of X[x] to Q[q] for top X rows by index I\n"
+  "                          prm: top=10,ef=64 (higher: better recall, slower),threads=1\n"
+  " ann:bench[,prm] Q I E  - recall@top and speed of index I vs. exact E = Q x X.T cos\n"
+  "                          prm: top=10,ef=10:20:40:80:160:320,queries=1000,threads=1\n"
   " P = A + B              - add matrix A to B: P[r,c] = A[r,c] + B[r,c]\n"
   "                          also supports: +,-,.,/,^,&,|,!,<,>\n"
   "                          rows of A must be compatible with rows of B\n"
@@ -2330,6 +2741,8 @@ int main (int argc, char *argv[]) {
   else if (!strncmp(a(1), "LTR:eval", 8)) mtx_letor_eval (arg(2), arg(3), arg(4), arg(5), a(1));
   else if (!strncmp(a(1), "xval", 4))   mtx_xval (arg(2), arg(3), arg(4), arg(5), a(1));
   else if (!strncmp(a(1), "trans", 5))  mtx_transpose (arg(1), arg(2), NULL);
+  else if (!strncmp(a(1), "ann:index",9)) mtx_ann_index (arg(2), arg(3), a(1));
+  else if (!strncmp(a(1), "ann:bench",9)) mtx_ann_bench (arg(2), arg(3), arg(4), a(1));
   else if (!strncmp(a(4), "deflate", 7) && !strcmp(a(3), "="))
     mtx_deflate(arg(1), arg(2), arg(5), arg(6), a(4));
   else if (!strncmp(a(1), "merge", 5) && !strcmp (a(5),"+="))
@@ -2351,6 +2764,8 @@ int main (int argc, char *argv[]) {
     else if (!strncmp (a(3), "slice",5))   mtx_slice (tmp, arg(3), arg(4), arg(5));
     else if (!strncmp (a(3), "paste",5))   mtx_paste (tmp, arg(3), argv+4, argc-4);
     else if (!strcmp  (a(3), "shuffle"))   mtx_shuffle (tmp, arg(4));
+    else if (!strncmp (a(3), "pack",4))    mtx_pack (tmp, arg(4), a(3));
+    else if (!strcmp  (a(3), "dense"))     mtx_dense (tmp, arg(4));
     else if (!strcmp  (a(3), "permute"))   mtx_permute_col (tmp, arg(4), arg(5));
     else if (!strncmp (a(3), "sample",6))  mtx_sample (tmp, arg(4), a(3));
     else if (!strncmp (a(3), "subset",6))  mtx_rowset (tmp, arg(4), arg(5));
@@ -2365,17 +2780,19 @@ int main (int argc, char *argv[]) {
     else if (!strncmp (a(3), "semg",4))    mtx_semg (tmp, arg(4), arg(5), a(3));
     else if (!strncmp (a(3), "mmr",3))     mtx_mmr (tmp, arg(4), arg(5), a(3));
     else if (!strncmp (a(3), "clump",5))   mtx_clump (tmp, arg(4), arg(5), a(3));
+    else if (!strncmp (a(3), "kmeans",6))  mtx_kmeans (tmp, arg(4), arg(5), a(3));
     else if (!strcmp  (a(3), "mst"))       mtx_mst (tmp, arg(4));
     else if (!strcmp  (a(3), "reachable")) mtx_reachable (tmp, arg(4), arg(5));
     else if (!strncmp (a(3), "diverse",7)) mtx_diverse (tmp, arg(4), arg(5), a(3));
     else if (!strncmp (a(4), "dist",4))    mtx_distance (tmp, arg(3), arg(5), arg(4));
     else if (!strcmp  (a(4), "#"))         mtx_distance (tmp, arg(3), arg(5), arg(6));
     else if (!strcmp  (a(4), "x"))         mtx_product (tmp, arg(3), arg(5), arg(6));
+    else if (!strcmp  (a(4), "ann"))       mtx_ann (tmp, arg(3), arg(5), arg(6));
     else if (!strcmp  (a(5), "+") ||
 	     !strcmp  (a(5), "-"))         mtx_add (tmp, arg(3), arg(4), arg(5)[0], arg(6), arg(7));
     else if (!strcmp  (a(3), "min") && argc == 6) mtx_dot (tmp, arg(4), 'm', arg(5));
     else if (!strcmp  (a(3), "max") && argc == 6) mtx_dot (tmp, arg(4), 'M', arg(5));
-    else if (!strcmp  (a(3), "transpose")) mtx_transpose (arg(3), arg(4), tmp);
+    else if (!strncmp (a(3), "transpose",9)) mtx_transpose (arg(3), arg(4), tmp);
     else if (strlen(a(4))==1 && ispunct(a(4)[0])) mtx_dot (tmp, arg(3), arg(4)[0], arg(5));
     else                                   mtx_weigh (tmp, arg(3), arg(4), arg(5));
     //else if (!strncmp (a(3), "weigh",5)) mtx_weigh (tmp, arg(3), arg(4), arg(5));
@@ -130,6 +130,96 @@ void server_loop (int port, void* (*handle) (void*), int threaded) {
   }
 }
 
+// line-delimited server on a fixed pool of nt threads (no thread per
+// connection). Workers share one epoll set: a worker that wakes up on a
+// client reads what has arrived and calls handle (fd, line, arg) for every
+// complete line, in order, before the client is re-armed (EPOLLONESHOT),
+// so replies to one client never overlap. Idle clients hold no thread.
+// Replies block for at most timeout ms (SO_SNDTIMEO) on a client that
+// stopped reading; handle returns -1 then and the client is dropped.
+
+typedef struct { int fd, used, size; char *buf; } sconn_t; // client, buffered input
+
+typedef struct {
+  int ep, listener;
+  uint timeout; // ms
+  int (*handle) (int fd, char *line, void *arg);
+  void *arg;
+} lserver_t;
+
+static void rearm (int ep, sconn_t *c) {
+  struct epoll_event e = {EPOLLIN | EPOLLONESHOT, {.ptr = c}};
+  safe ("epoll_ctl", epoll_ctl (ep, EPOLL_CTL_MOD, c->fd, &e));
+}
+
+static void *line_worker (void *arg) {
+  lserver_t *S = arg; struct epoll_event e;
+  while (1) {
+    if (epoll_wait (S->ep, &e, 1, -1) < 1) continue; // EINTR
+    sconn_t *c = e.data.ptr;
+    if (c->fd == S->listener) { // new client
+      int fd = accept (S->listener, NULL, NULL);
+      rearm (S->ep, c);
+      if (fd < 0) continue;
+      struct timeval tv = {S->timeout / 1000, (S->timeout % 1000) * 1000};
+      safe ("setsockopt", setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)));
+      sconn_t *new = calloc (1, sizeof (sconn_t));
+      new->fd = fd; new->buf = malloc (new->size = 1<<16);
+      struct epoll_event ne = {EPOLLIN | EPOLLONESHOT, {.ptr = new}};
+      safe ("epoll_ctl", epoll_ctl (S->ep, EPOLL_CTL_ADD, fd, &ne));
+      continue;
+    }
+    int got = 0, eof = 0;
+    while (1) { // take all that arrived, keep room for a terminating 0
+      if (c->used + 1 >= c->size) c->buf = realloc (c->buf, c->size *= 2);
+      got = recv (c->fd, c->buf + c->used, c->size - c->used - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (got > 0) c->used += got;
+      else { eof = !got || (errno != EAGAIN && errno != EWOULDBLOCK); break; }
+    }
+    char *line = c->buf, *nl;
+    while (!eof && (nl = memchr (line, '\n', c->buf + c->used - line))) {
+      *nl = 0;
+      if (nl > line && nl[-1] == '\r') nl[-1] = 0;
+      if (S->handle (c->fd, line, S->arg) < 0) eof = 1; // client stopped reading: drop it
+      line = nl + 1;
+    }
+    c->used -= line - c->buf;
+    memmove (c->buf, line, c->used);
+    if (!eof) { rearm (S->ep, c); continue; }
+    epoll_ctl (S->ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close (c->fd);
+    free (c->buf); free (c);
+  }
+  return NULL;
+}
+
+// send all of buf[0..n), -1 if the client is gone or a send timed out
+int send_all (int fd, char *buf, size_t n) {
+  while (n > 0) {
+    ssize_t sent = send (fd, buf, n, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return -1; // EAGAIN: SO_SNDTIMEO ran out
+    buf += sent; n -= sent;
+  }
+  return 0;
+}
+
+void server_lines (int port, uint nt, uint timeout, int (*handle) (int fd, char *line, void *arg), void *arg) {
+  server_sockid = server_socket (port, 0); // blocking socket
+  trap_signals (server_killed); // close sockid on signals
+  signal (SIGPIPE, SIG_IGN); // client went away: send fails, we go on
+  lserver_t S = {safe ("epoll_create", epoll_create1 (0)), server_sockid, timeout, handle, arg};
+  sconn_t L = {server_sockid, 0, 0, NULL};
+  struct epoll_event e = {EPOLLIN | EPOLLONESHOT, {.ptr = &L}};
+  safe ("epoll_ctl", epoll_ctl (S.ep, EPOLL_CTL_ADD, server_sockid, &e));
+  fprintf (stderr, "Listening on port %d, %d threads\n", port, nt);
+  pthread_t *T = calloc (nt, sizeof (pthread_t));
+  uint i;
+  for (i = 0; i < nt; ++i) pthread_create (T+i, NULL, line_worker, &S);
+  for (i = 0; i < nt; ++i) pthread_join (T[i], NULL); // never
+  free (T);
+}
+
 // accept a connection, send data to the client, close connection
 // return number of bytes sent, or -1 if no clients waiting
 // if sockid is non-blocking, the call will return immediately
@@ -226,18 +316,21 @@ char *extract_message (char *buf, char *eom, int *used) {
   return msg;
 }
 
-char *recv_message (int sockid, char *eom) { // thread-unsafe: static
+char *recv_message_r (int sockid, char *eom, msgbuf_t *B) {
   int get = 10000, got, flags = MSG_NOSIGNAL | MSG_DONTWAIT;
-  static int N = 10000, used = 0;
-  static char *buf = NULL;
-  if (!buf) buf = malloc (N);
+  if (!B->buf) B->buf = malloc (B->size = 10000);
   while(1) { // receive as much data as we can get without blocking
-    if (used+get > N) buf = realloc (buf, N *= 2); // buf big enough?
-    got = recv (sockid, buf+used, get, flags); // try to get a chunk
+    if (B->used+get > B->size) B->buf = realloc (B->buf, B->size *= 2); // buf big enough?
+    got = recv (sockid, B->buf+B->used, get, flags); // try to get a chunk
     if (got <= 0) break; // stop if no more data at the moment
-    else used += got;
+    else B->used += got;
   }
-  return extract_message (buf, eom, &used);
+  return extract_message (B->buf, eom, &B->used);
+}
+
+char *recv_message (int sockid, char *eom) { // thread-unsafe: static
+  static msgbuf_t B = {NULL, 0, 0};
+  return recv_message_r (sockid, eom, &B);
 }
 
 int sends (int socket, char *str) {
@@ -33,7 +33,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #ifndef NETUTIL
@@ -81,6 +83,13 @@ int client_socket (char *host) ;
 // handler will be passed a client socket, must close it when done
 void server_loop (int port, void* (*handle) (void*), int threaded) ;
 
+// line-delimited server: a fixed pool of nt threads calls handle (fd, line,
+// arg) for each line a client sends; lines of one client are handled in order.
+// Replies go out with send_all, which gives up after timeout ms; handle
+// returns -1 to drop the client.
+void server_lines (int port, uint nt, uint timeout, int (*handle) (int fd, char *line, void *arg), void *arg) ;
+int send_all (int fd, char *buf, size_t n) ; // 0 if sent, -1 if gone or timed out
+
 // accept a connection, send data to the client, close connection
 // return number of bytes sent, or -1 if no clients waiting
 // if sockid is non-blocking, the call will return immediately
@@ -106,6 +115,10 @@ int send_message (int sockid, char *message, int size) ;
 // returns NULL if not complete message is ready
 char *recv_message (int sockid, char *eom) ;
 
+typedef struct { char *buf; int size, used; } msgbuf_t; // pending bytes
+// same, but partial messages are kept in B (one per connection)
+char *recv_message_r (int sockid, char *eom, msgbuf_t *B) ;
+
 int sputs (char *buf, int sock) ;
 char *sgets (char *buf, int size, int sock) ;
 char *asgets (char *buf, int size, int sock, char **end) ;
@@ -0,0 +1,150 @@
+/*
+
+  Copyright (c) 1997-2025 Victor Lavrenko (v.lavrenko@gmail.com)
+
+  This file is part of YARI.
+
+  YARI is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  YARI is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YARI. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <math.h>
+#include "pvec.h"
+
+/* -------------------- layout --------------------
+
+   data:  pblk_t dir [nblk] ; block [0] ... block [nblk-1]
+   block: phdr_t ; id gaps [m] ; weights [m]    (m = 128, less in last)
+
+   gaps:    id[k] - id[k-1] - 1 (id[-1] = last id of previous block),
+            ib bits each, LSB-first in 32-bit words
+   weights: 'F' raw floats
+            'I' integers: x = x0 + u, xb bits each (lossless)
+            'Q' quantised: x = x0 + dx * u, xb bits each (lossy)
+
+   A full block of b-bit values is exactly 4*b words, so every block
+   of gaps starts and ends on a 16-byte boundary relative to its start.
+
+   ----------------------------------------------- */
+
+typedef struct {
+  uchar ib; // bits per id gap
+  uchar xb; // bits per weight (0 => all weights = x0)
+  uchar xm; // weight mode: 'F', 'I' or 'Q'
+  uchar pad;
+  float x0; // smallest weight in the block
+  float dx; // quantisation step
+} phdr_t;
+
+static inline uint nbits (uint u) { return u ? 32 - __builtin_clz (u) : 0; }
+
+// pack n values of b bits each into W, return number of words used
+static uint pack_bits (uint *U, uint n, uint b, uint *W) {
+  ulong buf = 0; uint have = 0, *w = W, i;
+  for (i = 0; i < n; ++i) {
+    buf |= ((ulong) U[i]) << have;
+    if ((have += b) >= 32) { *w++ = (uint) buf; buf >>= 32; have -= 32; }
+  }
+  if (have) *w++ = (uint) buf;
+  return w - W;
+}
+
+// unpack n values of b bits each from W, return number of words used
+static uint unpack_bits (uint *W, uint n, uint b, uint *U) {
+  ulong buf = 0, mask = (1lu << b) - 1; uint have = 0, *w = W, i;
+  for (i = 0; i < n; ++i) {
+    if (have < b) { buf |= ((ulong) *w++) << have; have += 32; }
+    U[i] = buf & mask;
+    buf >>= b; have -= b;
+  }
+  return w - W;
+}
+
+// weights of one block: pick the mode, fill U with the codes
+static void pack_weights (ix_t *V, uint m, uint q, phdr_t *h, uint *U) {
+  float lo = V[0].x, hi = V[0].x; uint k, ints = 1;
+  for (k = 0; k < m; ++k) {
+    lo = MIN (lo, V[k].x); hi = MAX (hi, V[k].x);
+    if (V[k].x != (int) V[k].x || ABS(V[k].x) >= (1<<24)) ints = 0; // exact in float
+  }
+  h->x0 = lo; h->dx = 1;
+  if (ints) { // integers: lossless
+    h->xm = 'I'; h->xb = nbits (hi - lo);
+    for (k = 0; k < m; ++k) U[k] = V[k].x - lo;
+  } else if (q) { // quantise to q bits
+    h->xm = 'Q'; h->xb = MIN (q, 16);
+    h->dx = (hi - lo) / ((1 << h->xb) - 1);
+    for (k = 0; k < m; ++k) U[k] = h->dx ? lrintf ((V[k].x - lo) / h->dx) : 0;
+  } else { // raw floats
+    h->xm = 'F'; h->xb = 32;
+  }
+}
+
+// encode V (sorted by id) into bytes, NULL if ids are not increasing
+byte *pack_vec (ix_t *V, uint q) {
+  uint n = len(V), nb = pack_nblk(n), b, k, last = 0, U [PACK_BLOCK];
+  if (!n) return NULL;
+  for (k = 0; k < n; ++k)
+    if (V[k].i <= (k ? V[k-1].i : 0)) return NULL; // unsorted or id 0
+  ulong worst = nb * sizeof(pblk_t) + nb * sizeof(phdr_t) + 2 * n * sizeof(uint) + 8;
+  byte *P = new_vec (worst, 1);
+  pblk_t *dir = pack_dir (P);
+  uint *w = (uint*) (dir + nb);
+  for (b = 0; b < nb; ++b) {
+    ix_t *B = V + b * PACK_BLOCK;
+    uint m = MIN (PACK_BLOCK, n - b * PACK_BLOCK), maxgap = 0;
+    phdr_t *h = (phdr_t*) w;
+    dir[b].offs = (byte*) h - P;
+    dir[b].last = B[m-1].i;
+    dir[b].xmax = B[0].x;
+    for (k = 0; k < m; ++k) {
+      U[k] = B[k].i - (k ? B[k-1].i : last) - 1;
+      maxgap = MAX (maxgap, U[k]);
+      dir[b].xmax = MAX (dir[b].xmax, B[k].x);
+    }
+    h->ib = nbits (maxgap); h->pad = 0;
+    w = (uint*) (h+1);
+    w += pack_bits (U, m, h->ib, w);
+    pack_weights (B, m, q, h, U);
+    if (h->xm == 'F') for (k = 0; k < m; ++k) ((float*)w)[k] = B[k].x;
+    w += (h->xm == 'F') ? m : pack_bits (U, m, h->xb, w);
+    last = B[m-1].i;
+  }
+  len(P) = (byte*) w - P;
+  return P;
+}
+
+// decode block b of P (n postings in total) into out[128]
+uint unpack_block (void *P, uint n, uint b, ix_t *out) {
+  pblk_t *dir = pack_dir (P);
+  phdr_t *h = (phdr_t*) ((byte*) P + dir[b].offs);
+  uint m = MIN (PACK_BLOCK, n - b * PACK_BLOCK), k, U [PACK_BLOCK];
+  uint id = b ? dir[b-1].last : 0, *w = (uint*) (h+1);
+  w += unpack_bits (w, m, h->ib, U);
+  for (k = 0; k < m; ++k) out[k].i = (id += U[k] + 1);
+  if (h->xm == 'F') for (k = 0; k < m; ++k) out[k].x = ((float*)w)[k];
+  else {
+    unpack_bits (w, m, h->xb, U);
+    for (k = 0; k < m; ++k) out[k].x = h->x0 + h->dx * U[k];
+  }
+  return m;
+}
+
+// decode all n postings of P into a new vector
+ix_t *unpack_vec (void *P, uint n) {
+  ix_t *V = new_vec (n, sizeof(ix_t));
+  uint b, nb = pack_nblk(n);
+  for (b = 0; b < nb; ++b) unpack_block (P, n, b, V + b * PACK_BLOCK);
+  return V;
+}
@@ -0,0 +1,50 @@
+/*
+
+  Copyright (c) 1997-2025 Victor Lavrenko (v.lavrenko@gmail.com)
+
+  This file is part of YARI.
+
+  YARI is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  YARI is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YARI. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "vector.h"
+
+#ifndef PVEC
+#define PVEC
+
+// Packed ix_t vectors: ids delta-coded and bit-packed in blocks of 128,
+// weights bit-packed as integers (lossless) or quantised (lossy, q=K).
+// In a coll_t the chunk header has file = 3 and count = number of postings,
+// get_vec*() decode transparently, writes into get_vec_ro() are lost.
+
+#define PACK_BLOCK 128
+#define PACK_FILE  3
+
+#define is_packed(hdr) ((hdr)->file == PACK_FILE) // hdr: vec_t in a coll
+#define pack_nblk(n) (((n) + PACK_BLOCK - 1) / PACK_BLOCK)
+
+typedef struct {
+  uint  last; // largest id in the block (skip pointer)
+  uint  offs; // byte offset of the block from the start of the data
+  float xmax; // largest weight in the block
+} pblk_t; // block directory entry
+
+// P is the packed data of a vector with n postings
+byte *pack_vec (ix_t *V, uint q) ; // NULL if V is not sorted by id
+ix_t *unpack_vec (void *P, uint n) ;
+uint unpack_block (void *P, uint n, uint b, ix_t *out) ; // out[128], returns size
+#define pack_dir(P) ((pblk_t *) (P)) // pack_nblk(n) entries
+
+#endif
@@ -19,6 +19,7 @@
 
 */
 
+#include <pthread.h>
 #include "types.h"
 #include "hash.h"
 #include "textutil.h"
@@ -29,22 +30,34 @@
 #include "hl.h"
 #include "math.h"
 #include "cluster.h"
+#include "pvec.h"
+#include "netutil.h"
+#include "synq.h"
+#include "zvec.h"
 
 // ------------------------------ index ------------------------------
 
-index_t *open_index (char *dir) {
+static index_t *open_index_as (char *dir, char *hash, char *vecs, char *text) {
   char _[999];
   index_t *I = calloc (1, sizeof(index_t));
-  I->DOC      = open_hash_if_exists (fmt(_,"%s/DOC",dir), "r");
-  I->WORD     = open_hash_if_exists (fmt(_,"%s/WORD",dir), "r");
-  I->WORDxDOC = open_coll_if_exists (fmt(_,"%s/WORDxDOC",dir), "r+");
-  I->DOCxWORD = open_coll_if_exists (fmt(_,"%s/DOCxWORD",dir), "r+");
-  I->JSON     = open_coll_if_exists (fmt(_,"%s/JSON",dir), "r");
-  I->XML      = open_coll_if_exists (fmt(_,"%s/XML",dir), "r");
+  I->DOC      = open_hash_if_exists (fmt(_,"%s/DOC",dir), hash);
+  I->WORD     = open_hash_if_exists (fmt(_,"%s/WORD",dir), hash);
+  I->WORDxDOC = open_coll_if_exists (fmt(_,"%s/WORDxDOC",dir), vecs);
+  I->DOCxWORD = open_coll_if_exists (fmt(_,"%s/DOCxWORD",dir), vecs);
+  I->JSON     = open_coll_if_exists (fmt(_,"%s/JSON",dir), text);
+  I->XML      = open_coll_if_exists (fmt(_,"%s/XML",dir), text);
   I->STATS    = open_stats_if_exists (fmt(_,"%s/STATS",dir));
+  if (I->STATS && I->STATS->mx && I->WORDxDOC && // WORDxDOC rewritten since: wand can't trust STATS.mx
+      file_modified ("%s/STATS.mx",dir) < coll_modified (I->WORDxDOC->path)) {
+    free_vec (I->STATS->mx); I->STATS->mx = NULL;
+  }
   return I;
 }
 
+index_t *open_index (char *dir) { return open_index_as (dir, "r", "r+", "r"); }
+
+index_t *open_shared_index (char *dir, char *how) { return open_index_as (dir, how, how, how); }
+
 void free_index (index_t *I) {
   if (I->DOC) free_hash (I->DOC);
   if (I->WORD) free_hash (I->WORD);
@@ -53,6 +66,9 @@ void free_index (index_t *I) {
   if (I->JSON) free_coll (I->JSON);
   if (I->XML) free_coll (I->XML);
   if (I->STATS) free_stats (I->STATS);
+  if (I->RESULTS) free_cache (I->RESULTS);
+  if (I->HOT) free_hot (I->HOT);
+  if (I->TEXT) free_cache (I->TEXT);
   memset (I, 0, sizeof(index_t));
   free (I);
 }
@@ -77,11 +93,74 @@ void free_snippets (snip_t *S) {
   free_vec (S);
 }
 
+static char *strdup0 (char *s) { return s ? strdup (s) : NULL; }
+
+snip_t *copy_snippets (snip_t *S) {
+  snip_t *C = copy_vec (S), *c, *cEnd = C + len(C);
+  for (c = C; c < cEnd; ++c) {
+    c->id = strdup0 (c->id);
+    c->url = strdup0 (c->url);
+    c->head = strdup0 (c->head);
+    c->snip = strdup0 (c->snip);
+    c->meta = strdup0 (c->meta);
+    c->full = strdup0 (c->full);
+  }
+  return C;
+}
+
+static ulong size_snippets (snip_t *S) {
+  ulong sz = sizeof(vec_t) + len(S) * sizeof(snip_t);
+  snip_t *s, *sEnd = S + len(S);
+  for (s = S; s < sEnd; ++s)
+    sz += ((s->id ? strlen(s->id)+1 : 0) + (s->url ? strlen(s->url)+1 : 0) +
+	   (s->head ? strlen(s->head)+1 : 0) + (s->snip ? strlen(s->snip)+1 : 0) +
+	   (s->meta ? strlen(s->meta)+1 : 0) + (s->full ? strlen(s->full)+1 : 0));
+  return sz;
+}
+
+// keep final results of run_text_qry / run_bool_qry in memory:
+// cache=MB (0: off), cacheN=10000 results at most
+// hot=MB (0: off): pin decoded postings of frequently used WORDxDOC terms
+// text=MB (0: off): cleaned text of docs, saves decoding a zdoc XML again
+static void *copy_text (void *s) { return strdup (s); }
+static ulong size_text (void *s) { return strlen (s) + 1; }
+void cache_results (index_t *I, char *prm) {
+  double mb = getprm (prm,"cache=",0), hot = getprm (prm,"hot=",0), text = getprm (prm,"text=",0);
+  uint n = getprm (prm,"cacheN=",10000);
+  if (mb > 0 && !I->RESULTS)
+    I->RESULTS = new_cache (n, mb * 1E6, (void (*)(void*)) free_snippets,
+			    (void *(*)(void*)) copy_snippets,
+			    (ulong (*)(void*)) size_snippets);
+  if (hot > 0 && !I->HOT && I->WORDxDOC)
+    I->HOT = new_hot (hot * 1E6, nvecs (I->WORDxDOC));
+  if (text > 0 && !I->TEXT && I->XML)
+    I->TEXT = new_cache (n, text * 1E6, free, copy_text, size_text);
+}
+
+// cache key: kind, prm and the query with whitespace collapsed
+static char *cache_key (char kind, char *qry, char *prm) {
+  char *q = strdup (qry);
+  csub (q, "\t\r\n", ' ');
+  chop (q, " ");
+  spaces2space (q);
+  char *key = malloc (strlen(prm) + strlen(q) + 5);
+  sprintf (key, "%c\t%s\t%s", kind, prm, q);
+  free (q);
+  return key;
+}
+
+// prm "fresh": drop cached results if WORDxDOC changed on disk
+static void cache_check (index_t *I, char *prm) {
+  if (strstr (prm,"fresh") && I->WORDxDOC && I->WORDxDOC->path)
+    cache_stamp (I->RESULTS, coll_modified (I->WORDxDOC->path));
+  if (strstr (prm,"fresh") && I->TEXT && I->XML->path)
+    cache_stamp (I->TEXT, coll_modified (I->XML->path));
+}
+
 // returns a cleaned copy of XML[id], or NULL
 char *copy_doc_text (coll_t *XML, uint id) {
-  char *chunk = id ? get_chunk(XML,id) : NULL;
-  if (!chunk) return NULL;
-  char *text = strdup(chunk);
+  char *text = get_doc (XML, id); // plain or zdoc
+  if (!text) return NULL;
   erase_between(text, "<DOCID>", "</DOCID>", ' ');
   no_xml_tags (text);
   chop (text, " "); // chop whitespace around docid
@@ -92,6 +171,15 @@ char *copy_doc_text (coll_t *XML, uint id) {
   // spaces2space (text); // multiple spaces
 }
 
+// copy_doc_text (I->XML, id) through I->TEXT, if any
+static char *index_doc_text (index_t *I, uint id) {
+  if (!I->TEXT) return copy_doc_text (I->XML, id);
+  char key[16]; sprintf (key, "%u", id);
+  char *text = cache_get (I->TEXT, key);
+  if (!text && (text = copy_doc_text (I->XML, id))) cache_put (I->TEXT, key, strdup (text));
+  return text;
+}
+
 // returns just id and score for each doc in D.
 snip_t *bare_snippets (ix_t *D, hash_t *IDs) {
   uint i, n = len(D);
@@ -103,73 +191,155 @@ snip_t *bare_snippets (ix_t *D, hash_t *IDs) {
   return S;
 }
 
-// returns full text as a snippet for each each doc in D.
-snip_t *lazy_snippets (jix_t *D, coll_t *XML, hash_t *IDs) {
-  uint i, n = len(D);
+// id, score and group for each doc in D, text left NULL but prefetched
+static snip_t *doc_snippets (jix_t *D, coll_t *XML, hash_t *IDs) {
+  uint i, n = len(D), *ids = new_vec (n, sizeof(uint));
   snip_t *S = new_vec(n, sizeof(snip_t));
+  for (i = 0; i < n; ++i) ids[i] = D[i].i;
+  if (XML) prefetch_chunks (XML, ids, n); // one batch of readahead hints
   for (i = 0; i < n; ++i) {
-    S[i].snip = copy_doc_text (XML, D[i].i); // clean copy
     S[i].score = D[i].x;
     S[i].id = id2str (IDs, D[i].i);
     S[i].group = D[i].j;
   }
+  free_vec (ids);
+  return S;
+}
+
+// returns full text as a snippet for each each doc in D.
+snip_t *lazy_snippets (jix_t *D, coll_t *XML, hash_t *IDs) {
+  snip_t *S = doc_snippets (D, XML, IDs);
+  uint i, n = len(D);
+  for (i = 0; i < n; ++i) S[i].snip = copy_doc_text (XML, D[i].i); // clean copy
   return S;
 }
 
 char *best_paragraph (index_t *I, char *text, char *qry, hash_t *_Q, int n, float *score) ;
 
-// shrink snippet to size, rerank by how many words it covers.
-void rerank_snippets (index_t *I, snip_t *S, char *qry, char **words, char *prm) {
+typedef struct {
+  index_t *I; snip_t *S;
+  jix_t *D; // fetch text of D[i] into S[i] first, NULL: S[i].snip has it
+  char *qry, **words, *hilit, *curses, *hihtml, *paragr;
+  uint snipsz, ngramsz;
+  hash_t *Q;
+} rerank_t;
+
+// S[i]: fetch, shrink to snipsz and score it, independent of other i
+static int rerank_one (uint i, void *arg) {
+  rerank_t *R = arg;
+  snip_t *s = R->S + i;
+  if (R->D) s->snip = index_doc_text (R->I, R->D[i].i);
+  if (!R->snipsz) return 0;
+  char *old = s->snip, **words = R->words;
+  float score = s->score;
+  uint snipsz = R->snipsz, ngramsz = R->ngramsz;
+  //printf ("%srerank%s: %s %s\n", fg_RED, RESET, s->id, s->snip);
+  //if     (ngramsz) s->snip = hybrid_snippet (old, words, Q, ngramsz, snipsz, &score);
+  //if     (ngramsz) s->snip = (len(words) > 3 ?
+  //ngram_snippet (old, Q, ngramsz, snipsz, &score) :
+  //html_snippet (old, words, snipsz, &score));
+  if     (ngramsz) s->snip = (R->paragr ?
+			      best_paragraph (R->I, old, R->qry, R->Q, ngramsz, &score) :
+			      strlen(R->qry) > 60 ?
+			      ngram_snippet (old, R->Q, ngramsz, snipsz, &score) :
+			      html_snippet (old, words, snipsz, &score));
+  else if (R->curses) s->snip = curses_snippet (old, words, snipsz, &score);
+  else if (R->hihtml) s->snip = html_snippet (old, words, snipsz, &score);
+  else if  (R->hilit) s->snip = hl_snippet (old, words, snipsz, &score);
+  else                s->snip = snippet2 (old, words, snipsz, &score);
+  s->score = score;
+  free(old);
+  return 0;
+}
+
+// fetch (if D) and shrink S on snipthreads=4, order and scores as serial
+static void rerank_docs (index_t *I, snip_t *S, jix_t *D, char *qry, char **words, char *prm) {
   //printf ("%squery%s: %s %s\n", fg_RED, RESET, qry, prm);
-  uint qryLen = strlen(qry);
-  uint snipsz = getprm(prm,"snipsz=",0);
-  if (!snipsz) return sort_vec (S, cmp_snip_score);
-  char *hilit = strstr(prm,"hilit");
-  char *curses = strstr(prm,"curses");
-  char *hihtml = strstr(prm,"hihtml");
-  char *paragr = strstr(prm,"paragr");
-  uint ngramsz = getprm(prm,"ngramsz=",0);
+  uint ngramsz = getprm(prm,"ngramsz=",0), snipsz = getprm(prm,"snipsz=",0);
+  uint i, n = len(S), nt = MIN (getprm(prm,"snipthreads=",4), n/2);
   //char **words = text_to_toks (qry, prm); // 3/18
-  hash_t *Q = ngramsz ? ngrams_dict (qry, ngramsz) : NULL;
-  snip_t *s;
-  for (s = S; s < S + len(S); ++s) {
-    char *old = s->snip;
-    float score = s->score;
-    //printf ("%srerank%s: %s %s\n", fg_RED, RESET, s->id, s->snip);
-    //if     (ngramsz) s->snip = hybrid_snippet (old, words, Q, ngramsz, snipsz, &score);
-    //if     (ngramsz) s->snip = (len(words) > 3 ?
-    //ngram_snippet (old, Q, ngramsz, snipsz, &score) :
-    //html_snippet (old, words, snipsz, &score));
-    if     (ngramsz) s->snip = (paragr ?
-				best_paragraph (I, old, qry, Q, ngramsz, &score) :
-				qryLen > 60 ?
-				ngram_snippet (old, Q, ngramsz, snipsz, &score) :
-				html_snippet (old, words, snipsz, &score));
-    else if (curses) s->snip = curses_snippet (old, words, snipsz, &score);
-    else if (hihtml) s->snip = html_snippet (old, words, snipsz, &score);
-    else if  (hilit) s->snip = hl_snippet (old, words, snipsz, &score);
-    else             s->snip = snippet2 (old, words, snipsz, &score);
-    s->score = score;
-    free(old);
-    //break; // FIXME!
-  }
+  rerank_t R = {I, S, D, qry, words, strstr(prm,"hilit"), strstr(prm,"curses"),
+		strstr(prm,"hihtml"), strstr(prm,"paragr"), snipsz, ngramsz,
+		(snipsz && ngramsz) ? ngrams_dict (qry, ngramsz) : NULL};
+  if (!D && !snipsz) return sort_vec (S, cmp_snip_score);
+  if (nt > 1) parallel (nt, n, rerank_one, &R, NULL);
+  else for (i = 0; i < n; ++i) rerank_one (i, &R);
   sort_vec (S, cmp_snip_score);
-  free_hash (Q);
+  free_hash (R.Q);
   //free_toks (words); // 3/18
 }
 
-// helper function: extracts & reranks snippets for docs
-snip_t *ranked_snippets (index_t *I, jix_t *docs, char *qry, char **toks, char *prm) {
+// shrink snippet to size, rerank by how many words it covers.
+void rerank_snippets (index_t *I, snip_t *S, char *qry, char **words, char *prm) {
+  rerank_docs (I, S, NULL, qry, words, prm);
+}
+
+// ------------------------------ context ------------------------------
+
+qctx_t *new_qctx (char verbose) {
+  qctx_t *C = calloc (1, sizeof(qctx_t));
+  C->verbose = verbose;
+  C->t0 = mstime();
+  return C;
+}
+
+void free_qctx (qctx_t *C) {
+  if (!C) return;
+  free_accum (C->acc);
+  free (C);
+}
+
+static pthread_key_t QCTX_KEY;
+static pthread_once_t QCTX_ONCE = PTHREAD_ONCE_INIT;
+static void qctx_key_init () { pthread_key_create (&QCTX_KEY, (void (*)(void*)) free_qctx); }
+
+// one context per thread, freed when the thread exits
+qctx_t *thread_qctx () {
+  pthread_once (&QCTX_ONCE, qctx_key_init);
+  qctx_t *C = pthread_getspecific (QCTX_KEY);
+  if (!C) pthread_setspecific (QCTX_KEY, C = new_qctx (1));
+  return C;
+}
+
+// time since the previous stage of this query
+static void qlag (qctx_t *C, char *tag) {
+  if (C->verbose) loglag_at (&C->t0, tag);
+  else C->t0 = mstime();
+}
+
+// SCORE[doc] for Q in the context's accumulator, how: see accum2vec
+static ix_t *qctx_score (qctx_t *C, index_t *I, ix_t *Q, char how) {
+  coll_t *INVL = I->WORDxDOC;
+  accum_t *A = C->acc = grow_accum (C->acc, INVL->cdim);
+  if (!I->HOT) return cols_x_vec_acc (A, INVL, Q, how);
+  ix_t *q, *p, *P; void *pin;
+  for (q = Q; q < Q + len(Q); ++q) { // same as cols_x_vec_acc, no copies
+    P = get_hot (I->HOT, INVL, q->i, &pin);
+    for (p = P; p < P + len(P) && p->i <= A->n; ++p) *accum_at (A, p->i) += q->x * p->x;
+    put_hot (I->HOT, pin);
+  }
+  return accum2vec (A, how);
+}
+
+static snip_t *ranked_snippets_ctx (qctx_t *C, index_t *I, jix_t *docs, char *qry, char **toks, char *prm) {
   uint rerank = getprm(prm,"rerank=",50);
   sort_vec (docs, cmp_jix_X);
   if (len(docs) > rerank) len(docs) = rerank;
-  snip_t *S = lazy_snippets (docs, I->XML, I->DOC);
-  loglag("lazy");
-  rerank_snippets (I, S, qry, toks, prm);
-  loglag("rerank");
+  int rs = I->XML && !strncmp (I->XML->access, "rs", 2); // get_chunk is thread-safe: fetch in rerank
+  snip_t *S = doc_snippets (docs, I->XML, I->DOC);
+  uint i;
+  if (!rs) for (i = 0; i < len(S); ++i) S[i].snip = index_doc_text (I, docs[i].i);
+  qlag(C,"lazy");
+  rerank_docs (I, S, rs ? docs : NULL, qry, toks, prm);
+  qlag(C,"rerank");
   return S;
 }
 
+// helper function: extracts & reranks snippets for docs
+snip_t *ranked_snippets (index_t *I, jix_t *docs, char *qry, char **toks, char *prm) {
+  return ranked_snippets_ctx (thread_qctx(), I, docs, qry, toks, prm);
+}
+
 // compares two snippets by decreasing score.
 int cmp_snip_score (const void *n1, const void *n2) {
   float x1 = ((snip_t*)n1)->score;
@@ -200,7 +370,7 @@ ix_t *future_docs (ix_t *D, uint maxId, char *prm) {
 ix_t *rm_words (ix_t *Q, coll_t *DxW, coll_t *WxD, ulong *DF, char *prm) {
   uint limit = getprm(prm,"limit=",50);
   uint scale = getprm(prm,"scale=",1.0);
-  ix_t *D0 = timed_qry (Q, WxD, DF, prm); // deadline=100ms,beam=10000
+  ix_t *D0 = timed_qry (Q, WxD, NULL, DF, prm); // deadline=100ms,beam=10000
   trim_vec (D0, limit);
   //ix_t *D1 = future_docs(D0, num_rows(DxW), prm); // future=1,decay=0.5
   vec_x_num (D0, '*', scale);
@@ -359,7 +529,7 @@ int qry_altered (qry_t *Q, hash_t *H) {
 // ------------------------- spell-check -------------------------
 
 // corrects spelling of every query word, fuses if helpful
-void spell_qry (qry_t *Q, hash_t *H, float *F, char *prm) {
+void spell_qry (qry_t *Q, hash_t *H, float *F, char *prm, symdel_t *S) {
   char V = prm && strstr(prm,"verbose") ? 1 : 0;
   qry_t *q, *last = Q+len(Q)-1;
   for (q = Q; q <= last; ++q) q->id = has_key (H,q->tok); // pre-fetch
@@ -374,7 +544,7 @@ void spell_qry (qry_t *Q, hash_t *H, float *F, char *prm) {
 		     ok, q->tok, F[wL], (q+1)->tok, F[wR], id2key(H,wF), F[wF]);
       if (ok) { q->id = wF; (q+1)->op = 'x'; /* skip q+1 */ continue; }
     }
-    q->id = pubmed_spell (q->tok, H, F, prm, 0, &(q->id2));
+    q->id = pubmed_spell (q->tok, H, F, prm, 0, &(q->id2), S);
   }
 }
 
@@ -391,8 +561,9 @@ ix_t *exec_qry (index_t *I, qry_t *Q, char *prm) {
     q->docs = get_vec (I->WORDxDOC, q->id);
     //if (q->children) q->docs = exec_qry (I, q->children)
     if (q->id2) { // term was a runon => intersect (L,R)
-      ix_t *tmp = get_vec_ro (I->WORDxDOC, q->id2);
+      void *pin; ix_t *tmp = get_hot (I->HOT, I->WORDxDOC, q->id2, &pin);
       filter_and_sum (q->docs, tmp);
+      put_hot (I->HOT, pin);
     }
     if (!result) result = copy_vec (q->docs); // 1st term cannot be a negation
     else if (q->op == '.') filter_and_sum (result, q->docs);
@@ -405,10 +576,10 @@ ix_t *exec_qry (index_t *I, qry_t *Q, char *prm) {
 }
 
 // pqrse qry, execute, extract & rerank snippets
-snip_t *run_bool_qry (index_t *I, char *qry, char *prm) {
+static snip_t *bool_qry (index_t *I, char *qry, char *prm) {
   qry_t *Q = parse_qry (qry, prm); // prm: stop,stem=L
   //char *spell = strstr(prm,"spell");
-  //if (spell) spell_qry (Q, I->WORD, I->STATS->cf, prm); // prm: pubmed_spell
+  //if (spell) spell_qry (Q, I->WORD, I->STATS->cf, prm, NULL); // prm: pubmed_spell
   ix_t *docs = exec_qry (I, Q, prm); // prm: verbose
   jix_t *groups = ix2jix (0, docs); // no grouping
   char **toks = qry2toks (Q, I->WORD);
@@ -420,34 +591,49 @@ snip_t *run_bool_qry (index_t *I, char *qry, char *prm) {
   return snips;
 }
 
-snip_t *run_text_qry (index_t *I, char *_qry, char *prm, char *mask) {
+snip_t *run_bool_qry (index_t *I, char *qry, char *prm) {
+  if (!I->RESULTS) return bool_qry (I, qry, prm);
+  cache_check (I, prm);
+  char *key = cache_key ('B', qry, prm);
+  snip_t *S = cache_get (I->RESULTS, key);
+  if (!S) cache_put (I->RESULTS, key, copy_snippets (S = bool_qry (I, qry, prm)));
+  free (key);
+  return S;
+}
+
+static snip_t *text_qry (qctx_t *C, index_t *I, char *_qry, char *prm, char *mask) {
   //fprintf(stderr,"\nrun_text_qry: '%s'\n", qry);
-  if (!_qry) return new_vec (0, sizeof(snip_t));
   char *qry = strdup(_qry); // parse_vec destroys qry
   coll_t *INVL = I->WORDxDOC;
+  C->t0 = mstime();
   ulong *DF = I->STATS->df;
   ix_t *D, *Q = parse_vec_txt (qry, 0, I->WORD, prm); // stop,stem=K,tokw,nowb,gram=2:3
   jix_t *G = NULL; // groups of docs
-  loglag("parse");
+  qlag(C,"parse");
   //weigh_mtx_or_vec (0, Q, "idf,top=10", I->STATS); // inq,idf,top=10,thr=0,L2=1
-  if      (strstr(prm,"band"))  D = band_qry (Q, INVL);  // Boolean AND (fast!)
-  else if (strstr(prm,"timed")) D = timed_qry (Q, INVL, DF, prm); // deadline=100ms,beam=10000
+  if      (strstr(prm,"band"))  D = band_qry (Q, INVL, I->HOT);  // Boolean AND (fast!)
+  else if (strstr(prm,"timed")) D = timed_qry (Q, INVL, I->HOT, DF, prm); // deadline=100ms,beam=10000
   else if (strstr(prm,"merge")) D = vec_x_rows (Q, INVL); // merge lists: few rare terms
-  else if (strstr(prm,"score")) D = cols_x_vec (INVL, Q); // SCORE: many common terms
-  else if (strstr(prm,"iseen")) D = cols_x_vec_iseen (INVL, Q);
-  else if (strstr(prm,"iskip")) D = cols_x_vec_iskip (INVL, Q);
-  else assert(0 && "must specify band | timed | merge | score | iseen | iskip");
-  loglag("exec");
+  else if (strstr(prm,"wand")) D = (mask ? qctx_score (C, I, Q, 0) : // top-k must see the mask
+				  wand_qry (Q, INVL, I->STATS, getprm(prm,"rerank=",50))); // exact top-k
+  else if (strstr(prm,"score")) D = qctx_score (C, I, Q, 0); // SCORE: many common terms
+  else if (strstr(prm,"iseen")) D = qctx_score (C, I, Q, 'I');
+  else if (strstr(prm,"iskip")) D = qctx_score (C, I, Q, 'B');
+  else { // no mode: empty result, don't take the caller down
+    fprintf (stderr, "[text_qry] no mode in '%s': must specify band | timed | merge | score | iseen | iskip | wand\n", prm);
+    D = new_vec (0, sizeof(ix_t));
+  }
+  qlag(C,"exec");
   if (mask) {
     vec_x_set(D, '*', mask);
-    loglag("mask");
+    qlag(C,"mask");
   }
   if (strstr(prm,"dedup")) {
     uint limit = getprm(prm,"rerank=",50);
     float thresh = getprm(prm,"dedup=",1.1);
     sort_vec(D, cmp_ix_X);
     dedup_items (D, I->DOCxWORD, thresh, limit);
-    loglag("dedup");
+    qlag(C,"dedup");
   }
   if (strstr(prm,"clump")) {
     G = clump_docs (D, I->DOCxWORD, prm);
@@ -455,12 +641,12 @@ snip_t *run_text_qry (index_t *I, char *_qry, char *prm, char *mask) {
     one_per_clump (G);
     //group_jix_j(G);
     //show_jix (G, "1/group", '*');
-    loglag("clump");
+    qlag(C,"clump");
   }
   else G = ix2jix (1, D); // no grouping / clumping
   char **toks = vec2toks (Q, I->WORD);
-  snip_t *snips = ranked_snippets (I, G, _qry, toks, prm); // rerank=50, snipsz=300
-  loglag("snippets");
+  snip_t *snips = ranked_snippets_ctx (C, I, G, _qry, toks, prm); // rerank=50, snipsz=300
+  qlag(C,"snippets");
   free_vec(Q);
   free_vec(D);
   free_vec(G);
@@ -469,6 +655,23 @@ snip_t *run_text_qry (index_t *I, char *_qry, char *prm, char *mask) {
   return snips;
 }
 
+// mask: not cached
+snip_t *run_text_qry_ctx (qctx_t *C, index_t *I, char *qry, char *prm, char *mask) {
+  if (!qry) return new_vec (0, sizeof(snip_t));
+  if (!I->RESULTS || mask) return text_qry (C, I, qry, prm, mask);
+  cache_check (I, prm);
+  char *key = cache_key ('T', qry, prm);
+  snip_t *S = cache_get (I->RESULTS, key);
+  if (S) qlag(C,"cached");
+  else cache_put (I->RESULTS, key, copy_snippets (S = text_qry (C, I, qry, prm, NULL)));
+  free (key);
+  return S;
+}
+
+snip_t *run_text_qry (index_t *I, char *qry, char *prm, char *mask) {
+  return run_text_qry_ctx (thread_qctx(), I, qry, prm, mask);
+}
+
 /* unused? (was used in do_find)
 // returns toks as used by run_text_qry()
 char **text_qry_toks (index_t *I, char *qry, char *prm) {
@@ -484,22 +687,12 @@ char **text_qry_toks (index_t *I, char *qry, char *prm) {
 }
 */
 
-// Boolean AND of query terms (fast!)
-ix_t *band_qry (ix_t *Q, coll_t *INVL) {
-  ix_t *R = get_vec (INVL, Q->i), *q, *end = Q+len(Q);
-  for (q = Q; q < end; ++q) {
-    ix_t *D = get_vec_ro (INVL, q->i);
-    filter_and_sum (R, D);
-  }
-  return R;
-}
-
 // cost of each query term, slowest last
 ixy_t *qry_costs (ix_t *Q, ulong *DF, coll_t *INVL) {
   ixy_t *C = ix2ixy(Q, 0), *c;
   for (c = C; c < C+len(C); ++c) {
     c->y = 0;
-    if (c->i < len(DF)) c->y = DF[c->i];
+    if (DF && c->i < len(DF)) c->y = DF[c->i];
     if (c->y < 1) c->y = len_vec(INVL, c->i);
     if (c->y < 1) c->y = 1.0;
   }
@@ -507,6 +700,20 @@ ixy_t *qry_costs (ix_t *Q, ulong *DF, coll_t *INVL) {
   return C;
 }
 
+// Boolean AND of query terms (fast!), shortest list first
+ix_t *band_qry (ix_t *Q, coll_t *INVL, hot_t *HOT) {
+  if (!len(Q)) return new_vec (0, sizeof(ix_t));
+  ixy_t *C = qry_costs (Q, NULL, INVL), *c, *end = C+len(C);
+  ix_t *R = get_vec (INVL, C->i);
+  for (c = C+1; c < end && len(R); ++c) {
+    void *pin; ix_t *D = get_hot (HOT, INVL, c->i, &pin);
+    filter_and_sum (R, D);
+    put_hot (HOT, pin);
+  }
+  free_vec (C);
+  return R;
+}
+
 void show_qry_costs (ixy_t *Q) {
   uint i, n = len(Q);
   double sz = 0;
@@ -521,7 +728,7 @@ void show_qry_costs (ixy_t *Q) {
 
 // match as many query terms as possible before deadline
 // use DOT product, assume weighting pre-applied
-ix_t *timed_qry (ix_t *_Q, coll_t *INVL, ulong *DF, char *prm) {
+ix_t *timed_qry (ix_t *_Q, coll_t *INVL, hot_t *HOT, ulong *DF, char *prm) {
   double budget = getprm (prm,"timed=",100);
   double deadline = mstime() + budget;
   double max_bytes = getprm (prm, "qbytes=", 0);
@@ -539,10 +746,11 @@ ix_t *timed_qry (ix_t *_Q, coll_t *INVL, ulong *DF, char *prm) {
     used_bytes += q->y;
     if (max_bytes && max_bytes < used_bytes) break;
     if (max_terms && max_terms < q-Q) break;
-    ix_t *D = get_vec_ro (INVL, q->i), *tmp;
+    void *pin; ix_t *D = get_hot (HOT, INVL, q->i, &pin), *tmp;
     //fprintf(stderr, "%d:%.0fK ", q->i, q->y/1E3);
     R = vec_add_vec (1, tmp=R, q->x, D);
     free_vec(tmp);
+    put_hot (HOT, pin);
     if (len(R) < beam) continue;
     qselect(R, beam);
     len(R) = beam;
@@ -556,6 +764,162 @@ ix_t *timed_qry (ix_t *_Q, coll_t *INVL, ulong *DF, char *prm) {
   return R;
 }
 
+// ------------------------- top-k pruning (WAND) -------------------------
+
+typedef struct {
+  float w, ub; // query weight, w * largest weight in the list
+  vec_t *hdr;  // the list: in the map if "rs", else a private copy
+  char copy;   // hdr was copied, free it
+  ix_t *p, *end; // current posting, end of list (or of decoded block)
+  byte *P;     // packed list, NULL if plain
+  uint n, b;   // packed: number of postings, current block
+  uint sb;     // packed: block of the last cursor_bound
+  ix_t *buf;   // packed: decoded block
+} cursor_t;
+
+#define cur_doc(c) ((c)->p < (c)->end ? (c)->p->i : MAX_UINT)
+
+static void cursor_block (cursor_t *c, uint b) {
+  c->b = c->sb = b; c->p = c->buf;
+  c->end = c->buf + unpack_block (c->P, c->n, b, c->buf);
+}
+
+static void cursor_next (cursor_t *c) {
+  if (++c->p == c->end && c->P && c->b+1 < pack_nblk(c->n)) cursor_block (c, c->b+1);
+}
+
+// move cursor to the first posting with id >= d, packed: skip whole blocks
+static void cursor_seek (cursor_t *c, uint d) {
+  if (c->P && c->p < c->end && (c->end-1)->i < d) {
+    pblk_t *dir = pack_dir (c->P); uint b = c->b, nb = pack_nblk (c->n);
+    while (++b < nb && dir[b].last < d);
+    if (b >= nb) { c->p = c->end; return; }
+    cursor_block (c, b);
+  }
+  c->p = gallop_ix (c->p, c->end, d);
+}
+
+// bound on what c adds to any doc in d..*last, without decoding: the
+// block that would hold d if packed, the whole list if plain
+static float cursor_bound (cursor_t *c, uint d, uint *last) {
+  *last = MAX_UINT;
+  if (!c->P) {
+    if (c->end[-1].i < d) return 0; // list ends before d
+    *last = c->end[-1].i;
+    return c->ub;
+  }
+  pblk_t *dir = pack_dir (c->P); uint b = c->sb, nb = pack_nblk (c->n);
+  if (b < c->b || (b > c->b && dir[b-1].last >= d)) b = c->b;
+  while (b < nb && dir[b].last < d) ++b;
+  if ((c->sb = b) >= nb) return 0;
+  *last = dir[b].last;
+  return MAX (0, c->w * dir[b].xmax);
+}
+
+// largest weight in each list: STATS.mx if it describes this list (same
+// number of postings), else the block maxima if packed, else a scan
+static float list_max (cursor_t *c, uint id, stats_t *S) {
+  float mx = 0; ix_t *v;
+  if (S && S->mx && id < len(S->mx) && id < len(S->df) && S->df[id] == c->hdr->count) return S->mx[id];
+  if (c->P) {
+    pblk_t *d = pack_dir (c->P), *dEnd = d + pack_nblk (c->n);
+    for (mx = d->xmax; d < dEnd; ++d) mx = MAX (mx, d->xmax);
+  } else for (v = c->p; v < c->end; ++v) mx = MAX (mx, v->x);
+  return mx;
+}
+
+// one cursor per query term found in INVL, zero-copy if INVL is "rs"
+static cursor_t *wand_cursors (ix_t *Q, coll_t *INVL, stats_t *S) {
+  cursor_t *C = new_vec (0, sizeof(cursor_t)), c; ix_t *q;
+  for (q = Q; q < Q+len(Q); ++q) {
+    memset (&c, 0, sizeof(cursor_t));
+    c.copy = !is_shared (INVL);
+    c.hdr = c.copy ? get_chunk_pread (INVL, q->i) : get_chunk (INVL, q->i);
+    if (!c.hdr) continue; // no postings
+    c.w = q->x;
+    if (is_packed(c.hdr)) {
+      c.P = c.hdr->data; c.n = c.hdr->count;
+      c.buf = new_vec (PACK_BLOCK, sizeof(ix_t));
+      cursor_block (&c, 0);
+    } else {
+      c.p = (ix_t*) c.hdr->data; c.end = c.p + c.hdr->count;
+    }
+    if (c.p == c.end) { if (c.copy) free (c.hdr); free_vec (c.buf); continue; }
+    c.ub = MAX (0, c.w * list_max (&c, q->i, S));
+    C = append_vec (C, &c);
+  }
+  return C;
+}
+
+static void heap_up (float *H, uint i) { // min-heap of the k best scores
+  while (i && H[(i-1)/2] > H[i]) { float t = H[i]; H[i] = H[(i-1)/2]; H[i=(i-1)/2] = t; }
+}
+
+static void heap_down (float *H, uint n, uint i) {
+  for (;;) {
+    uint l = 2*i+1, r = l+1, m = i;
+    if (l < n && H[l] < H[m]) m = l;
+    if (r < n && H[r] < H[m]) m = r;
+    if (m == i) return;
+    float t = H[i]; H[i] = H[m]; H[m] = t; i = m;
+  }
+}
+
+#define WAND_EPS 1E-5 // bounds are summed in another order than scores
+
+// exact top-k docs by block-max WAND: skip docs whose score bound cannot
+// reach the k'th best, first by list maxima, then by block maxima. Scores
+// are summed in query order, same as cols_x_vec, and ties with the k'th
+// best are kept. Needs positive query weights.
+ix_t *wand_qry (ix_t *Q, coll_t *INVL, stats_t *S, uint k) {
+  ix_t *q; uint i, p, m, nh = 0; ulong scored = 0, total = 0;
+  for (q = Q; q < Q+len(Q); ++q) if (q->x <= 0) return cols_x_vec (INVL, Q);
+  if (!INVL->path || !k) return cols_x_vec (INVL, Q);
+  cursor_t *C = wand_cursors (Q, INVL, S), *c, *end = C + len(C), **O = new_vec (len(C), sizeof(cursor_t*));
+  float *H = new_vec (k, sizeof(float)), theta = 0;
+  ix_t *R = new_vec (0, sizeof(ix_t));
+  for (m = 0; m < len(C); ++m) { O[m] = C+m; total += C[m].hdr->count; }
+  for (;;) {
+    for (i = 1; i < m; ++i) { // insertion sort by current doc, almost sorted
+      cursor_t *t = O[i]; uint d = cur_doc(t);
+      for (p = i; p && cur_doc(O[p-1]) > d; --p) O[p] = O[p-1];
+      O[p] = t;
+    }
+    float bound = 0, reach = theta * (1 - WAND_EPS); // pivot: first cursor where the bounds reach theta
+    for (p = 0; p < m && cur_doc(O[p]) < MAX_UINT; ++p) if ((bound += O[p]->ub) >= reach) break;
+    if (p == m || cur_doc(O[p]) == MAX_UINT) break; // no doc can reach theta
+    uint d = cur_doc(O[p]), next, last;
+    while (p+1 < m && cur_doc(O[p+1]) == d) ++p; // every cursor on d
+    next = (p+1 < m) ? cur_doc(O[p+1]) : MAX_UINT;
+    for (bound = 0, i = 0; i <= p; ++i) {
+      bound += cursor_bound (O[i], d, &last);
+      if (last < next) next = last + 1;
+    }
+    if (bound < reach) { // block maxima: no doc in d..next-1 can reach theta
+      for (i = 0; i <= p; ++i) cursor_seek (O[i], next);
+      continue;
+    }
+    if (cur_doc(O[0]) < d) { // docs before d cannot reach theta
+      for (i = 0; i < p; ++i) cursor_seek (O[i], d);
+      continue;
+    }
+    ix_t r = {d, 0};
+    for (c = C; c < end; ++c) if (cur_doc(c) == d) { r.x += c->w * c->p->x; cursor_next (c); ++scored; }
+    if (r.x <= 0 || r.x < theta) continue;
+    R = append_vec (R, &r);
+    if (nh < k) { H[nh] = r.x; heap_up (H, nh++); }
+    else if (r.x > H[0]) { H[0] = r.x; heap_down (H, nh, 0); }
+    if (nh == k) theta = H[0];
+  }
+  ix_t *r, *w = R;
+  for (r = R; r < R+len(R); ++r) if (r->x >= theta) *w++ = *r; // drop docs that fell out
+  len(R) = w - R;
+  fprintf(stderr, "%swand_qry%s docs:%d scored:%ld/%ld postings\n", fg_BLUE, RESET, len(R), scored, total);
+  for (c = C; c < end; ++c) { if (c->copy) free (c->hdr); free_vec (c->buf); }
+  free_vec (C); free_vec (O); free_vec (H);
+  return R;
+}
+
 #ifdef MAIN
 
 int dump_parsed_qry (char *qry) {
@@ -571,11 +935,14 @@ int dump_spelled_qry (char *qry, char *_H, char *_F, char *prm) {
   qry_t *Q = parse_qry (qry, "");
   hash_t *H = open_hash (_H,"r");
   float *F = mtx_full_row (_F, 1);
+  char *idx = getprms (prm,"symdel=",NULL,",");
+  symdel_t *S = idx ? open_symdel (idx, H) : NULL;
   //expose_spell (Q, H, F, prm);
-  spell_qry (Q, H, F, prm);
+  spell_qry (Q, H, F, prm, S);
   char *str = qry2str (Q, H);
   printf("'%s'\n", str);
   free_qry(Q);
+  free_symdel(S); free(idx);
   free_hash(H);
   free_vec(F);
   free(str);
@@ -651,6 +1018,72 @@ int do_text_qry (char *qry, char *index, char *prm) {
   return 0;
 }
 
+// ------------------------------ server ------------------------------
+
+typedef struct {
+  index_t *I;
+  char *prm; // defaults for every query
+} serve_t;
+
+// 1 if prm names one of the text_qry modes
+static int has_mode (char *prm) {
+  static char *modes[] = {"band", "timed", "merge", "wand", "score", "iseen", "iskip", NULL};
+  for (char **m = modes; *m; ++m) if (strstr (prm, *m)) return 1;
+  return 0;
+}
+
+// one line from a client: "query" or "prm<TAB>query", prm overrides the
+// defaults, "score" if neither names a mode.
+// Reply: "score<TAB>id<TAB>snippet" per doc, then an empty line, sent in
+// one go. -1 if the client stopped reading (server_lines drops it).
+static int serve_qry (int fd, char *line, void *arg) {
+  serve_t *S = arg;
+  char *tab = strchr (line,'\t'), *qry = tab ? tab+1 : line;
+  if (tab) *tab = 0;
+  char *prm = tab ? acat3 (line, ",", S->prm) : strdup (S->prm);
+  if (!has_mode (prm)) { char *p = acat3 (prm, ",", "score"); free (prm); prm = p; }
+  uint limit = getprm (prm,"limit=",10);
+  qctx_t *C = thread_qctx (); // this worker's scratch state
+  C->verbose = (strstr (prm,"verbose") != NULL);
+  double t0 = mstime ();
+  snip_t *s, *R = *qry ? run_text_qry_ctx (C, S->I, qry, prm, NULL) : new_vec (0, sizeof(snip_t));
+  limit = MIN(limit,len(R));
+  char *buf = NULL; size_t sz = 0;
+  FILE *out = open_memstream (&buf, &sz);
+  for (s = R; s < R+limit; ++s) {
+    if (s->snip) csub (s->snip, "\t\r\n", ' '); // keep one doc per line
+    fprintf (out, "%.4f\t%s\t%s\n", s->score, s->id, (s->snip ? s->snip : ""));
+  }
+  fprintf (out, "\n");
+  fclose (out);
+  int sent = send_all (fd, buf, sz);
+  free (buf);
+  fprintf (stderr, "[serve:%d] %.1fms %d docs%s: %s\n", fd, mstime() - t0, limit,
+	   (sent < 0 ? ", client not reading, dropped" : ""), qry);
+  cache_t *K = S->I->RESULTS;
+  if (K && !((K->hits + K->misses) % 1000)) show_cache (K, "serve:cache");
+  cache_t *T = S->I->TEXT;
+  if (T && !((T->hits + T->misses) % 10000)) show_cache (T, "serve:text");
+  hot_t *H = S->I->HOT;
+  if (H && !((H->hits + H->misses + H->views) % 10000)) show_hot (H, "serve:hot");
+  free_snippets (R);
+  free (prm);
+  return sent;
+}
+
+int do_serve (char *index, char *prm) {
+  uint port = getprm (prm,"port=",8080), nt = getprm (prm,"threads=",4);
+  uint timeout = getprm (prm,"sendms=",1000); // a client that doesn't read for this long is dropped
+  char *how = strstr (prm,"lazy") ? "rs" : "rs!"; // pre-fault unless lazy
+  serve_t S = {open_shared_index (index, how), prm};
+  cache_results (S.I, prm); // cache=MB,hot=MB,text=MB
+  if (!S.I->WORD || !S.I->WORDxDOC || !S.I->STATS)
+    return fprintf (stderr, "%s: need WORD, WORDxDOC, STATS\n", index);
+  server_lines (port, nt, timeout, serve_qry, &S);
+  free_index (S.I);
+  return 0;
+}
+
 int look_for_reuse (char *index, char *prm) {
   index_t *I = open_index (index);
   uint Len = getprm(prm,"len=",30);
@@ -662,7 +1095,7 @@ int look_for_reuse (char *index, char *prm) {
     uint id = 1 + (random() % nd);
     ix_t *Q = get_vec (VECS, id);
     if (sum(Q) < Len) {free_vec(Q); continue;} // too short
-    ix_t *D = timed_qry (Q, I->WORDxDOC, I->STATS->df, prm), *d;
+    ix_t *D = timed_qry (Q, I->WORDxDOC, I->HOT, I->STATS->df, prm), *d;
     sort_vec(D, cmp_ix_X);
     for (d = D; d < D+len(D); ++d)
       if ((d->x / D->x) < sim) break;
@@ -685,15 +1118,24 @@ int look_for_reuse (char *index, char *prm) {
 
 char *usage =
   "usage: query -parse 'rimantadin acid ic +\"aspirine\"'\n"
-  "       query -spell 'rimantadin acid ic' WORD WORD_CF [verbose]\n"
+  "       query -spell 'rimantadin acid ic' WORD WORD_CF [verbose,symdel=SPELL]\n"
   "       query -exec  'rimantadin acid ic' dir [prm]\n"
   "       query -reuse dir [prm]\n"
   "       query -text  'rimantadin acid ic' dir [prm]\n"
+  "       query -serve dir [prm] ... line per query on port=8080, threads=4\n"
+  "                     replies score<TAB>id<TAB>snippet lines, then an empty line\n"
+  "                     'prm<TAB>query' overrides prm for one query, lazy: no pre-fault\n"
+  "                     sendms=1000: drop a client that doesn't read its reply for 1s\n"
+  "                     cache=MB,cacheN=10000: keep results, fresh: drop if index changed\n"
+  "                     hot=MB: pin decoded postings of frequent terms\n"
+  "                     text=MB: keep cleaned text of recent docs (see kvs -zdoc)\n"
   "              dir: DOC WORD DOCxWORD WORDxDOC XML STATS\n"
   "              qry: 'query words' | 'docid=X' \n"
   "              prm: stop,stem=L,tokw,gram=2:3,ow=2,uw=3\n"
   "                   band | merge | score | iseen | iskip | timed=100ms,beam=999\n"
+  "                   wand ... top rerank= docs of score, skips hopeless postings\n"
   "                   dedup=0.9,rerank=50,limit=5,snipsz=100\n"
+  "                   snipthreads=4 ... fetch + shrink snippets in parallel\n"
   "                   hilit | hihtml | curses | qdiff | ngram=3\n"
   ;
 
@@ -704,6 +1146,7 @@ int main (int argc, char *argv[]) {
   if (!strcmp(a(1),"-exec")) return do_exec_qry(a(2), a(3), a(4));
   if (!strcmp(a(1),"-text")) return do_text_qry(a(2), a(3), a(4));
   if (!strcmp(a(1),"-reuse")) return look_for_reuse (a(2), a(3));
+  if (!strcmp(a(1),"-serve")) return do_serve (a(2), a(3));
   return 0;
 }
 
@@ -20,6 +20,8 @@
 */
 
 #include "matrix.h"
+#include "cache.h"
+#include "spell.h"
 
 #ifndef QUERY
 #define QUERY
@@ -34,10 +36,15 @@ typedef struct {
   coll_t *XML;
   coll_t *JSON;
   stats_t *STATS;
+  cache_t *RESULTS; // of run_*_qry, see cache_results
+  hot_t *HOT; // pinned WORDxDOC postings, see cache_results
+  cache_t *TEXT; // cleaned XML of recently shown docs, see cache_results
 } index_t;
 
 index_t *open_index (char *dir) ;
+index_t *open_shared_index (char *dir, char *how) ; // "rs": many threads, "rs!" pre-faulted
 void free_index (index_t *I) ;
+void cache_results (index_t *I, char *prm) ; // cache=MB,cacheN=10000,hot=MB,text=MB
 
 // ------------------------------ snippets ------------------------------
 
@@ -57,6 +64,7 @@ typedef struct {
 int num_snippets(snip_t *S);
 // de-allocates a vector of snippets.
 void free_snippets (snip_t *S) ;
+snip_t *copy_snippets (snip_t *S) ;
 // returns full text as a snippet for each each doc in D.
 snip_t *bare_snippets (ix_t *D, hash_t *IDs) ; // just id and score
 snip_t *lazy_snippets (jix_t *D, coll_t *XML, hash_t *IDs) ;
@@ -97,20 +105,34 @@ int qry_altered (qry_t *Q, hash_t *H) ;
 // converts (structured) query to a list of tokens (for snippets)
 char **qry2toks (qry_t *Q, hash_t *H) ;
 
-// corrects spelling of every query word, fuses if helpful
-void spell_qry (qry_t *Q, hash_t *H, float *F, char *prm) ;
+// corrects spelling of every query word, fuses if helpful (S: see pubmed_spell)
+void spell_qry (qry_t *Q, hash_t *H, float *F, char *prm, symdel_t *S) ;
 
 // combine inv.lists for each term in Q using AND / OR / NOT
 ix_t *exec_qry (index_t *I, qry_t *Q, char *prm) ;
 
+// scratch state of one running query: any number of threads can run
+// queries against the same index, as long as each has its own context
+typedef struct {
+  accum_t *acc; // SCORE[doc], touched docs, skip bitmap
+  double t0;    // end of the previous stage (ms)
+  char verbose; // log stage timings to stderr
+} qctx_t;
+
+qctx_t *new_qctx (char verbose) ;
+void free_qctx (qctx_t *C) ;
+qctx_t *thread_qctx () ; // per-thread context (verbose), freed at thread exit
+
 snip_t *run_bool_qry (index_t *I, char *qry, char *prm) ;
-snip_t *run_text_qry (index_t *I, char *qry, char *prm, char *mask) ;
+snip_t *run_text_qry (index_t *I, char *qry, char *prm, char *mask) ; // thread_qctx
+snip_t *run_text_qry_ctx (qctx_t *C, index_t *I, char *qry, char *prm, char *mask) ;
 
 snip_t *text_keywords (index_t *I, char *text, uint limit) ;
 char **text_qry_toks (index_t *I, char *qry, char *prm) ;
 
-ix_t *band_qry (ix_t *Q, coll_t *INVL) ;
-ix_t *timed_qry (ix_t *_Q, coll_t *INVL, ulong *DF, char *prm) ;
+ix_t *band_qry (ix_t *Q, coll_t *INVL, hot_t *HOT) ;
+ix_t *timed_qry (ix_t *_Q, coll_t *INVL, hot_t *HOT, ulong *DF, char *prm) ;
+ix_t *wand_qry (ix_t *Q, coll_t *INVL, stats_t *S, uint k) ; // exact top-k, bounds: S->mx or NULL
 
 void dedup_docs (ix_t *D, coll_t *DOCS, char *prm);
 
@@ -0,0 +1,336 @@
+/*
+
+  Copyright (c) 1997-2025 Victor Lavrenko (v.lavrenko@gmail.com)
+
+  This file is part of YARI.
+
+  YARI is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  YARI is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YARI. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <immintrin.h>
+#include <stdio.h>
+#include <string.h>
+#include "simd.h"
+
+// a*x+y is rounded twice, like the scalar loops: no fused multiply-add,
+// not even where target ("avx512f") lets the compiler contract it
+#pragma GCC optimize ("fp-contract=off")
+
+// -------------------- scalar reference --------------------
+
+static double dot_1 (float *A, float *B, uint n) {
+  double s = 0; uint i;
+  for (i = 0; i < n; ++i) s += A[i] * B[i];
+  return s; }
+
+static double sum_1 (float *A, uint n, float p) {
+  double s = 0; uint i;
+  if (p == 2) for (i = 0; i < n; ++i) s += A[i] * A[i];
+  else        for (i = 0; i < n; ++i) s += A[i];
+  return s; }
+
+static double dist_1 (float *A, float *B, uint n, float p) {
+  double s = 0, d; uint i;
+  if (p == 2) for (i = 0; i < n; ++i) { d = A[i] - B[i]; s += d * d; }
+  else        for (i = 0; i < n; ++i) { d = A[i] - B[i]; s += ABS(d); }
+  return s; }
+
+static void axpy_1 (float a, float *X, float *Y, uint n) {
+  uint i;
+  for (i = 0; i < n; ++i) Y[i] += a * X[i]; }
+
+static double dot_ix_1 (ix_t *A, ix_t *B, uint n) {
+  double s = 0; uint i;
+  for (i = 0; i < n; ++i) s += A[i].x * B[i].x;
+  return s; }
+
+static double dist_ix_1 (ix_t *A, ix_t *B, uint n, float p) {
+  double s = 0, d; uint i;
+  if (p == 2) for (i = 0; i < n; ++i) { d = A[i].x - B[i].x; s += d * d; }
+  else        for (i = 0; i < n; ++i) { d = A[i].x - B[i].x; s += ABS(d); }
+  return s; }
+
+static double gather_1 (ix_t *V, uint n, float *F) {
+  double s = 0; uint i;
+  for (i = 0; i < n; ++i) s += V[i].x * F[V[i].i];
+  return s; }
+
+// -------------------- AVX2: 8 floats at a time --------------------
+
+#define AVX2 __attribute__ ((target ("avx2")))
+
+// s0 += low 4 of x, s1 += high 4 of x (in double)
+#define ADD8(s0,s1,x) {							\
+    s0 = _mm256_add_pd (s0, _mm256_cvtps_pd (_mm256_castps256_ps128 (x))); \
+    s1 = _mm256_add_pd (s1, _mm256_cvtps_pd (_mm256_extractf128_ps (x, 1))); }
+
+// same, but squares of x (in double)
+#define SQ8(s0,s1,x) {							\
+    __m256d lo = _mm256_cvtps_pd (_mm256_castps256_ps128 (x));		\
+    __m256d hi = _mm256_cvtps_pd (_mm256_extractf128_ps (x, 1));	\
+    s0 = _mm256_add_pd (s0, _mm256_mul_pd (lo, lo));			\
+    s1 = _mm256_add_pd (s1, _mm256_mul_pd (hi, hi)); }
+
+static inline AVX2 double hsum4 (__m256d s0, __m256d s1) {
+  double t[4]; _mm256_storeu_pd (t, _mm256_add_pd (s0, s1));
+  return t[0] + t[1] + t[2] + t[3]; }
+
+// x fields of 8 ix_t at V (order within the register is irrelevant for sums)
+static inline AVX2 __m256 x8 (ix_t *V) {
+  return _mm256_shuffle_ps (_mm256_loadu_ps ((float*)V), _mm256_loadu_ps ((float*)(V+4)), 0xDD); }
+
+static inline AVX2 __m256 abs8 (__m256 x) {
+  return _mm256_andnot_ps (_mm256_set1_ps (-0.0f), x); }
+
+static AVX2 double dot_avx2 (float *A, float *B, uint n) {
+  __m256d s0 = _mm256_setzero_pd (), s1 = s0; uint i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_mul_ps (_mm256_loadu_ps (A+i), _mm256_loadu_ps (B+i));
+    ADD8 (s0, s1, x); }
+  return hsum4 (s0, s1) + dot_1 (A+i, B+i, n-i); }
+
+static AVX2 double sum_avx2 (float *A, uint n, float p) {
+  __m256d s0 = _mm256_setzero_pd (), s1 = s0; uint i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_loadu_ps (A+i);
+    if (p == 2) x = _mm256_mul_ps (x, x);
+    ADD8 (s0, s1, x); }
+  return hsum4 (s0, s1) + sum_1 (A+i, n-i, p); }
+
+static AVX2 double dist_avx2 (float *A, float *B, uint n, float p) {
+  __m256d s0 = _mm256_setzero_pd (), s1 = s0; uint i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 d = _mm256_sub_ps (_mm256_loadu_ps (A+i), _mm256_loadu_ps (B+i));
+    if (p == 2) SQ8 (s0, s1, d) else ADD8 (s0, s1, abs8 (d)); }
+  return hsum4 (s0, s1) + dist_1 (A+i, B+i, n-i, p); }
+
+static AVX2 void axpy_avx2 (float a, float *X, float *Y, uint n) {
+  __m256 A = _mm256_set1_ps (a); uint i = 0;
+  for (; i + 8 <= n; i += 8) // no FMA: round a*X like the scalar loop
+    _mm256_storeu_ps (Y+i, _mm256_add_ps (_mm256_loadu_ps (Y+i), _mm256_mul_ps (A, _mm256_loadu_ps (X+i))));
+  axpy_1 (a, X+i, Y+i, n-i); }
+
+static AVX2 double dot_ix_avx2 (ix_t *A, ix_t *B, uint n) {
+  __m256d s0 = _mm256_setzero_pd (), s1 = s0; uint i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_mul_ps (x8 (A+i), x8 (B+i));
+    ADD8 (s0, s1, x); }
+  return hsum4 (s0, s1) + dot_ix_1 (A+i, B+i, n-i); }
+
+static AVX2 double dist_ix_avx2 (ix_t *A, ix_t *B, uint n, float p) {
+  __m256d s0 = _mm256_setzero_pd (), s1 = s0; uint i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 d = _mm256_sub_ps (x8 (A+i), x8 (B+i));
+    if (p == 2) SQ8 (s0, s1, d) else ADD8 (s0, s1, abs8 (d)); }
+  return hsum4 (s0, s1) + dist_ix_1 (A+i, B+i, n-i, p); }
+
+static AVX2 double gather_avx2 (ix_t *V, uint n, float *F) {
+  __m256d s0 = _mm256_setzero_pd (), s1 = s0; uint i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 lo = _mm256_loadu_ps ((float*)(V+i)), hi = _mm256_loadu_ps ((float*)(V+i+4));
+    __m256i id = _mm256_castps_si256 (_mm256_shuffle_ps (lo, hi, 0x88));
+    __m256 x = _mm256_mul_ps (_mm256_shuffle_ps (lo, hi, 0xDD), _mm256_i32gather_ps (F, id, 4));
+    ADD8 (s0, s1, x); }
+  return hsum4 (s0, s1) + gather_1 (V+i, n-i, F); }
+
+// -------------------- AVX-512: 16 floats at a time --------------------
+
+#define AVX512 __attribute__ ((target ("avx512f")))
+
+#define ADD16(s0,s1,x) {						\
+    s0 = _mm512_add_pd (s0, _mm512_cvtps_pd (_mm512_castps512_ps256 (x))); \
+    s1 = _mm512_add_pd (s1, _mm512_cvtps_pd (_mm256_castpd_ps (_mm512_extractf64x4_pd (_mm512_castps_pd (x), 1)))); }
+
+#define SQ16(s0,s1,x) {						\
+    __m512d lo = _mm512_cvtps_pd (_mm512_castps512_ps256 (x));		\
+    __m512d hi = _mm512_cvtps_pd (_mm256_castpd_ps (_mm512_extractf64x4_pd (_mm512_castps_pd (x), 1))); \
+    s0 = _mm512_add_pd (s0, _mm512_mul_pd (lo, lo));			\
+    s1 = _mm512_add_pd (s1, _mm512_mul_pd (hi, hi)); }
+
+static inline AVX512 __m512 x16 (ix_t *V) {
+  return _mm512_shuffle_ps (_mm512_loadu_ps ((float*)V), _mm512_loadu_ps ((float*)(V+8)), 0xDD); }
+
+static AVX512 double dot_avx512 (float *A, float *B, uint n) {
+  __m512d s0 = _mm512_setzero_pd (), s1 = s0; uint i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 x = _mm512_mul_ps (_mm512_loadu_ps (A+i), _mm512_loadu_ps (B+i));
+    ADD16 (s0, s1, x); }
+  return _mm512_reduce_add_pd (_mm512_add_pd (s0, s1)) + dot_1 (A+i, B+i, n-i); }
+
+static AVX512 double sum_avx512 (float *A, uint n, float p) {
+  __m512d s0 = _mm512_setzero_pd (), s1 = s0; uint i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 x = _mm512_loadu_ps (A+i);
+    if (p == 2) x = _mm512_mul_ps (x, x);
+    ADD16 (s0, s1, x); }
+  return _mm512_reduce_add_pd (_mm512_add_pd (s0, s1)) + sum_1 (A+i, n-i, p); }
+
+static AVX512 double dist_avx512 (float *A, float *B, uint n, float p) {
+  __m512d s0 = _mm512_setzero_pd (), s1 = s0; uint i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 d = _mm512_sub_ps (_mm512_loadu_ps (A+i), _mm512_loadu_ps (B+i));
+    if (p == 2) SQ16 (s0, s1, d) else ADD16 (s0, s1, _mm512_abs_ps (d)); }
+  return _mm512_reduce_add_pd (_mm512_add_pd (s0, s1)) + dist_1 (A+i, B+i, n-i, p); }
+
+static AVX512 void axpy_avx512 (float a, float *X, float *Y, uint n) {
+  __m512 A = _mm512_set1_ps (a); uint i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm512_storeu_ps (Y+i, _mm512_add_ps (_mm512_loadu_ps (Y+i), _mm512_mul_ps (A, _mm512_loadu_ps (X+i))));
+  axpy_1 (a, X+i, Y+i, n-i); }
+
+static AVX512 double dot_ix_avx512 (ix_t *A, ix_t *B, uint n) {
+  __m512d s0 = _mm512_setzero_pd (), s1 = s0; uint i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 x = _mm512_mul_ps (x16 (A+i), x16 (B+i));
+    ADD16 (s0, s1, x); }
+  return _mm512_reduce_add_pd (_mm512_add_pd (s0, s1)) + dot_ix_1 (A+i, B+i, n-i); }
+
+static AVX512 double dist_ix_avx512 (ix_t *A, ix_t *B, uint n, float p) {
+  __m512d s0 = _mm512_setzero_pd (), s1 = s0; uint i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 d = _mm512_sub_ps (x16 (A+i), x16 (B+i));
+    if (p == 2) SQ16 (s0, s1, d) else ADD16 (s0, s1, _mm512_abs_ps (d)); }
+  return _mm512_reduce_add_pd (_mm512_add_pd (s0, s1)) + dist_ix_1 (A+i, B+i, n-i, p); }
+
+static AVX512 double gather_avx512 (ix_t *V, uint n, float *F) {
+  __m512d s0 = _mm512_setzero_pd (), s1 = s0; uint i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 lo = _mm512_loadu_ps ((float*)(V+i)), hi = _mm512_loadu_ps ((float*)(V+i+8));
+    __m512i id = _mm512_castps_si512 (_mm512_shuffle_ps (lo, hi, 0x88));
+    __m512 x = _mm512_mul_ps (_mm512_shuffle_ps (lo, hi, 0xDD), _mm512_i32gather_ps (id, F, 4));
+    ADD16 (s0, s1, x); }
+  return _mm512_reduce_add_pd (_mm512_add_pd (s0, s1)) + gather_1 (V+i, n-i, F); }
+
+// -------------------- dispatch --------------------
+
+typedef struct {
+  char *name;
+  double (*dot)     (float *A, float *B, uint n);
+  double (*sum)     (float *A, uint n, float p);
+  double (*dist)    (float *A, float *B, uint n, float p);
+  void   (*axpy)    (float a, float *X, float *Y, uint n);
+  double (*dot_ix)  (ix_t *A, ix_t *B, uint n);
+  double (*dist_ix) (ix_t *A, ix_t *B, uint n, float p);
+  double (*gather)  (ix_t *V, uint n, float *F);
+} simd_t;
+
+static simd_t KERNELS[] = {
+  {"avx512", dot_avx512, sum_avx512, dist_avx512, axpy_avx512, dot_ix_avx512, dist_ix_avx512, gather_avx512},
+  {"avx2",   dot_avx2,   sum_avx2,   dist_avx2,   axpy_avx2,   dot_ix_avx2,   dist_ix_avx2,   gather_avx2},
+  {"scalar", dot_1,      sum_1,      dist_1,      axpy_1,      dot_ix_1,      dist_ix_1,      gather_1}};
+
+static simd_t *K = NULL; // set once, racing initialisers pick the same
+
+static int supported (simd_t *k) {
+  __builtin_cpu_init ();
+  if (!strcmp (k->name, "avx512")) return __builtin_cpu_supports ("avx512f");
+  if (!strcmp (k->name, "avx2"))   return __builtin_cpu_supports ("avx2");
+  return 1;
+}
+
+char *simd_level (char *want) {
+  simd_t *k;
+  for (k = KERNELS; k < KERNELS + 3; ++k)
+    if ((!want || !strcmp (want, k->name)) && supported (k)) return (K = k)->name;
+  return K ? K->name : simd_level (NULL); // unknown or unsupported: keep current
+}
+
+static inline simd_t *kern () { if (!K) simd_level (NULL); return K; }
+
+double simd_dot (float *A, float *B, uint n) { return kern()->dot (A, B, n); }
+double simd_sum (float *A, uint n, float p) { return kern()->sum (A, n, p); }
+double simd_dist (float *A, float *B, uint n, float p) { return kern()->dist (A, B, n, p); }
+void   simd_axpy (float a, float *X, float *Y, uint n) { kern()->axpy (a, X, Y, n); }
+double simd_dot_ix (ix_t *A, ix_t *B, uint n) { return kern()->dot_ix (A, B, n); }
+double simd_dist_ix (ix_t *A, ix_t *B, uint n, float p) { return kern()->dist_ix (A, B, n, p); }
+double simd_gather (ix_t *V, uint n, float *F) { return kern()->gather (V, n, F); }
+
+#ifdef MAIN
+
+#include <stdlib.h>
+#include <math.h>
+#include "timeutil.h"
+
+#define arg(i) ((i < argc) ? argv[i] : NULL)
+#define a(i) ((i < argc) ? argv[i] : "")
+
+static double rel_err (double x, double ref) { return ABS(x - ref) / (ABS(ref) > 1 ? ABS(ref) : 1); }
+
+// every kernel of every supported level vs. scalar: error and speed
+int bench (uint n, uint R, double tol) {
+  float *A = malloc (n * sizeof(float)), *B = malloc (n * sizeof(float));
+  float *Y = malloc (n * sizeof(float)), *Y1 = malloc (n * sizeof(float));
+  ix_t *IA = malloc (n * sizeof(ix_t)), *IB = malloc (n * sizeof(ix_t)), *S = malloc (n * sizeof(ix_t));
+  uint i, r, bad = 0;
+  for (i = 0; i < n; ++i) {
+    A[i] = IA[i].x = (random() % 2000 - 1000) / 100.;
+    B[i] = IB[i].x = (random() % 2000 - 1000) / 100.;
+    IA[i].i = IB[i].i = i+1;
+    S[i].i = random() % n; S[i].x = A[i];
+  }
+  simd_t *k, *k1 = KERNELS + 2;
+  printf ("%-8s %-8s %12s %10s %8s\n", "kernel", "level", "ns/call", "speedup", "error");
+  for (k = KERNELS; k < KERNELS + 3; ++k) {
+    if (!supported (k)) { printf ("%-8s %-8s not supported by this CPU\n", "*", k->name); continue; }
+    for (uint which = 0; which < 7; ++which) {
+      char *name[] = {"dot", "sum2", "dist1", "dist2_ix", "axpy", "dot_ix", "gather"};
+      double x = 0, x1 = 0, err; ulong t0, t1, t2;
+      memcpy (Y, B, n * sizeof(float)); memcpy (Y1, B, n * sizeof(float));
+      t0 = ustime();
+      for (r = 0; r < R; ++r) switch (which) {
+	case 0: x1 += k1->dot (A, B, n); break;
+	case 1: x1 += k1->sum (A, n, 2); break;
+	case 2: x1 += k1->dist (A, B, n, 1); break;
+	case 3: x1 += k1->dist_ix (IA, IB, n, 2); break;
+	case 4: k1->axpy (.5, A, Y1, n); break;
+	case 5: x1 += k1->dot_ix (IA, IB, n); break;
+	case 6: x1 += k1->gather (S, n, B); break; }
+      t1 = ustime();
+      for (r = 0; r < R; ++r) switch (which) {
+	case 0: x += k->dot (A, B, n); break;
+	case 1: x += k->sum (A, n, 2); break;
+	case 2: x += k->dist (A, B, n, 1); break;
+	case 3: x += k->dist_ix (IA, IB, n, 2); break;
+	case 4: k->axpy (.5, A, Y, n); break;
+	case 5: x += k->dot_ix (IA, IB, n); break;
+	case 6: x += k->gather (S, n, B); break; }
+      t2 = ustime();
+      if (which == 4) err = memcmp (Y, Y1, n * sizeof(float)) ? 1 : 0; // must be exact
+      else err = rel_err (x, x1);
+      if (err > tol) ++bad;
+      printf ("%-8s %-8s %12.1f %9.1fx %8.1g %s\n", name[which], k->name, 1000. * (t2-t1) / R,
+	      (t2-t1) ? (double)(t1-t0) / (t2-t1) : 0, err, (err > tol) ? "FAIL" : "");
+    }
+  }
+  free (A); free (B); free (Y); free (Y1); free (IA); free (IB); free (S);
+  printf ("%s: %d kernels outside tolerance %g, dispatch picks %s\n",
+	  bad ? "FAIL" : "PASS", bad, tol, simd_level (NULL));
+  return bad ? 1 : 0;
+}
+
+int usage () {
+  fprintf (stderr,
+	   "usage: simd -bench [N] [R] [tol] ... N floats, R repeats, max relative error\n"
+	   "       simd -level             ... kernel set picked for this CPU\n");
+  return 1;
+}
+
+int main (int argc, char *argv[]) {
+  if (!strcmp(a(1),"-level")) return !printf ("%s\n", simd_level (NULL));
+  if (!strcmp(a(1),"-bench")) return bench (arg(2) ? atoi(a(2)) : 1000, arg(3) ? atoi(a(3)) : 10000, arg(4) ? atof(a(4)) : 1e-9);
+  return usage();
+}
+
+#endif
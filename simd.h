@@ -0,0 +1,43 @@
+/*
+
+  Copyright (c) 1997-2025 Victor Lavrenko (v.lavrenko@gmail.com)
+
+  This file is part of YARI.
+
+  YARI is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  YARI is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+  or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+  License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YARI. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "types.h"
+
+#ifndef SIMD
+#define SIMD
+
+// Dense float kernels: AVX-512, AVX2 or scalar, picked on first use from
+// CPUID. Products are rounded to float (squared differences: double) and
+// summed in double, as in the scalar loops they replace, so only the order
+// of summation differs. p must be 1 or 2.
+// "Dense" ix_t vectors have ids 1..n, only the .x fields are used.
+
+double simd_dot     (float *A, float *B, uint n) ;         // sum A[i] * B[i]
+double simd_sum     (float *A, uint n, float p) ;           // sum A[i]^p
+double simd_dist    (float *A, float *B, uint n, float p) ; // sum |A[i]-B[i]|^p
+void   simd_axpy    (float a, float *X, float *Y, uint n) ; // Y[i] += a * X[i]
+double simd_dot_ix  (ix_t *A, ix_t *B, uint n) ;            // sum A[i].x * B[i].x
+double simd_dist_ix (ix_t *A, ix_t *B, uint n, float p) ;   // sum |A[i].x-B[i].x|^p
+double simd_gather  (ix_t *V, uint n, float *F) ;           // sum V[i].x * F[V[i].i]
+
+char *simd_level (char *want) ; // force "scalar", "avx2", "avx512"; NULL: best
+
+#endif
@@ -23,6 +23,7 @@
 #include "matrix.h"
 #include "textutil.h"
 #include "timeutil.h"
+#include "spell.h"
 
 void dump_levenstein_cost (uint **C, char *A, char *B) {
   uint nA = strlen(A), nB = strlen(B), a, b;
@@ -262,7 +263,137 @@ uint try_fuse (char *w1, char *w2, hash_t *known) {
   return i12;
 }
 
-uint pubmed_spell (char *word, hash_t *H, float *F, char *prm, uint W, uint *id2) {
+//////////////////////////////////////////////////////////////////////////////// symmetric delete
+
+// all strings made from w[0..n) by k more deletions at positions >= p
+// (each set of positions once), appended to *out
+static void deletes (char *w, uint n, uint p, uint k, char ***out) {
+  char *d = malloc (n); uint i;
+  for (i = p; i < n && k; ++i) {
+    memcpy (d, w, i); memcpy (d+i, w+i+1, n-i); // d = w without w[i], 0-terminated
+    char *copy = strdup (d);
+    *out = append_vec (*out, &copy);
+    deletes (d, n-1, i, k-1, out);
+  }
+  free (d);
+}
+
+void build_symdel (char *path, hash_t *H, uint edits) {
+  char x[9999]; uint w, nw = nkeys(H), k;
+  mkdir (path, S_IRWXU | S_IRWXG | S_IRWXO);
+  hash_t *DEL = open_hash (fmt (x,"%s/DEL",path), "w");
+  jix_t *J = new_vec (0, sizeof(jix_t));
+  for (w = 1; w <= nw; ++w) {
+    char *word = id2key (H,w), **D = new_vec (1, sizeof(char*));
+    D[0] = strdup (word); // 0 deletions: the word itself
+    deletes (word, strlen(word), 0, edits, &D);
+    for (k = 0; k < len(D); ++k) {
+      jix_t new = {key2id (DEL, D[k]), w, 1};
+      J = append_vec (J, &new);
+      free (D[k]);
+    }
+    free_vec (D);
+    if (0 == w%1000) show_progress (w, nw, " words");
+  }
+  sort_vec (J, cmp_jix);
+  uniq_jix (J); // repeated letters give the same deletion twice
+  coll_t *DxW = open_coll (fmt (x,"%s/DxW",path), "w+");
+  append_jix (DxW, J);
+  uint *E = new_vec (1, sizeof(uint)); E[0] = edits;
+  write_vec (E, fmt (x,"%s/edits",path));
+  fprintf (stderr, "[%.0fs] %s: %d words -> %d deletions, %d postings, %d edits\n",
+	   vtime(), path, nw, nkeys(DEL), len(J), edits);
+  free_vec (E); free_vec (J); free_coll (DxW); free_hash (DEL);
+}
+
+symdel_t *open_symdel (char *path, hash_t *H) {
+  char x[9999];
+  symdel_t *S = safe_calloc (sizeof(symdel_t));
+  uint *E = read_vec (fmt (x,"%s/edits",path));
+  S->edits = E[0]; free_vec (E);
+  S->DEL = open_hash (fmt (x,"%s/DEL",path), "r");
+  S->DxW = open_coll (fmt (x,"%s/DxW",path), "rs"); // rows are borrowed
+  S->WORD = H;
+  return S;
+}
+
+void free_symdel (symdel_t *S) {
+  if (!S) return;
+  free_hash (S->DEL); free_coll (S->DxW); free (S);
+}
+
+// optimal string alignment distance A -> B, max+1 as soon as it must be
+// more than max; inserts and substitutions only of a-z, as in best_edit
+#define az(c) ((c) >= 'a' && (c) <= 'z')
+static uint osa_distance (char *A, char *B, uint max) {
+  uint nA = strlen(A), nB = strlen(B), a, b, far = max+1, lo1 = 0;
+  if (nA > nB + max || nB > nA + max) return far;
+  uint R[3][nB+1], *r2, *r1, *r0; // rows a-2, a-1, a
+  for (R[0][0] = 0, b = 1; b <= nB; ++b) R[0][b] = az(B[b-1]) ? MIN (R[0][b-1] + 1, far) : far;
+  for (a = 1; a <= nA; ++a) {
+    r0 = R[a%3]; r1 = R[(a+2)%3]; r2 = R[(a+1)%3];
+    uint lo = r0[0] = MIN (a, far);
+    for (b = 1; b <= nB; ++b) {
+      uint ok = az(B[b-1]), fit = (A[a-1] == B[b-1]);
+      uint del = r1[b] + 1, ins = ok ? r0[b-1] + 1 : far;
+      uint sub = r1[b-1] + (fit ? 0 : ok ? 1 : far);
+      uint txp = (a > 1 && b > 1 && A[a-2] == B[b-1] && A[a-1] == B[b-2]) ? r2[b-2] + 1 : far;
+      r0[b] = MIN (far, MIN (MIN (del,ins), MIN (sub,txp)));
+      lo = MIN (lo, r0[b]);
+    }
+    if (lo > max && lo1 > max) return far; // transpositions skip one row, not two
+    lo1 = lo;
+  }
+  return R[nA%3][nB];
+}
+
+// cand is k edits from word as in best_edit (edits of edits): OSA distance
+// misses an edit of a transposed pair, e.g. aer -> ar -> ra, so 1 more
+// than k is rechecked through the 1-edits of word
+static int within_edits (char *word, char *cand, uint k) {
+  uint d = osa_distance (word, cand, k+1), n = strlen(word), pos;
+  if (d <= k || d > k+1 || k < 2) return d <= k;
+  char *edit = calloc(n+3, 1), *op, *sub; int ok = 0;
+  for (op = "-^=+"; *op && !ok; ++op)
+    for (sub = (*op=='-' || *op=='^') ? "a" : "abcdefghijklmnopqrstuvwxyz"; *sub && !ok; ++sub)
+      for (pos = 0; pos <= n && !ok; ++pos) {
+	memcpy(edit,word,n+1);
+	ok = do_edit (edit,n,pos,*op,*sub) && within_edits (edit, cand, k-1);
+      }
+  free(edit);
+  return ok;
+}
+
+// same as best_edit (nedits <= S->edits): known words within nedits edits
+// share a deletion with word, so only those are looked at
+int symdel_best_edit (symdel_t *S, char *word, uint nedits, float *score, uint *best) {
+  if (nedits > S->edits) return best_edit (word, nedits, S->WORD, score, best);
+  char **D = new_vec (1, sizeof(char*)); uint k;
+  D[0] = strdup (word);
+  deletes (word, strlen(word), 0, nedits, &D);
+  ix_t *C = new_vec (0, sizeof(ix_t)), *c;
+  for (k = 0; k < len(D); ++k) {
+    uint d = has_key (S->DEL, D[k]);
+    ix_t *W = d ? borrow_vec (S->DxW, d) : NULL;
+    if (W) C = append_many (C, W, len(W));
+    release_vec (W); free (D[k]);
+  }
+  sort_vec (C, cmp_ix_i);
+  dedup_vec (C);
+  for (c = C; c < C + len(C); ++c) c->x = score[c->i];
+  sort_vec (C, cmp_ix_X); // highest score first: 1st within nedits wins
+  for (c = C; c < C + len(C) && c->x > score[*best]; ++c)
+    if (within_edits (word, id2key (S->WORD, c->i), nedits)) { *best = c->i; break; }
+  free_vec (C); free_vec (D);
+  return 0;
+}
+
+// best_edit through the index if there is one
+static int spell_edit (symdel_t *S, char *word, uint nedits, hash_t *H, float *score, uint *best) {
+  return S ? symdel_best_edit (S, word, nedits, score, best) : best_edit (word, nedits, H, score, best);
+}
+
+uint pubmed_spell (char *word, hash_t *H, float *F, char *prm, uint W, uint *id2, symdel_t *S) {
   char V = prm && strstr(prm,"verbose") ? 1 : 0; // getprm(NULL) is fast
   //L1=4,L2=9,F0=1000,F1=10,F2=10000,F3=10000,F11=10000,x1=100,x10=10000,x11=10000,x20=10000,x21=10000,x30=10000,x31=10000,x32=10000
   uint L1  = getprm(prm,"L1=",5);      // do not correct if len(w) < L1
@@ -290,12 +421,12 @@ uint pubmed_spell (char *word, hash_t *H, float *F, char *prm, uint W, uint *id2
 
   if ((l0 >= L1) || !w0) { // if word long enough, or zero matches: try 1-edit
 
-    best_edit (word, 1, H, F, &w1); // w1 = 1-edit(w0)
+    spell_edit (S, word, 1, H, F, &w1); // w1 = 1-edit(w0)
     ok = (F[w1] > x1*F[w0] && F[w1] >= F1);
     if (V) printf ("%d %d\t1edit: %s:%.0f -> %s:%.0f\n", w1==W, ok, word, F[w0], id2key(H,w1), F[w1]);
     if (ok) { id=id?id:w1; if (!V) return id; }
 
-    if (w1) best_edit (id2key(H,w1), 1, H, F, &w11);
+    if (w1) spell_edit (S, id2key(H,w1), 1, H, F, &w11);
     ok = (F[w11] > x11*F[w1] && F[w11] > x10*F[w0] && F[w11] > F11);
     if (V) printf ("%d %d\t1-1ed: %s:%.0f -> %s:%.0f\n", w11==W, ok, word, F[w0], id2key(H,w11), F[w11]);
     if (ok) { id=id?id:w11; if (!V) return id; }
@@ -303,12 +434,12 @@ uint pubmed_spell (char *word, hash_t *H, float *F, char *prm, uint W, uint *id2
 
   if ((l0 >= L1 && l0 >= L2 && l0 <= 20) || (!id && !w0 && l0 <= 20)) {
 
-    best_edit (word, 2, H, F, &w2); // w2 = 2-edit(w0)
+    spell_edit (S, word, 2, H, F, &w2); // w2 = 2-edit(w0)
     ok = (F[w2] > x21*F[w1] && F[w2] > x20*F[w0] && F[w2] > F2);
     if (V) printf ("%d %d\t2edit: %s:%.0f -> %s:%.0f\n", w2==W, ok, word, F[w0], id2key(H,w2), F[w2]);
     if (ok) { id=id?id:w2; if (!V) return id; }
 
-    if (w2) best_edit (id2key(H,w2), 1, H, F, &w21);
+    if (w2) spell_edit (S, id2key(H,w2), 1, H, F, &w21);
     ok = (F[w21] > x32*F[w2] && F[w21] > x31*F[w1] && F[w21] > x30*F[w0] && F[w21] > F3);
     if (V) printf ("%d %d\t2-1ed: %s:%.0f -> %s:%.0f\n", w21==W, ok, word, F[w0], id2key(H,w21), F[w21]);
     if (ok) { id=id?id:w21; if (!V) return id; }
@@ -322,7 +453,7 @@ uint pubmed_spell (char *word, hash_t *H, float *F, char *prm, uint W, uint *id2
 
   (void) w3;
   //  if (!id && !w0) { // no matches
-  //    best_edit (word, 3, H, F, &w3); // w3 = 3-edit(w0)
+  //    spell_edit (S, word, 3, H, F, &w3); // w3 = 3-edit(w0)
   //    ok = (F[w3] > 0);
   //    if (V) printf ("%d %d\t3edit: %s:%.0f -> %s:%.0f\n", w3==W, ok, word, F[w0], id2key(H,w3), F[w3]);
   //    if (ok) { id=id?id:w3; if (!V) return id; }
@@ -331,16 +462,16 @@ uint pubmed_spell (char *word, hash_t *H, float *F, char *prm, uint W, uint *id2
   return id ? id : w0;
 }
 
-uint pickmax_spell (char *word, hash_t *H, float *F, char *_, uint W) {
+uint pickmax_spell (char *word, hash_t *H, float *F, char *_, uint W, symdel_t *S) {
   char V = !strstr(_,"quiet") && !strstr(_,"silent") ? 1 : 0; // verbose?
   float x1  = getprm(_,"x1=",1), x11 = getprm(_,"x11=",1);
   float x2  = getprm(_,"x2=",1), x21 = getprm(_,"x21=",1);
 
   uint w0 = has_key (H, word), w1=0, w2=0, w11=0, w21=0, id = w0;
-  best_edit (word, 1, H, F, &w1);                   // w1  = 1-edit(w0)
-  if (w1) best_edit (id2key(H,w1), 1, H, F, &w11);  // w11 = 1-edit(w1)
-  best_edit (word, 2, H, F, &w2);                   // w2  = 2-edit(w0)
-  if (w2) best_edit (id2key(H,w2), 1, H, F, &w21);  // w21 = 1-edit(w2)
+  spell_edit (S, word, 1, H, F, &w1);                  // w1  = 1-edit(w0)
+  if (w1) spell_edit (S, id2key(H,w1), 1, H, F, &w11); // w11 = 1-edit(w1)
+  spell_edit (S, word, 2, H, F, &w2);                  // w2  = 2-edit(w0)
+  if (w2) spell_edit (S, id2key(H,w2), 1, H, F, &w21); // w21 = 1-edit(w2)
   float f0 = F[w0], f1 = F[w1]/x1, f11 = F[w11]/x11, f2 = F[w2]/x2, f21 = F[w21]/x21, best = f0;
   if (f1 > best)  { best = f1; id = w1; }
   if (f2 > best)  { best = f2; id = w2; }
@@ -447,13 +578,16 @@ int do_pubmed (char *word, char *_H, char *_F, char *prm) {
   char *pickmax = strstr(prm,"pickmax");
   hash_t *H = open_hash (_H,"r");
   float *F = mtx_full_row (_F, 1);
+  char *idx = getprms (prm,"symdel=",NULL,",");
+  symdel_t *S = idx ? open_symdel (idx, H) : NULL;
   uint i0 = has_key(H,word), id, id2 = 0;
-  if (pickmax) id = pickmax_spell (word, H, F, prm, nkeys(H)+2);
-  else         id =  pubmed_spell (word, H, F, prm, nkeys(H)+2, &id2);
+  if (pickmax) id = pickmax_spell (word, H, F, prm, nkeys(H)+2, S);
+  else         id =  pubmed_spell (word, H, F, prm, nkeys(H)+2, &id2, S);
   printf("%s:%.0f -> %s:%.0f", word, F[i0], id2key(H,id), F[id]);
   if (id2) printf(" + %s:%.0f", id2key(H,id2), F[id2]);
   puts("");
   free_vec(F);
+  free_symdel(S); free(idx);
   free_hash(H);
   return 0;
 }
@@ -463,6 +597,8 @@ int do_eval_spell (char *_H, char *_F, char *prm) {
   char V = !strstr(prm,"silent");
   hash_t *H = open_hash (_H,"r");
   float *F = mtx_full_row (_F, 1);
+  char *idx = getprms (prm,"symdel=",NULL,",");
+  symdel_t *S = idx ? open_symdel (idx, H) : NULL;
   char trg[1000], *src=0, *eol=0;
   double t0 = ftime(), n = 0, oks = 0;
   while (fgets (trg, 999, stdin)) {
@@ -470,8 +606,8 @@ int do_eval_spell (char *_H, char *_F, char *prm) {
     if ((src = index(trg,'\t'))) *src++ = 0;
     uint it = has_key(H,trg), is = has_key(H,src), id = 0, ok = 0;
     if (it) {
-      if (pickmax) id = pickmax_spell (src, H, F, prm, it);
-      else         id =  pubmed_spell (src, H, F, prm, it, 0);
+      if (pickmax) id = pickmax_spell (src, H, F, prm, it, S);
+      else         id =  pubmed_spell (src, H, F, prm, it, 0, S);
       ok = (id == it);
       if (V) printf("EVAL %d %s:%.0f -> %s:%.0f %s:%.0f\n",
 		    ok, src, F[is], id2key(H,id), F[id], trg, F[it]);
@@ -481,6 +617,43 @@ int do_eval_spell (char *_H, char *_F, char *prm) {
   double lag = (ftime()-t0), acc = oks/n;
   printf ("%.4f %.2fs %s\n", acc, lag, prm);
   free_vec(F);
+  free_symdel(S); free(idx);
+  free_hash(H);
+  return 0;
+}
+
+int do_symdel (char *_H, char *path, uint edits) {
+  hash_t *H = open_hash (_H,"r");
+  build_symdel (path, H, edits ? edits : 2);
+  free_hash(H);
+  return 0;
+}
+
+// best_edit vs symdel_best_edit on every misspelling in pairs.tsv
+int do_bench_symdel (char *_H, char *_F, char *path) {
+  hash_t *H = open_hash (_H,"r");
+  float *F = mtx_full_row (_F, 1);
+  symdel_t *S = open_symdel (path, H);
+  char trg[1000], *src=0, *eol=0; uint k, n = 0, same[3] = {0,0,0};
+  double t[3][2] = {{0,0},{0,0},{0,0}};
+  while (fgets (trg, 999, stdin)) {
+    if ((eol = index(trg,'\n'))) *eol = 0;
+    if (!(src = index(trg,'\t'))) continue;
+    *src++ = 0; ++n;
+    for (k = 1; k <= 2 && k <= S->edits; ++k) {
+      uint b0 = 0, b1 = 0; double t0 = ftime();
+      best_edit (src, k, H, F, &b0);
+      double t1 = ftime();
+      symdel_best_edit (S, src, k, F, &b1);
+      t[k][0] += t1 - t0; t[k][1] += ftime() - t1;
+      same[k] += (F[b0] == F[b1]); // ties may pick either
+    }
+  }
+  for (k = 1; k <= 2 && k <= S->edits; ++k)
+    printf ("%d-edit: %d words, recursive %.2fs, symdel %.3fs, same best %d\n",
+	    k, n, t[k][0], t[k][1], same[k]);
+  free_vec(F);
+  free_symdel(S);
   free_hash(H);
   return 0;
 }
@@ -602,8 +775,10 @@ char *usage =
   "usage: spell -edits remdesivir 1 WORD WORD_CF\n"
   "       spell -fuse  amino acid WORD WORD_CF\n"
   "       spell -split coronavirus WORD WORD_CF\n"
-  "       spell -pub   coronavirus WORD WORD_CF [verbose]\n"
-  "       spell -eval  WORD WORD_CF [quiet] < pairs.tsv\n"
+  "       spell -pub   coronavirus WORD WORD_CF [verbose,symdel=SPELL]\n"
+  "       spell -eval  WORD WORD_CF [quiet,symdel=SPELL] < pairs.tsv\n"
+  "       spell -index WORD SPELL [2]    - symmetric-delete index, 2 edits\n"
+  "       spell -bench WORD WORD_CF SPELL < pairs.tsv   - index vs. best_edit\n"
   "       spell -dist  word word\n"
   "       spell -ops  'b a n a' 'b n a'\n"
   "       spell -pairs XML1 IDS1 XML2 IDS2 < stdin: id1 id2\n"
@@ -617,6 +792,8 @@ int main (int argc, char *A[]) {
   if (!strncmp(a(1),"-edits",6)) return do_edits (a(2), atoi(a(3)), a(4), a(5));
   if (!strncmp(a(1),"-pub",4))   return do_pubmed (a(2), a(3), a(4), a(5));
   if (!strncmp(a(1),"-eval",5))  return do_eval_spell (a(2), a(3), a(4));
+  if (!strncmp(a(1),"-index",6)) return do_symdel (a(2), a(3), atoi(a(4)));
+  if (!strncmp(a(1),"-bench",6)) return do_bench_symdel (a(2), a(3), a(4));
   if (!strncmp(a(1),"-dist",5))  return do_levenstein (a(2), a(3));
   if (!strncmp(a(1),"-ops",4))   return do_levenstein_ops (a(2), a(3));
   if (!strncmp(a(1),"-pairs",6)) return do_xml_pairs (a(2), a(3), a(4), a(5), a(1));
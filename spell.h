@@ -19,6 +19,9 @@
 
 */
 
+#include "hash.h"
+#include "coll.h"
+
 #ifndef SPELLING
 #define SPELLING
 
@@ -40,7 +43,26 @@ void try_runon (char *word, hash_t *known, float *score, uint *i, uint *j) ;
 // amino acid -> aminoacid
 uint try_fuse (char *w1, char *w2, hash_t *known) ;
 
-uint pubmed_spell (char *word, hash_t *H, float *F, char *prm, uint W, uint *id2) ;
+// Symmetric-delete index (SymSpell): every string made from a known word by
+// up to 'edits' deletions -> ids of the words it came from. Words within k
+// edits of each other share a deletion of at most k letters each, so the
+// candidates are a few dozen probes away, and then edit distance decides.
+typedef struct {
+  hash_t *DEL;  // deletions
+  coll_t *DxW;  // DxW [deletion] = known words that have it
+  hash_t *WORD; // known words, not owned
+  uint  edits;  // most deletions indexed
+} symdel_t;
+
+void build_symdel (char *path, hash_t *H, uint edits) ; // path/{DEL,DxW,edits}
+symdel_t *open_symdel (char *path, hash_t *H) ;
+void free_symdel (symdel_t *S) ;
+
+// same as best_edit, through the index (falls back if nedits > S->edits)
+int symdel_best_edit (symdel_t *S, char *word, uint nedits, float *score, uint *best) ;
+
+// S: symdel index for H or NULL (recursive best_edit)
+uint pubmed_spell (char *word, hash_t *H, float *F, char *prm, uint W, uint *id2, symdel_t *S) ;
 
 uint levenstein_distance (char *A, char *B, char *explain) ;
 
@@ -156,8 +156,8 @@ void pmap (uint nt, void *(*fn)(void *), void **in, void **out, uint n) {
 
 // ---------- tqdm-style progress bar ----------
 
-void tqdm (uint done, uint total, char *msg) { // thread-unsafe: static
-  static time_t t0 = 0;
+void tqdm (uint done, uint total, char *msg) {
+  static __thread time_t t0 = 0; // one bar per thread
   if (!t0 || !done) t0 = time(0);
   double elapsed = difftime (time(0), t0);
   if (elapsed < 0.2 && done < total) return; // throttle to 5 Hz
@@ -228,9 +228,10 @@ void *pool_worker (void *arg) {
     void *item = synq_pop (p->in);
     if (!item) { sched_yield(); continue; }
     void *result = p->fn (item);
-    while (!synq_push (p->out, result))
-      sched_yield();
+    while (!synq_push (p->out, result) && !atomic_load (&p->stop))
+      sched_yield(); // stopped with a full queue: result is dropped
   }
+  atomic_fetch_sub (&p->live, 1);
   return NULL;
 }
 
@@ -240,13 +241,15 @@ pool_t *new_pool (uint nt, synq_t *in, synq_t *out, void *(*fn)(void *)) {
   p->out = out;
   p->fn  = fn;
   atomic_init (&p->stop, 0);
+  atomic_init (&p->live, nt);
   for (uint i = 0; i < nt; ++i)
     detach (pool_worker, p);
   return p;
 }
 
-void stop_pool (pool_t *p) {
+void stop_pool (pool_t *p) { // waits for the workers: they still read p
   atomic_store (&p->stop, 1);
+  while (atomic_load (&p->live)) sched_yield();
   free (p);
 }
 
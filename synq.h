@@ -65,6 +65,7 @@ typedef struct {
   synq_t *out;
   void *(*fn)(void *);
   _Atomic int stop;
+  _Atomic uint live; // workers still running
 } pool_t;
 
 pool_t *new_pool  (uint nt, synq_t *in, synq_t *out, void *(*fn)(void *)) ;
@@ -388,11 +388,86 @@ void test_pool_pipeline () {
   synq_free (out);
 }
 
+// ==================== accumulator tests =========================
+
+#include "matrix.h"
+
+#define ACCUM_ROWS 2000
+#define ACCUM_COLS 2000
+
+// one product row: touch ids in random order, accum2vec must return them sorted
+int accum_row (uint task, void *arg) {
+  atomic_uint *bad = arg;
+  uint seed = task, k, n = task % 100 + 1; // sparse rows: list path
+  accum_t *A = thread_accum (ACCUM_COLS);
+  for (k = 0; k < n; ++k) *accum_at (A, 1 + rand_r (&seed) % ACCUM_COLS) += 1;
+  ix_t *V = accum2vec (A, 0);
+  if (!vec_is_sorted (V)) atomic_fetch_add (bad, 1);
+  free_vec (V);
+  return 0;
+}
+
+void test_accum_sorted () {
+  atomic_uint bad;
+  atomic_init (&bad, 0);
+  int err = parallel (4, ACCUM_ROWS, accum_row, &bad, NULL);
+  fprintf (stderr, "accumulator test: %d of %d rows unsorted, err=%d %s\n",
+           atomic_load (&bad), ACCUM_ROWS, err, (!atomic_load (&bad) && !err) ? PASS : FAIL);
+  assert (!atomic_load (&bad) && !err);
+}
+
+// ==================== k-means tests =============================
+
+#include "cluster.h"
+
+#define KM_DOCS 300
+#define KM_TOPICS 3
+
+// docs d use words of topic d % 3 only: every topic must end up in a
+// cluster of its own, whatever the thread count
+void test_kmeans_dense () {
+  uint d, w, t, nt, topic;
+  srandom (1);
+  coll_t *DxW = open_coll_inmem ();
+  for (d = 1; d <= KM_DOCS; ++d) {
+    ix_t *doc = new_vec (0, sizeof(ix_t));
+    for (w = 1; w <= 10; ++w) {
+      ix_t v = {10 * (d % KM_TOPICS) + w, 1 + random() % 5};
+      if (w == 1 || random() % 2) doc = append_vec (doc, &v);
+    }
+    put_vec (DxW, d, doc);
+    free_vec (doc);
+  }
+  DxW->rdim = KM_DOCS; DxW->cdim = 10 * KM_TOPICS;
+  for (nt = 1; nt <= 4; nt += 3) {
+    char prm[99];
+    sprintf (prm, "k=%d,pp,iter=5,threads=%d", KM_TOPICS, nt);
+    coll_t *KxD = open_coll_inmem ();
+    k_means_dense (DxW, KxD, NULL, prm);
+    uint of [KM_TOPICS+1] = {0}, bad = 0, seen = 0; // cluster of each topic
+    for (t = 1; t <= KM_TOPICS; ++t) {
+      ix_t *docs = get_vec (KxD, t), *v;
+      for (v = docs; v < docs + len(docs); ++v, ++seen) {
+	topic = v->i % KM_TOPICS;
+	if (!of[topic]) of[topic] = t;
+	else if (of[topic] != t) ++bad;
+      }
+      free_vec (docs);
+    }
+    for (t = 0; t < KM_TOPICS; ++t) for (w = 0; w < t; ++w) if (of[t] == of[w]) ++bad;
+    fprintf (stderr, "k-means test, %d threads: %d docs, %d misplaced %s\n",
+	     nt, seen, bad, (!bad && seen == KM_DOCS) ? PASS : FAIL);
+    assert (!bad && seen == KM_DOCS);
+    free_coll (KxD);
+  }
+  free_coll (DxW);
+}
+
 // ==================== main ======================================
 
 int main (int argc, char *argv[]) {
   if (argc < 2) {
-    fprintf (stderr, "usage: test_synq -test-lock | -test-synq | -test-pmap | -test-parallel | -test-pool | -test-all\n");
+    fprintf (stderr, "usage: test_synq -test-lock | -test-synq | -test-pmap | -test-parallel | -test-pool | -test-accum | -test-kmeans | -test-all\n");
     return 1;
   }
   if (!strcmp (argv[1], "-test-lock") || !strcmp (argv[1], "-test-all"))
@@ -415,5 +490,9 @@ int main (int argc, char *argv[]) {
     test_pool();
     test_pool_pipeline();
   }
+  if (!strcmp (argv[1], "-test-accum") || !strcmp (argv[1], "-test-all"))
+    test_accum_sorted();
+  if (!strcmp (argv[1], "-test-kmeans") || !strcmp (argv[1], "-test-all"))
+    test_kmeans_dense();
   return 0;
 }
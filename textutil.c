@@ -21,15 +21,19 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <fcntl.h> // AT_FDCWD
 #include <math.h>
 #include "hash.h"
 #include "textutil.h"
 #include "mmap.h"
 #include "hl.h"
+#include "synq.h"
 #include "matrix.h"
 #include "timeutil.h"
 #include "query.h"
@@ -583,9 +587,115 @@ void lowercase_stemmer (char *word, char *stem) {
   for (s = stem; *s; ++s) *s = tolower ((int) *s);
 }
 
+// ------------------------- stem cache -------------------------
+// per-thread direct-mapped: type + surface form -> stem, misses go to the
+// forms preloaded by stem_cache_load, then to the stemmer. Once a cache is
+// loaded, freshly stemmed forms are also kept for stem_cache_save.
+
+#define STEM_SLOTS 4096 // per thread
+#define STEM_KEY 32     // type + form (or stem) + '\0', longer are not cached
+
+typedef struct { char key [STEM_KEY], stem [STEM_KEY]; } stem_slot_t;
+typedef struct { stem_slot_t slot [STEM_SLOTS]; _Atomic ulong hits, misses; } stem_cache_t;
+
+static volatile int stem_lk = 0; // guards everything below
+static stem_cache_t **stem_caches = NULL; // live threads
+static ulong stem_hits = 0, stem_misses = 0; // threads that exited
+static hash_t *FORM = NULL; static coll_t *STEM = NULL; // preloaded, read-only
+static hash_t *NEWF = NULL; static char **NEWS = NULL; // stemmed since load
+
+static void stem_cache_exit (stem_cache_t *C) {
+  lock (&stem_lk);
+  stem_hits += C->hits; stem_misses += C->misses;
+  stem_cache_t **c = stem_caches-1, **end = stem_caches + len(stem_caches);
+  while (++c < end) if (*c == C) { *c = end[-1]; --len(stem_caches); break; }
+  unlock (&stem_lk);
+  free (C);
+}
+
+static pthread_key_t STEM_TLS;
+static pthread_once_t STEM_ONCE = PTHREAD_ONCE_INIT;
+static void stem_key_init () { pthread_key_create (&STEM_TLS, (void (*)(void*)) stem_cache_exit); }
+
+static stem_cache_t *thread_stem_cache () {
+  pthread_once (&STEM_ONCE, stem_key_init);
+  stem_cache_t *C = pthread_getspecific (STEM_TLS);
+  if (!C) {
+    pthread_setspecific (STEM_TLS, (C = safe_calloc (sizeof (stem_cache_t))));
+    lock (&stem_lk);
+    stem_caches = append_vec (stem_caches ? stem_caches : new_vec (0, sizeof(void*)), &C);
+    unlock (&stem_lk);
+  }
+  return C;
+}
+
+// stemmer (word, stem) through the cache, same result
+static void stem_cached (char *word, char *stem, char type, void (*stemmer) (char*, char*)) {
+  uint n = strlen (word) + 1;
+  if (n + 1 > STEM_KEY) return stemmer (word, stem);
+  char key [STEM_KEY]; key[0] = type; memcpy (key+1, word, n); // stemmer may lowercase word
+  stem_cache_t *C = thread_stem_cache ();
+  stem_slot_t *s = C->slot + murmur3 (key, n) % STEM_SLOTS;
+  if (!strcmp (s->key, key)) {
+    atomic_fetch_add_explicit (&C->hits, 1, memory_order_relaxed);
+    strcpy (stem, s->stem); return;
+  }
+  uint id = FORM ? has_key (FORM, key) : 0;
+  char *old = id ? get_chunk (STEM, id) : NULL;
+  if (old) strcpy (stem, old);
+  else stemmer (word, stem);
+  atomic_fetch_add_explicit (old ? &C->hits : &C->misses, 1, memory_order_relaxed);
+  if (!old && NEWF) { // remember for stem_cache_save
+    lock (&stem_lk);
+    if (!has_key (NEWF, key)) { char *dup = strdup (stem); key2id (NEWF, key); NEWS = append_vec (NEWS, &dup); }
+    unlock (&stem_lk);
+  }
+  if (strlen (stem) < STEM_KEY) { strcpy (s->key, key); strcpy (s->stem, stem); }
+}
+
+void stem_cache_stats (ulong *hits, ulong *misses) {
+  lock (&stem_lk);
+  stem_cache_t **c = stem_caches-1, **end = stem_caches + (stem_caches ? len(stem_caches) : 0);
+  *hits = stem_hits; *misses = stem_misses;
+  while (++c < end) { *hits += (*c)->hits; *misses += (*c)->misses; }
+  unlock (&stem_lk);
+}
+
+void stem_cache_load (char *path) {
+  char x[9999];
+  NEWF = open_hash_inmem (); NEWS = new_vec (0, sizeof(char*));
+  if (!coll_exists (fmt (x,"%s/STEM",path))) return;
+  FORM = open_hash (fmt (x,"%s/FORM",path), "rs"); // probed by all threads
+  STEM = open_coll (fmt (x,"%s/STEM",path), "rs");
+}
+
+void stem_cache_save (char *path) { // preloaded + stemmed since -> path/FORM, path/STEM
+  char x[9999], tmp[9999]; uint i, nf = FORM ? nkeys (FORM) : 0, nn = NEWF ? nkeys (NEWF) : 0;
+  if (!nn) return; // nothing new
+  rm_dir (fmt (tmp,"%s.new",path)); // left over from an interrupted save
+  mkdir (tmp, S_IRWXU | S_IRWXG | S_IRWXO);
+  hash_t *F = open_hash (fmt (x,"%s/FORM",tmp), "w");
+  coll_t *S = open_coll (fmt (x,"%s/STEM",tmp), "w+");
+  for (i = 1; i <= nf; ++i) { // keeps the old ids
+    char *stem = get_chunk (STEM, i);
+    if (stem) put_chunk (S, key2id (F, id2key (FORM, i)), stem, strlen(stem)+1);
+  }
+  for (i = 1; i <= nn; ++i)
+    put_chunk (S, key2id (F, id2key (NEWF, i)), NEWS[i-1], strlen(NEWS[i-1])+1);
+  fprintf (stderr, "[%.0fs] stem cache: %d forms -> %s\n", vtime(), nkeys(F), path);
+  free_hash (F); free_coll (S);
+  if (FORM) { free_hash (FORM); free_coll (STEM); FORM = NULL; STEM = NULL; }
+  for (i = 0; i < nn; ++i) free (NEWS[i]);
+  free_hash (NEWF); free_vec (NEWS); NEWF = NULL; NEWS = NULL;
+  // swap the whole directory in one step: a reader sees the old cache or the new one
+  if (!file_exists ("%s", path)) { if (rename (tmp, path)) perror (path); return; }
+  if (renameat2 (AT_FDCWD, tmp, AT_FDCWD, path, RENAME_EXCHANGE)) { perror (path); return; }
+  rm_dir (tmp); // now holds the old cache
+}
+
 void stem_word (char *word, char *stem, char *type) {
   switch (*type) {
-  case 'K': kstem_stemmer (word, stem); break;
+  case 'K': stem_cached (word, stem, 'K', kstem_stemmer); break; // L: cheaper than a lookup
   case 'L': lowercase_stemmer (word,stem); break;
   default: strncpy(stem,word,999);
   }
@@ -608,9 +718,19 @@ hash_t *load_stoplist () {
   return H;
 }
 
-int stop_word (char *word) { // thread-unsafe: static
-  static hash_t *stops = NULL;
-  if (!stops) stops = load_stoplist();
+static hash_t *stoplist () { // loaded once, then read-only
+  static hash_t *_Atomic stops = NULL;
+  static int loading = 0;
+  if (!stops) {
+    lock (&loading);
+    if (!stops) stops = load_stoplist();
+    unlock (&loading);
+  }
+  return stops;
+}
+
+int stop_word (char *word) {
+  hash_t *stops = stoplist ();
   //if (has_key(stops,word)) printf ("%s is a stopword\n", word);
   //fprintf(stderr, "%s -> %d\n", word, has_key (stops, word));
   return has_key (stops, word);
@@ -626,6 +746,63 @@ char **str2toks (char *str, char *ws, uint maxlen) {
   return toks;
 }
 
+// per-thread bump arena: blocks chained, merged into one on reset
+typedef struct { char **blk; size_t used, size, total; } arena_t;
+
+static void free_arena (arena_t *A) {
+  char **b = A->blk-1, **end = A->blk+len(A->blk);
+  while (++b < end) free (*b);
+  free_vec (A->blk); free (A);
+}
+
+static pthread_key_t ARENA_KEY;
+static pthread_once_t ARENA_ONCE = PTHREAD_ONCE_INIT;
+static void arena_key_init () { pthread_key_create (&ARENA_KEY, (void (*)(void*)) free_arena); }
+
+static arena_t *thread_arena () {
+  pthread_once (&ARENA_ONCE, arena_key_init);
+  arena_t *A = pthread_getspecific (ARENA_KEY);
+  if (!A) {
+    A = safe_calloc (sizeof(arena_t));
+    A->blk = new_vec (0, sizeof(char*));
+    pthread_setspecific (ARENA_KEY, A);
+  }
+  return A;
+}
+
+void arena_reset () {
+  arena_t *A = thread_arena ();
+  if (len(A->blk) > 1) { // outgrew the block: one big enough for all of it
+    char **b = A->blk-1, **end = A->blk+len(A->blk), *big = malloc (A->total);
+    while (++b < end) free (*b);
+    len(A->blk) = 0; A->blk = append_vec (A->blk, &big);
+    A->size = A->total;
+  }
+  A->used = 0;
+}
+
+char *arena_strdup (char *s) {
+  arena_t *A = thread_arena ();
+  size_t n = strlen(s) + 1;
+  if (!len(A->blk) || A->used + n > A->size) {
+    size_t sz = MAX (n, 1<<16);
+    char *b = malloc (sz);
+    A->blk = append_vec (A->blk, &b);
+    A->used = 0; A->size = sz; A->total += sz;
+  }
+  char *t = A->blk[len(A->blk)-1] + A->used;
+  memcpy (t, s, n); A->used += n;
+  return t;
+}
+
+// same as str2toks, but the tokens point into str (next_token terminates them)
+char **str2toks_inplace (char *str, char *ws, uint maxlen) {
+  char *tok, **toks = new_vec (0, sizeof(char*));
+  while ((tok = next_token (&str, ws)))
+    if (strlen(tok) <= maxlen) toks = append_vec (toks, &tok);
+  return toks;
+}
+
 char *toks2str (char **toks) { // ' '.join(toks)
   char *buf=0; int sz=0, i=-1, n = len(toks);
   while (++i<n) if (toks[i]) zprintf (&buf,&sz, "%s ", toks[i]);
@@ -642,9 +819,8 @@ void stem_toks (char **toks, char *type) {
   }
 }
 
-void stop_toks (char **toks) { // thread-unsafe: static
-  static hash_t *stops = NULL;
-  if (!stops) stops = load_stoplist();
+void stop_toks (char **toks) {
+  hash_t *stops = stoplist ();
   char **v, **w, **end = toks+len(toks);
   for (v = w = toks; w < end; ++w)
     if (has_key (stops,*w)) free(*w);
@@ -652,6 +828,24 @@ void stop_toks (char **toks) { // thread-unsafe: static
   len(toks) = v - toks;
 }
 
+// stem over the token when the stem fits, else into the thread arena
+void stem_toks_inplace (char **toks, char *type) {
+  char stem[1000], **w, **end = toks+len(toks);
+  for (w = toks; w < end; ++w) {
+    stem_word (*w, stem, type);
+    size_t n = strlen (stem);
+    if (n <= strlen (*w)) memcpy (*w, stem, n+1);
+    else *w = arena_strdup (stem);
+  }
+}
+
+void stop_toks_inplace (char **toks) { // same as stop_toks, nothing to free
+  hash_t *stops = stoplist ();
+  char **v, **w, **end = toks+len(toks);
+  for (v = w = toks; w < end; ++w) if (!has_key (stops,*w)) *v++ = *w;
+  len(toks) = v - toks;
+}
+
 // drop tokens with length outside [lo,hi]
 void keep_midsize_toks (char **toks, uint lo, uint hi) {
   char **v, **w, **end = toks+len(toks);
@@ -696,31 +890,39 @@ char **vec2toks (ix_t *vec, hash_t *ids) {
 ix_t *toks2vec (char **toks, hash_t *ids) {
   char **w, **end = toks+len(toks);
   ix_t *vec = new_vec (0, sizeof(ix_t)), new = {0,1};
+  uint *I = ids ? key2id_batch (ids, toks, len(toks), NULL, 1) : NULL;
   for (w = toks; w < end; ++w) {
-    new.i = !(*w && **w) ? 0 : ids ? key2id(ids,*w) : (uint) atoi(*w);
+    new.i = !(*w && **w) ? 0 : I ? I[w-toks] : (uint) atoi(*w);
     if (new.i) vec = append_vec (vec, &new);
   }
+  if (I) free_vec (I);
   return vec;
 }
 
-char **toks2pairs (char **toks, char *prm) {
+static char **toks2pairs_dup (char **toks, char *prm, char *(*dup) (const char*)) {
   char **pairs = new_vec (0, sizeof(char*)), buf[1000];
   uint ow = getprm(prm,"ow=",0), uw = getprm(prm,"uw=",0);
   uint n = len(toks), k = ow ? MIN(n,ow) : uw ? MIN(n,uw) : n;
   char *a, *b, **v, **w, **end = toks+n;
   for (v = toks; v < end; ++v) {
-    char *single = strdup(*v);
+    char *single = dup ? dup(*v) : *v;
     pairs = append_vec (pairs, &single);
     for (w = v+1; w < v+k && w < end; ++w) {
       if (ow || strcmp(*v,*w) <= 0) { a = *v; b = *w; } // keep order: v_w
       else                          { a = *w; b = *v; } // swap order: w_v
-      char *pair = strdup (fmt(buf,"%s,%s",a,b));
+      fmt (buf,"%s,%s",a,b);
+      char *pair = dup ? dup (buf) : arena_strdup (buf);
       pairs = append_vec (pairs, &pair);
     }
   }
   return pairs;
 }
 
+char **toks2pairs (char **toks, char *prm) { return toks2pairs_dup (toks, prm, strdup); }
+
+// singles are toks themselves, pairs go to the thread arena
+char **toks2pairs_inplace (char **toks, char *prm) { return toks2pairs_dup (toks, prm, NULL); }
+
 void free_toks (char **toks) {
   if (!toks) return;
   char **t = toks-1, **end = toks+len(toks);
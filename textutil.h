@@ -97,6 +97,9 @@ void porter_stemmer (char *word, char *stem) ;
 void kstem_stemmer (char *word, char *stem) ;
 void arabic_stemmer (char *word, char *stem) ;
 void lowercase_stemmer (char *word, char *stem) ;
+void stem_cache_load (char *path) ; // preload FORM/STEM written by stem_cache_save
+void stem_cache_save (char *path) ; // preloaded + forms stemmed since load
+void stem_cache_stats (ulong *hits, ulong *misses) ; // stem_word K lookups
 void stem_word (char *word, char *stem, char *type) ;
 int stop_word (char *word) ;
 
@@ -104,6 +107,16 @@ char **str2toks (char *str, char *ws, uint maxlen) ;
 char *toks2str (char **toks) ; // ' '.join(toks)
 void stem_toks (char **toks, char *type) ;
 void stop_toks (char **toks) ;
+
+// Zero-copy tokens: pointers into the (modified) text, stems that do not
+// fit and pairs in a per-thread arena. Valid until the text is freed and
+// arena_reset() is called by the same thread. Free with free_vec, not free_toks.
+char **str2toks_inplace (char *str, char *ws, uint maxlen) ;
+void stem_toks_inplace (char **toks, char *type) ;
+void stop_toks_inplace (char **toks) ;
+char **toks2pairs_inplace (char **toks, char *prm) ;
+char *arena_strdup (char *s) ;
+void arena_reset () ;
 void keep_midsize_toks (char **toks, uint lo, uint hi) ;
 void keep_wordlike_toks (char **toks) ;
 char **text_to_toks (char *text, char *prm) ;
@@ -50,11 +50,10 @@ double msdiff (double *t) {
   return t0 ? (*t - t0) : 0;
 }
 
-// print time elapsed since last call
-void loglag(char *tag) {
-  static double t0 = 0;
-  double t1 = mstime(), lag = t1 - t0;
-  t0 = t1;
+// print time elapsed since *t0, reset *t0
+void loglag_at(double *t0, char *tag) {
+  double t1 = mstime(), lag = t1 - *t0;
+  *t0 = t1;
   if (!tag || !*tag) return;
   char *color = (lag > 1000 ? bg_MAGENTA :
 		 lag >  500 ? bg_CYAN :
@@ -69,8 +68,14 @@ void loglag(char *tag) {
   fputs(RESET" ",stderr);
 }
 
+// print time elapsed since last call (in this thread)
+void loglag(char *tag) {
+  static __thread double t0 = 0;
+  loglag_at (&t0, tag);
+}
+
 void loglag2(char *tag) {
-  static double t0 = 0;
+  static __thread double t0 = 0;
   double t1 = mstime(), lag = t1 - t0;
   t0 = t1;
   if (!tag || !*tag) return;
@@ -68,5 +68,6 @@ unsigned long ustime (); // time in microseconds since epoch
 double msdiff (double *T) ; // milliseconds since T, update T
 void loglag(char *tag) ; // log time elapsed since last call
 void loglag2(char *tag) ; // same, but 10x shorter intervals
+void loglag_at(double *t0, char *tag) ; // same, caller keeps the clock
 
 #endif
@@ -367,8 +367,10 @@ int cmp_xy_X (const void *n1, const void *n2) { // by decreasing x
 int cmp_x (const void *n1, const void *n2) { return -cmp_X (n1,n2); }
 int cmp_X (const void *n1, const void *n2) { return *((float*)n2) - *((float*)n1); }
 
-int cmp_u (const void *n1, const void *n2) { return -cmp_X (n1,n2); }
-int cmp_U (const void *n1, const void *n2) { return *((uint*)n2) - *((uint*)n1); }
+int cmp_u (const void *n1, const void *n2) { return -cmp_U (n1,n2); }
+int cmp_U (const void *n1, const void *n2) { // by decreasing uint
+  uint u1 = *(uint*)n1, u2 = *(uint*)n2;
+  return (u1 > u2) ? -1 : (u1 < u2) ? +1 : 0; }
 
 int cmp_str (const void *a, const void *b) { return strcmp(*(char**)a, *(char**)b); }
 
@@ -23,9 +23,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "types.h"
 #include "hash.h"
 #include "timeutil.h"
+#include "synq.h"
 
 // ---------------------------------------- z-standard
 
@@ -36,6 +38,29 @@ const char* ZSTD_getErrorName(size_t code);
 size_t ZSTD_compressBound(size_t srcSize);
 unsigned long long ZSTD_getDecompressedSize(const void* src, size_t srcSize);
 unsigned long long ZSTD_getFrameContentSize(const void *src, size_t srcSize);
+size_t ZSTD_findFrameCompressedSize(const void* src, size_t srcSize);
+
+typedef struct ZSTD_CCtx_s ZSTD_CCtx;
+typedef struct ZSTD_DCtx_s ZSTD_DCtx;
+typedef struct ZSTD_CDict_s ZSTD_CDict;
+typedef struct ZSTD_DDict_s ZSTD_DDict;
+ZSTD_CCtx* ZSTD_createCCtx(void);
+size_t ZSTD_freeCCtx(ZSTD_CCtx* cctx);
+ZSTD_DCtx* ZSTD_createDCtx(void);
+size_t ZSTD_freeDCtx(ZSTD_DCtx* dctx);
+ZSTD_CDict* ZSTD_createCDict(const void* dict, size_t dictSize, int lvl);
+size_t ZSTD_freeCDict(ZSTD_CDict* cdict);
+ZSTD_DDict* ZSTD_createDDict(const void* dict, size_t dictSize);
+size_t ZSTD_compress_usingCDict(ZSTD_CCtx* cctx, void* dst, size_t dstSz,
+				const void* src, size_t srcSz, const ZSTD_CDict* cdict);
+size_t ZSTD_decompress_usingDDict(ZSTD_DCtx* dctx, void* dst, size_t dstSz,
+				  const void* src, size_t srcSz, const ZSTD_DDict* ddict);
+unsigned ZSTD_getDictID_fromFrame(const void* src, size_t srcSize);
+unsigned ZSTD_getDictID_fromDict(const void* dict, size_t dictSize);
+size_t ZDICT_trainFromBuffer(void* dict, size_t dictCap,
+			     const void* samples, const size_t* sampleSizes, unsigned nbSamples);
+unsigned ZDICT_isError(size_t code);
+const char* ZDICT_getErrorName(size_t code);
 
 // if sz == error, print msg followed by zstd error.
 void zstd_assert (size_t sz, char *msg) {
@@ -199,3 +224,135 @@ void *get_string_zst (coll_t *c, uint id) {
   if (!len(zvec)) return NULL;
   return zvec_to_str(zvec);
 }
+
+// ---------------------------------------- document store
+
+// Every chunk is one zstd frame, compressed with a dictionary trained on a
+// sample of the documents (path/zstd.dict), so small documents shrink too
+// and each one decodes on its own. Plain chunks never start with the zstd
+// magic number followed by a dictionary id, so get_doc reads both kinds.
+
+#define ZSTD_MAGIC 0xFD2FB528
+#define ZSTD_CONTENTSIZE_UNKNOWN (0ULL - 1)
+#define ZSTD_CONTENTSIZE_ERROR   (0ULL - 2)
+
+typedef struct { uint id; ZSTD_DDict *dd; } zdict_t;
+static zdict_t *ZDICTS = NULL; // by dictionary id, never freed
+static volatile int zdicts_lk = 0;
+
+// dictionary id of the zstd frame in chunk, 0 if chunk is plain text
+static uint zdoc_dict_id (char *chunk, off_t sz) {
+  if (sz < 8 || *(uint*)chunk != ZSTD_MAGIC) return 0;
+  return ZSTD_getDictID_fromFrame (chunk, sz);
+}
+
+// decoding dictionary id of coll c, loaded from c->path/zstd.dict on first use
+static ZSTD_DDict *zdoc_dict (coll_t *c, uint id) {
+  ZSTD_DDict *dd = NULL; zdict_t *z; char x[9999];
+  lock (&zdicts_lk);
+  for (z = ZDICTS; z && z < ZDICTS + len(ZDICTS); ++z) if (z->id == id) dd = z->dd;
+  if (!dd && c->path && file_exists ("%s/zstd.dict", c->path)) {
+    byte *D = read_vec (fmt (x,"%s/zstd.dict",c->path));
+    if (ZSTD_getDictID_fromDict (D, len(D)) == id) {
+      zdict_t new = {id, ZSTD_createDDict (D, len(D))};
+      ZDICTS = append_vec (ZDICTS ? ZDICTS : new_vec (0, sizeof(zdict_t)), &new);
+      dd = new.dd;
+    }
+    free_vec (D);
+  }
+  unlock (&zdicts_lk);
+  if (!dd) fprintf (stderr, "[get_doc] %s/zstd.dict missing or not dictionary %u\n", c->path, id);
+  assert (dd);
+  return dd;
+}
+
+static pthread_key_t DCTX_KEY;
+static pthread_once_t DCTX_ONCE = PTHREAD_ONCE_INIT;
+static void free_dctx (void *D) { ZSTD_freeDCtx (D); }
+static void dctx_key_init () { pthread_key_create (&DCTX_KEY, free_dctx); }
+
+static ZSTD_DCtx *thread_dctx () {
+  pthread_once (&DCTX_ONCE, dctx_key_init);
+  ZSTD_DCtx *D = pthread_getspecific (DCTX_KEY);
+  if (!D) pthread_setspecific (DCTX_KEY, D = ZSTD_createDCtx ());
+  return D;
+}
+
+// malloc'd copy of document id, NULL if none
+char *get_doc (coll_t *c, uint id) {
+  char *chunk = id ? get_chunk (c, id) : NULL;
+  if (!chunk) return NULL;
+  off_t sz = c->path ? chunk_sz (c, id) : 0;
+  uint dict = zdoc_dict_id (chunk, sz);
+  if (!dict) return strdup (chunk);
+  size_t zsz = ZSTD_findFrameCompressedSize (chunk, sz);
+  zstd_assert (zsz, "get_doc");
+  unsigned long long n = ZSTD_getFrameContentSize (chunk, zsz);
+  if (n == ZSTD_CONTENTSIZE_UNKNOWN || n == ZSTD_CONTENTSIZE_ERROR) { // zdoc_build always sets it
+    fprintf (stderr, "[get_doc] %s[%u]: bad zstd frame, no content size\n", c->path, id);
+    return NULL;
+  }
+  char *doc = safe_malloc (n);
+  size_t got = ZSTD_decompress_usingDDict (thread_dctx(), doc, n, chunk, zsz, zdoc_dict (c, dict));
+  zstd_assert (got, "get_doc");
+  return doc;
+}
+
+// 1 if c holds zdoc frames (has a dictionary next to its chunks)
+int is_zdoc (coll_t *c) { return c->path && file_exists ("%s/zstd.dict", c->path); }
+
+// SRC/zstd.dict -> TRG/zstd.dict, so frames copied by chunk_sz still decode
+void zdoc_copy_dict (coll_t *SRC, char *TRG) {
+  char x[9999];
+  if (!is_zdoc (SRC)) return;
+  byte *D = read_vec (fmt (x,"%s/zstd.dict",SRC->path));
+  write_vec (D, fmt (x,"%s/zstd.dict",TRG));
+  free_vec (D);
+}
+
+// documents in SRC -> TRG + TRG/zstd.dict, same ids
+void zdoc_build (char *_SRC, char *_TRG, char *prm) {
+  uint dictsz = getprm (prm,"dict=",112640), level = getprm (prm,"level=",5);
+  uint sample = getprm (prm,"sample=",10000);
+  coll_t *SRC = open_coll (_SRC, "r+");
+  uint i, n = nvecs(SRC), step = MAX (1, n / MAX (1, sample));
+  char *S = new_vec (0, sizeof(char)), *doc, x[9999];
+  size_t *SZ = new_vec (0, sizeof(size_t)), sz, raw = 0, zip = 0;
+  for (i = 1; i <= n && len(S) < 100 * dictsz; i += step) { // ~100x dict is plenty
+    if (!(doc = get_doc (SRC, i))) continue;
+    S = append_many (S, doc, (sz = strlen (doc)));
+    SZ = append_vec (SZ, &sz);
+    free (doc);
+  }
+  byte *D = new_vec (dictsz, sizeof(byte));
+  size_t dsz = ZDICT_trainFromBuffer (D, dictsz, S, SZ, len(SZ));
+  free_vec (S); free_vec (SZ);
+  if (ZDICT_isError (dsz)) {
+    fprintf (stderr, "[zdoc] %s: no dictionary from %d docs: %s\n", _SRC, n, ZDICT_getErrorName (dsz));
+    free_vec (D); free_coll (SRC);
+    return;
+  }
+  len(D) = dsz;
+  coll_t *TRG = open_coll (_TRG, "w+");
+  write_vec (D, fmt (x,"%s/zstd.dict",_TRG));
+  ZSTD_CDict *cd = ZSTD_createCDict (D, dsz, level);
+  ZSTD_CCtx *cx = ZSTD_createCCtx ();
+  char *buf = NULL; size_t cap = 0;
+  for (i = 1; i <= n; ++i) {
+    if (!(doc = get_doc (SRC, i))) continue;
+    sz = strlen (doc) + 1;
+    if (ZSTD_compressBound (sz) > cap) buf = safe_realloc (buf, cap = ZSTD_compressBound (sz));
+    size_t z = ZSTD_compress_usingCDict (cx, buf, cap, doc, sz, cd);
+    zstd_assert (z, "zdoc");
+    put_chunk (TRG, i, buf, z);
+    raw += sz; zip += z;
+    free (doc);
+    show_progress (i, n, " docs");
+  }
+  fprintf (stderr, "[%.0fs] %s: %d docs, %ld -> %ld bytes + %ld dict\n",
+	   vtime(), _TRG, nvecs(TRG), raw, zip, dsz);
+  ZSTD_freeCDict (cd); ZSTD_freeCCtx (cx);
+  free (buf); free_vec (D);
+  free_coll (SRC); free_coll (TRG);
+}
+
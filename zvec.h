@@ -40,6 +40,12 @@ void put_chunk_zst (coll_t *c, uint id, void *chunk, size_t sz) ;
 void *get_chunk_zst (coll_t *c, uint id, size_t *sz) ;
 void *get_string_zst (coll_t *c, uint id) ;
 
+// document store: a zstd frame per doc, shared dictionary in path/zstd.dict
+void zdoc_build (char *SRC, char *TRG, char *prm) ; // dict=112640,level=5,sample=10000
+char *get_doc (coll_t *c, uint id) ; // malloc'd doc, zdoc or plain coll, thread-safe if "rs"
+int is_zdoc (coll_t *c) ; // c has path/zstd.dict
+void zdoc_copy_dict (coll_t *SRC, char *TRG) ; // needed when copying frames by chunk_sz
+
 // convert string to vector of bytes (resizeable string with length).
 byte *str_to_bytes(char *str) ;
 